@@ -10,7 +10,107 @@ from xml.etree import ElementTree as ET
 from collections import defaultdict
 import os, sys
 import json
+import math
 import re
+import struct
+
+# Vehicles can drive faster than the lane speed limit by their speed factor,
+# keep the lookahead safe for factors up to this
+MAX_SPEED_FACTOR = 2.0
+
+# Binary partition data, mapped by the partitions and used in place
+# (see src/PartitionData.cpp for the layout)
+PART_DATA_MAGIC = b"PSUMOPD\0"
+PART_DATA_VERSION = 1
+PART_DATA_HEADER = struct.Struct("<8sIid10I")
+# Header flags
+PART_DATA_HAS_ROUTES = 1
+
+def _fnv1a(data: bytes) -> int:
+    h = 2166136261
+    for b in data:
+        h = ((h ^ b) * 16777619) & 0xFFFFFFFF
+    return h
+
+class _PartDataWriter:
+    def __init__(self):
+        self.buf = bytearray(PART_DATA_HEADER.size)
+        self.string_index: dict[str, int] = {}
+        self.strings: list[bytes] = []
+
+    def string(self, s: str) -> int:
+        if s not in self.string_index:
+            self.string_index[s] = len(self.strings)
+            self.strings.append(s.encode())
+        return self.string_index[s]
+
+    def append(self, data: bytes) -> int:
+        # Everything 8 byte aligned, so doubles can be read in place
+        self.buf.extend(b"\0" * (-len(self.buf) % 8))
+        offset = len(self.buf)
+        self.buf.extend(data)
+        return offset
+
+    def hash_table(self, entries: list[tuple[int, int]]) -> int:
+        # Open addressing with linear probing, key is string index + 1 (0 is empty),
+        # at most half full
+        num_buckets = 2
+        while num_buckets < len(entries) * 2:
+            num_buckets *= 2
+        buckets = [(0, 0)] * num_buckets
+        for (key, value) in entries:
+            i = _fnv1a(self.strings[key]) & (num_buckets - 1)
+            while buckets[i][0] != 0:
+                i = (i + 1) & (num_buckets - 1)
+            buckets[i] = (key + 1, value)
+        return self.append(struct.pack(f"<II{num_buckets * 2}I", num_buckets, 0, *(x for b in buckets for x in b)))
+
+    def string_set(self, strings) -> int:
+        return self.hash_table([(self.string(s), 0) for s in set(strings)])
+
+def write_binary_part_data(path: str, data: dict):
+    w = _PartDataWriter()
+
+    neighbors = data['neighbors']
+    neighbor_entries = b"".join(
+        struct.pack("<iId", neigh_id,
+            w.string_set(data['neighborRoutes'].get(neigh_id, [])),
+            data['neighborLookahead'].get(neigh_id, math.nan))
+        for neigh_id in neighbors
+    )
+    neighbors_offset = w.append(neighbor_entries)
+
+    edge_entries = []
+    for edge in data['borderEdges']:
+        lanes = [w.string(lane) for lane in edge['lanes']]
+        lanes_offset = w.append(struct.pack(f"<{len(lanes)}I", *lanes))
+        edge_entries.append(struct.pack("<IiiII", w.string(edge['id']), edge['from'], edge['to'], len(lanes), lanes_offset))
+    border_edges_offset = w.append(b"".join(edge_entries))
+
+    route_ends = [(w.string(edge_id), w.string_set(routes)) for (edge_id, routes) in data['borderRouteEnds'].items()]
+    route_ends_offset = w.hash_table(route_ends)
+
+    routes = [w.string(route_id) for route_id in data['routes']]
+    routes_offset = w.append(struct.pack(f"<{len(routes)}I", *routes))
+
+    # String table last, after all strings were added
+    string_data = bytearray()
+    string_entries = []
+    string_data_offset = len(w.buf) + (-len(w.buf) % 8) + len(w.strings) * 8
+    for s in w.strings:
+        string_entries.append(struct.pack("<II", string_data_offset + len(string_data), len(s)))
+        string_data.extend(s)
+    strings_offset = w.append(b"".join(string_entries))
+    w.buf.extend(string_data)
+
+    PART_DATA_HEADER.pack_into(w.buf, 0, PART_DATA_MAGIC, PART_DATA_VERSION, data['id'], data['lastDepart'],
+        len(w.strings), strings_offset,
+        len(neighbors), neighbors_offset,
+        len(data['borderEdges']), border_edges_offset,
+        route_ends_offset,
+        len(routes), routes_offset, PART_DATA_HAS_ROUTES)
+    with open(path, 'wb') as f:
+        f.write(w.buf)
 
 class PartitionDataGen:
     num_parts: int
@@ -97,6 +197,9 @@ class PartitionDataGen:
     
     def __get_routes(self, neighbor_lists):
         part_routes = [[] for _ in range(self.num_parts)]
+        # Full ids, _partN included, so the partitions don't need to parse
+        # their route file again to find the multipart routes
+        part_full_routes = [[] for _ in range(self.num_parts)]
         for part_idx in range(self.num_parts):
             route_file = self.routefiles[part_idx]
             root = route_file.getroot()
@@ -104,13 +207,14 @@ class PartitionDataGen:
                 route_id = route.attrib['id']
                 id_no_part = re.sub(r'_part\d+', '', route_id)
                 part_routes[part_idx].append(id_no_part)
+                part_full_routes[part_idx].append(route_id)
                 
         part_neighbor_routes = [
             {neigh_id: part_routes[neigh_id] for neigh_id in neighbor_lists[part_idx]} 
             for part_idx in range(self.num_parts)
         ]
                 
-        return part_neighbor_routes
+        return part_neighbor_routes, part_full_routes
     
     def __get_route_ends(self, border_edges: list[list[dict]]):
         # for every border edge in every part, 
@@ -150,24 +254,91 @@ class PartitionDataGen:
             out.append(val)
         return out
 
+    def __get_neighbor_lookaheads(self):
+        # For each pair of neighbors, the least time (in seconds) a vehicle
+        # needs to cross any border edge between them; partitions can run this
+        # long without synchronizing, as handed off vehicles are still in the edge
+        # Also returns the least of all and its edge, the longest window all
+        # partitions can use (see --sync-interval)
+        part_lookaheads = [{} for _ in range(self.num_parts)]
+        min_lookahead = (math.inf, None)
+        for id in self.edge_parts:
+            (p1, p2) = self.edge_parts[id]
+            edge_el = self.netfiles[p1].getroot().find(f".//edge[@id='{id}']")
+            travel_time = min(
+                float(lane_el.get("length")) / (float(lane_el.get("speed")) * MAX_SPEED_FACTOR)
+                for lane_el in edge_el.findall("lane")
+            )
+            for (a, b) in ((p1, p2), (p2, p1)):
+                part_lookaheads[a][b] = min(part_lookaheads[a].get(b, travel_time), travel_time)
+            min_lookahead = min(min_lookahead, (travel_time, id), key=lambda x: x[0])
+        return part_lookaheads, min_lookahead
+
+    def __get_id_table(self, border_edges: list[list[dict]]):
+        # Ids that can be sent between partitions, shared by all of them
+        # so that messages can use their index instead of the string
+        routes = set()
+        vehicle_types = {"DEFAULT_VEHTYPE"}
+        for part_idx in range(self.num_parts):
+            root = self.routefiles[part_idx].getroot()
+            for route in root.findall("route"):
+                routes.add(re.sub(r'_part\d+', '', route.attrib['id']))
+            for vtype in root.findall("vType"):
+                vehicle_types.add(vtype.attrib['id'])
+            for el in root:
+                if "type" in el.attrib:
+                    vehicle_types.add(el.attrib["type"])
+                    
+        lanes = set()
+        edges = set()
+        for border_edges_ls in border_edges:
+            for edge in border_edges_ls:
+                edges.add(edge["id"])
+                lanes.update(edge["lanes"])
+                
+        return {
+            'routes': sorted(routes),
+            'vehicleTypes': sorted(vehicle_types),
+            'lanes': sorted(lanes),
+            'edges': sorted(edges),
+        }
+
     def generate_partition_data(self):
         self.__load()
         border_edges = self.__find_border_edges()
         neighbor_lists = self.__find_part_neighbors()
-        part_neighbor_routes = self.__get_routes(neighbor_lists)
+        part_neighbor_routes, part_full_routes = self.__get_routes(neighbor_lists)
         part_route_ends = self.__get_route_ends(border_edges)
         part_last_depart_times = self.__get_last_depart_times()
+        part_lookaheads, (min_lookahead, min_lookahead_edge) = self.__get_neighbor_lookaheads()
         
         for part_id in range(self.num_parts):
+            part_data = {
+                'id': part_id,
+                'borderEdges': border_edges[part_id],
+                'neighbors': neighbor_lists[part_id],
+                'neighborRoutes': part_neighbor_routes[part_id],
+                # Always written, even if empty: partitions only read their
+                # route file when the key is missing (older data)
+                'routes': part_full_routes[part_id],
+                'borderRouteEnds': part_route_ends[part_id],
+                'lastDepart': part_last_depart_times[part_id],
+                'neighborLookahead': part_lookaheads[part_id],
+            }
+            # JSON kept for inspection and older partition executables,
+            # the binary one is used when present
             path = os.path.join(self.data_folder, f"partData{part_id}.json")
             with open(path, 'w') as f:
-                json.dump({
-                    'id': part_id,
-                    'borderEdges': border_edges[part_id],
-                    'neighbors': neighbor_lists[part_id],
-                    'neighborRoutes': part_neighbor_routes[part_id],
-                    'borderRouteEnds': part_route_ends[part_id],
-                    'lastDepart': part_last_depart_times[part_id],
-                }, f)
+                json.dump(part_data, f)
+            write_binary_part_data(os.path.join(self.data_folder, f"partData{part_id}.bin"), part_data)
+                
+        id_table = self.__get_id_table(border_edges)
+        path = os.path.join(self.data_folder, "idTable.json")
+        with open(path, 'w') as f:
+            json.dump(id_table, f)
                 
-        print(f"Saved edge data to json for {self.num_parts} partitions")
\ No newline at end of file
+        print(f"Saved edge data to json for {self.num_parts} partitions")
+        if min_lookahead_edge is not None:
+            # Step length is only known by the partitions, which check it per neighbor
+            print(f"Safe sync window: {min_lookahead:.2f}s (border edge {min_lookahead_edge}), "
+                  f"use --sync-interval up to {min_lookahead:.2f} / step length")
\ No newline at end of file
@@ -0,0 +1,93 @@
+/**
+EdgeOccupancyTracker.cpp
+
+Finds the vehicles that entered and left a set of edges between two scans,
+in time linear in the vehicles in each edge.
+
+Author: Filippo Lenzi
+*/
+
+#include "EdgeOccupancyTracker.hpp"
+
+using namespace std;
+
+namespace psumo {
+
+bool EdgeOccupancyTracker::visit(int edge, string_view vehId) {
+    int number;
+    auto it = vehicleNumbers.find(vehId);
+    if (it == vehicleNumbers.end()) {
+        if (!freeNumbers.empty()) {
+            number = freeNumbers.back();
+            freeNumbers.pop_back();
+            vehicleIds[number] = vehId;
+            vehicleEdge[number] = -1;
+            vehicleScan[number] = -1;
+        } else {
+            number = vehicleIds.size();
+            vehicleIds.emplace_back(vehId);
+            vehicleEdge.push_back(-1);
+            vehicleScan.push_back(-1);
+            vehicleLists.push_back(0);
+        }
+        vehicleNumbers.emplace(vehId, number);
+    } else {
+        number = it->second;
+    }
+
+    auto& state = edges[edge];
+    bool entered = vehicleEdge[number] != edge || vehicleScan[number] != state.lastScan;
+    vehicleEdge[number] = edge;
+    vehicleScan[number] = scan;
+    state.current.push_back(number);
+    vehicleLists[number]++;
+    return entered;
+}
+
+void EdgeOccupancyTracker::releaseUnlisted() {
+    for (int number : unlisted) {
+        // Unless seen again since
+        if (vehicleLists[number] > 0) continue;
+        vehicleNumbers.erase(vehicleIds[number]);
+        freeNumbers.push_back(number);
+    }
+    unlisted.clear();
+}
+
+const vector<int>& EdgeOccupancyTracker::finishEdge(int edge) {
+    releaseUnlisted();
+    auto& state = edges[edge];
+
+    // Left if not seen again in this scan in the same edge
+    exited.clear();
+    for (int number : state.previous) {
+        if (vehicleEdge[number] != edge || vehicleScan[number] != scan) {
+            exited.push_back(number);
+        }
+        if (--vehicleLists[number] == 0) unlisted.push_back(number);
+    }
+
+    state.previous.swap(state.current);
+    state.current.clear();
+    state.lastScan = scan;
+    return exited;
+}
+
+void EdgeOccupancyTracker::reset() {
+    for (auto& state : edges) {
+        state.current.clear();
+        state.previous.clear();
+        state.lastScan = -1;
+    }
+    // No vehicle is in a list anymore
+    vehicleNumbers.clear();
+    vehicleIds.clear();
+    vehicleEdge.clear();
+    vehicleScan.clear();
+    vehicleLists.clear();
+    freeNumbers.clear();
+    unlisted.clear();
+    scan++;
+}
+
+}
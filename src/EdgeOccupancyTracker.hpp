@@ -0,0 +1,69 @@
+/**
+EdgeOccupancyTracker.hpp
+
+Finds the vehicles that entered and left a set of edges between two scans,
+in time linear in the vehicles in each edge.
+
+Author: Filippo Lenzi
+*/
+
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "psumoTypes.hpp"
+
+namespace psumo {
+
+/**
+Vehicles are given an integer number the first time they are seen,
+and stamped with the edge and scan they were last seen in: a vehicle
+is new to an edge if it was not stamped with the edge's previous scan.
+Once a vehicle is in none of the edges' lists (edges not visited in a scan
+keep theirs), its number is released and given to the next new vehicle, so
+memory follows the vehicles in the edges and not all the ones ever seen.
+*/
+class EdgeOccupancyTracker {
+private:
+    typedef struct {
+        // Vehicles seen in the current and previous scan of the edge,
+        // swapped at each scan to reuse the memory
+        std::vector<int> current;
+        std::vector<int> previous;
+        int lastScan = -1;
+    } edge_state_t;
+
+    std::vector<edge_state_t> edges;
+    string_map<int> vehicleNumbers;
+    std::vector<std::string> vehicleIds;
+    std::vector<int> vehicleEdge;
+    std::vector<int> vehicleScan;
+    // Edge lists, current or previous, each vehicle is in
+    std::vector<int> vehicleLists;
+    std::vector<int> freeNumbers;
+    // In no list since the last finishEdge, released at the next
+    // call to keep the returned numbers valid until then
+    std::vector<int> unlisted;
+    std::vector<int> exited;
+    int scan = 0;
+
+    void releaseUnlisted();
+public:
+    void resize(int numEdges) { edges.resize(numEdges); }
+    // Start a new scan, edges not visited in it keep their previous state
+    void beginScan() { scan++; }
+    // Call for each vehicle in the edge, returns true if it was not
+    // in it at the edge's previous scan
+    bool visit(int edge, std::string_view vehId);
+    // Call after visiting all of the edge's vehicles; returns the numbers
+    // of the vehicles that left it since the previous scan, valid until
+    // the next call (see getVehicleId)
+    const std::vector<int>& finishEdge(int edge);
+    const std::string& getVehicleId(int number) const { return vehicleIds[number]; }
+    // Forget the previous scans, all vehicles will be new at the next one
+    void reset();
+};
+
+}
@@ -0,0 +1,234 @@
+/**
+HandlerReactor.cpp
+
+Single thread serving the messages of all the neighbors of a partition,
+used instead of one thread per NeighborPartitionHandler with --handlers reactor.
+
+Author: Filippo Lenzi
+*/
+
+#include "HandlerReactor.hpp"
+
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+#include "ContextPool.hpp"
+#include "messagingShared.hpp"
+#include "NeighborPartitionHandler.hpp"
+#include "Tracer.hpp"
+
+using namespace std;
+
+namespace psumo {
+
+HandlerReactor::HandlerReactor(const Args& args, partId_t id):
+    id(id),
+    args(args),
+    zcontext(ContextPool::newContext(1)),
+    socket(makeSocket(zcontext, zmq::socket_type::router)),
+    controlSocketMain(makeSocket(zcontext, zmq::socket_type::pair)),
+    controlSocketThread(makeSocket(zcontext, zmq::socket_type::pair)),
+    term(false),
+    bound(false)
+{}
+
+HandlerReactor::~HandlerReactor() {
+    stop();
+    delete socket;
+    for (auto& [neighborId, neighbor] : neighbors) {
+        delete neighbor.asyncSocket;
+    }
+    delete controlSocketMain;
+    delete controlSocketThread;
+}
+
+ServerTransport* HandlerReactor::addNeighbor(partId_t neighbor, NeighborPartitionHandler* handler) {
+    neighbors[neighbor] = {neighbor, handler, makeSocket(zcontext, zmq::socket_type::pull), false, TransportMessage()};
+    return new ReactorServerTransport(*this, neighbor);
+}
+
+void HandlerReactor::start() {
+    stringstream controlUri;
+    controlUri << "inproc://reactor" << id;
+    const string& host = getPartitionHost(args.partitionHosts, id);
+    try {
+        psumo::bind(*socket, getReactorSocketName(args.dataDir, host, id, args.transportType));
+        for (auto& [neighborId, neighbor] : neighbors) {
+            psumo::bind(*neighbor.asyncSocket,
+                getAsyncSocketName(args.dataDir, host, neighborId, id, args.numThreads, args.transportType));
+        }
+        psumo::bind(*controlSocketThread, controlUri.str());
+        psumo::connect(*controlSocketMain, controlUri.str());
+    } catch (zmq::error_t& e) {
+        logerr("ZMQ error in binding sockets: {}/{}\n", e.what(), e.num());
+        exit(EXIT_FAILURE);
+    }
+    bound = true;
+
+    thread = std::thread(&HandlerReactor::loop, this);
+}
+
+void HandlerReactor::stop() {
+    if (!bound) return;
+
+    log("Terminating...\n");
+    term = true;
+    wake("stop");
+    if (thread.joinable()) thread.join();
+
+    close(*socket);
+    for (auto& [neighborId, neighbor] : neighbors) {
+        close(*neighbor.asyncSocket);
+    }
+    close(*controlSocketMain);
+    close(*controlSocketThread);
+    bound = false;
+}
+
+void HandlerReactor::wake(const string& reason) {
+    if (!bound) return;
+    controlSocketMain->send(zmq::message_t(reason.data(), reason.size()), zmq::send_flags::none);
+}
+
+void HandlerReactor::loop() {
+    Tracer::nameThread("reactor");
+    // Control and request sockets, then the async socket of each neighbor
+    vector<zmq::pollitem_t> pollitems = {
+        { castPollSocket(*controlSocketThread), 0, ZMQ_POLLIN, 0 },
+        { castPollSocket(*socket), 0, ZMQ_POLLIN, 0 }
+    };
+    vector<neighbor_state_t*> asyncNeighbors;
+    for (auto& [neighborId, neighbor] : neighbors) {
+        pollitems.push_back({ castPollSocket(*neighbor.asyncSocket), 0, ZMQ_POLLIN, 0 });
+        asyncNeighbors.push_back(&neighbor);
+    }
+
+    try {
+        while (!term) {
+            // Messages the handler can not take yet stay in the transport,
+            // until it wakes the reactor
+            for (size_t i = 0; i < asyncNeighbors.size(); i++) {
+                pollitems[2 + i].events = asyncNeighbors[i]->handler->canServeAsync() ? ZMQ_POLLIN : 0;
+            }
+
+            int rc = zmq::poll(pollitems);
+            if (rc == -1) {
+                logerr("[WARN] poll interrupted\n");
+                continue;
+            }
+
+            if (pollitems[0].revents & ZMQ_POLLIN) {
+                zmq::message_t control;
+                [[maybe_unused]] auto _ = controlSocketThread->recv(control, zmq::recv_flags::none);
+                log("Woken up: {}\n", string(static_cast<char*>(control.data()), control.size()));
+                serveDeferred();
+            }
+            if (pollitems[1].revents & ZMQ_POLLIN) {
+                receiveRequest();
+            }
+            for (size_t i = 0; i < asyncNeighbors.size(); i++) {
+                if (pollitems[2 + i].revents & ZMQ_POLLIN) {
+                    receiveAsync(*asyncNeighbors[i]);
+                }
+            }
+        }
+    } catch(zmq::error_t& e) {
+        logerr("ZMQ error: {}/{}\n=== {} QUITTING ===\n", e.what(), e.num(), getPid());
+        exit(EXIT_FAILURE);
+    }
+}
+
+HandlerReactor::neighbor_state_t* HandlerReactor::findNeighbor(const zmq::message_t& senderId) {
+    string sender(static_cast<const char*>(senderId.data()), senderId.size());
+    auto it = neighbors.find(stoi(sender));
+    if (it == neighbors.end()) {
+        logerr("[WARN] Message from {}, which is not a neighbor\n", sender);
+        return nullptr;
+    }
+    return &it->second;
+}
+
+void HandlerReactor::receiveRequest() {
+    // Routing id, empty delimiter, then the request as sent by the REQ socket
+    zmq::message_t senderId, delimiter;
+    TransportMessage request;
+    [[maybe_unused]] auto _ = socket->recv(senderId, zmq::recv_flags::none);
+    _ = socket->recv(delimiter, zmq::recv_flags::none);
+    _ = socket->recv(request.zmqMessage(), zmq::recv_flags::none);
+
+    auto neighbor = findNeighbor(senderId);
+    if (neighbor == nullptr) return;
+
+    // Can still be refused if the handler started applying operations
+    if (!neighbor->handler->canServeRequests() || !neighbor->handler->serveRequest(request)) {
+        log("Deferring request from {}\n", neighbor->handler->getClientId());
+        neighbor->deferredRequest = std::move(request);
+        neighbor->hasDeferredRequest = true;
+    }
+}
+
+void HandlerReactor::receiveAsync(neighbor_state_t& neighbor) {
+    // Only polled when the handler can take it, one message at a time
+    // to check again before the next
+    TransportMessage message;
+    [[maybe_unused]] auto _ = neighbor.asyncSocket->recv(message.zmqMessage(), zmq::recv_flags::none);
+    neighbor.handler->serveAsync(message);
+}
+
+void HandlerReactor::serveDeferred() {
+    for (auto& [neighborId, neighbor] : neighbors) {
+        if (neighbor.hasDeferredRequest && neighbor.handler->canServeRequests()
+            && neighbor.handler->serveRequest(neighbor.deferredRequest)
+        ) {
+            neighbor.hasDeferredRequest = false;
+        }
+    }
+}
+
+void HandlerReactor::sendReply(partId_t neighbor, TransportMessage& reply) {
+    string sender = to_string(neighbor);
+    socket->send(zmq::message_t(sender.data(), sender.size()), zmq::send_flags::sndmore);
+    socket->send(zmq::message_t(), zmq::send_flags::sndmore);
+    socket->send(reply.zmqMessage(), zmq::send_flags::none);
+}
+
+ServerTransport::PollEvent ReactorServerTransport::poll(bool, bool) {
+    throw logic_error("Reactor handler transports are not polled");
+}
+
+void ReactorServerTransport::receiveRequest(TransportMessage&) {
+    throw logic_error("Reactor handler transports do not receive");
+}
+
+void ReactorServerTransport::receiveAsync(TransportMessage&) {
+    throw logic_error("Reactor handler transports do not receive");
+}
+
+template<typename... _Args>
+void HandlerReactor::log(std::format_string<_Args...> format, _Args&&... args_) {
+    if (!args.verbose) return;
+
+    std::stringstream msg;
+    msg << "\tPart. reactor " << id << " | ";
+    std::format_to(
+        std::ostreambuf_iterator<char>(msg),
+        std::forward<std::format_string<_Args...>>(format),
+        std::forward<_Args>(args_)...
+    );
+    std::cout << msg.str();
+}
+
+template<typename... _Args>
+void HandlerReactor::logerr(std::format_string<_Args...> format, _Args&&... args_) {
+    std::stringstream msg;
+    msg << "\tPart. reactor " << id << " | ";
+    std::format_to(
+        std::ostreambuf_iterator<char>(msg),
+        std::forward<std::format_string<_Args...>>(format),
+        std::forward<_Args>(args_)...
+    );
+    std::cerr << msg.str();
+}
+
+}
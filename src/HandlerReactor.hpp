@@ -0,0 +1,111 @@
+/**
+HandlerReactor.hpp
+
+Single thread serving the messages of all the neighbors of a partition,
+used instead of one thread per NeighborPartitionHandler with --handlers reactor.
+
+Author: Filippo Lenzi
+*/
+
+#pragma once
+
+#include <atomic>
+#include <format>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <zmq.hpp>
+
+#include "args.hpp"
+#include "psumoTypes.hpp"
+#include "Transport.hpp"
+
+namespace psumo {
+
+class NeighborPartitionHandler;
+
+/**
+One ROUTER socket receives the requests of all neighbors (tagged with the
+sender's id, see ZmqClientTransport), and each neighbor has its own PULL
+socket for its async messages, as in thread mode; each message is passed to
+the neighbor's handler on the reactor thread. The handlers keep their
+buffering semantics: a neighbor's PULL socket is only polled while its
+handler can take async messages (not after its step fence or with a full
+queue), so the others wait in the transport, up to its high water mark,
+and a request it can not take yet is kept until the handler wakes the
+reactor after applying its operations or listening again.
+*/
+class HandlerReactor {
+private:
+    typedef struct {
+        partId_t id;
+        NeighborPartitionHandler* handler;
+        zmq::socket_t* asyncSocket;
+        // The neighbor waits for the reply, so at most one
+        bool hasDeferredRequest;
+        TransportMessage deferredRequest;
+    } neighbor_state_t;
+
+    const partId_t id;
+    const Args& args;
+    zmq::context_t& zcontext;
+    zmq::socket_t* socket;
+    zmq::socket_t* controlSocketMain;
+    zmq::socket_t* controlSocketThread;
+    std::unordered_map<partId_t, neighbor_state_t> neighbors;
+    std::thread thread;
+    std::atomic<bool> term;
+    bool bound;
+
+    void loop();
+    void receiveRequest();
+    void receiveAsync(neighbor_state_t& neighbor);
+    // Serve the deferred requests the handlers can take now
+    void serveDeferred();
+    neighbor_state_t* findNeighbor(const zmq::message_t& senderId);
+
+    template<typename... _Args >
+        void log(std::format_string<_Args...> format, _Args&&... args);
+    template<typename... _Args >
+        void logerr(std::format_string<_Args...> format, _Args&&... args);
+public:
+    HandlerReactor(const Args& args, partId_t id);
+    ~HandlerReactor();
+
+    zmq::context_t& getContext() { return zcontext; }
+    // Transport for the handler of a neighbor, its replies go through
+    // the shared socket; call before start
+    ServerTransport* addNeighbor(partId_t neighbor, NeighborPartitionHandler* handler);
+    // Bind the sockets and start the thread
+    void start();
+    void stop();
+    // From any thread, to serve the deferred requests and check
+    // again which async sockets to poll
+    void wake(const std::string& reason);
+    // Reactor thread only, while serving a request from the neighbor
+    void sendReply(partId_t neighbor, TransportMessage& reply);
+};
+
+/**
+Handler side of a link when using a reactor: messages are received by
+the reactor, which calls the handler, so only replies and wake are used.
+*/
+class ReactorServerTransport : public ServerTransport {
+private:
+    HandlerReactor& reactor;
+    const partId_t neighbor;
+public:
+    ReactorServerTransport(HandlerReactor& reactor, partId_t neighbor): reactor(reactor), neighbor(neighbor) {}
+
+    // Bound and closed by the reactor
+    void bind() override {}
+    void close() override {}
+    PollEvent poll(bool readAsync, bool readRequests) override;
+    void receiveRequest(TransportMessage& request) override;
+    void receiveAsync(TransportMessage& message) override;
+    void sendReply(TransportMessage& reply) override { reactor.sendReply(neighbor, reply); }
+    void wake(const std::string& reason) override { reactor.wake(reason); }
+};
+
+}
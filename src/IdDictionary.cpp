@@ -0,0 +1,98 @@
+/**
+IdDictionary.cpp
+
+Map the string ids sent between partitions (vehicles, routes, vehicle types, lanes)
+to integers, to send those instead of the strings.
+
+Author: Filippo Lenzi
+*/
+
+#include "IdDictionary.hpp"
+
+#include <stdexcept>
+#include <string>
+
+using namespace std;
+
+namespace psumo {
+
+IdTable::IdTable(const vector<string>& strings):
+    strings(strings)
+{
+    ids.reserve(strings.size());
+    for (wireId_t i = 0; i < strings.size(); i++) {
+        ids[strings[i]] = i;
+    }
+}
+
+bool IdTable::find(string_view str, wireId_t& id) const {
+    auto it = ids.find(str);
+    if (it == ids.end()) return false;
+    id = it->second;
+    return true;
+}
+
+IdDictionary::IdDictionary(const IdTable& table):
+    table(table)
+{}
+
+wireId_t IdDictionary::encode(string_view str, vector<pair<wireId_t, string_view>>& newDefinitions) {
+    wireId_t id;
+    if (table.find(str, id)) return id;
+
+    auto it = dynamicIds.find(str);
+    if (it != dynamicIds.end()) return it->second;
+
+    string* stored;
+    if (!freeIds.empty()) {
+        id = freeIds.back();
+        freeIds.pop_back();
+        stored = &dynamicStrings[id - table.size()];
+        *stored = str;
+    } else {
+        id = table.size() + dynamicStrings.size();
+        stored = &dynamicStrings.emplace_back(str);
+    }
+    dynamicIds.emplace(*stored, id);
+    newDefinitions.push_back({id, *stored});
+    return id;
+}
+
+void IdDictionary::release(string_view str) {
+    auto it = dynamicIds.find(str);
+    if (it == dynamicIds.end()) return;
+    freeIds.push_back(it->second);
+    dynamicIds.erase(it);
+}
+
+void IdDictionary::define(wireId_t id, string_view str, uint64_t queuedCount) {
+    size_t index = id - table.size();
+    if (index >= definedStrings.size()) {
+        definedStrings.resize(index + 1);
+    }
+    // Operations queued before this can still point to the previous string
+    if (definedStrings[index] != nullptr) {
+        replacedStrings.push_back({queuedCount, std::move(definedStrings[index])});
+    }
+    definedStrings[index] = make_unique<string>(str);
+}
+
+void IdDictionary::dropReplaced(uint64_t takenCount) {
+    // The main thread uses an operation until it takes the next one
+    while (!replacedStrings.empty() && replacedStrings.front().first < takenCount) {
+        replacedStrings.pop_front();
+    }
+}
+
+const string& IdDictionary::decode(wireId_t id) const {
+    if (id < table.size()) {
+        return table.get(id);
+    }
+    size_t index = id - table.size();
+    if (index >= definedStrings.size() || definedStrings[index] == nullptr) {
+        throw out_of_range("Id " + to_string(id) + " not defined on link");
+    }
+    return *definedStrings[index];
+}
+
+}
@@ -0,0 +1,88 @@
+/**
+IdDictionary.hpp
+
+Map the string ids sent between partitions (vehicles, routes, vehicle types, lanes)
+to integers, to send those instead of the strings.
+
+Author: Filippo Lenzi
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "psumoTypes.hpp"
+
+namespace psumo {
+
+typedef uint32_t wireId_t;
+
+/**
+Ids known by all partitions from the start, generated by the partitioning
+script (see idTable.json in the data folder), in the same order for everyone.
+*/
+class IdTable {
+private:
+    std::vector<std::string> strings;
+    string_map<wireId_t> ids;
+public:
+    IdTable() {}
+    IdTable(const std::vector<std::string>& strings);
+
+    // Returns false if the string is not in the table
+    bool find(std::string_view str, wireId_t& id) const;
+    const std::string& get(wireId_t id) const { return strings[id]; }
+    size_t size() const { return strings.size(); }
+};
+
+/**
+Ids for a single link between two partitions, in one direction. Starts from
+the static ids, strings not in the table are given the next free id the first
+time they are sent, and the definition must be sent together with it. The
+receiver then defines it on its side, so later messages can use only the id.
+As messages on a link are received in order, definitions always arrive
+before their ids are used.
+Strings only used once, like the ids of the vehicles handed off, are released
+by the sender after sending them, and their ids given to the next new strings;
+the receiver learns it from the new definition, and keeps the string it
+replaces until the operations queued before it are applied.
+*/
+class IdDictionary {
+private:
+    const IdTable& table;
+    // Sender side, in a deque so views to them stay valid when more are added
+    std::deque<std::string> dynamicStrings;
+    string_map<wireId_t> dynamicIds;
+    std::vector<wireId_t> freeIds;
+    // Receiver side, by id minus the table size; queued operations point to them
+    std::vector<std::unique_ptr<std::string>> definedStrings;
+    // Strings replaced by a new definition, with the count of operations
+    // queued when they were replaced
+    std::deque<std::pair<uint64_t, std::unique_ptr<std::string>>> replacedStrings;
+public:
+    IdDictionary(const IdTable& table);
+
+    // Sender side: get the id for the string, adding it to newDefinitions if
+    // it is the first time it is sent on the link (views into the dictionary)
+    wireId_t encode(std::string_view str, std::vector<std::pair<wireId_t, std::string_view>>& newDefinitions);
+    // Sender side: the string will not be sent again soon, its id can be
+    // given to another one; call after the message using it was written
+    void release(std::string_view str);
+
+    // Receiver side: queuedCount is the count of operations queued so far,
+    // the string the id had before is kept until they are all taken
+    void define(wireId_t id, std::string_view str, uint64_t queuedCount);
+    const std::string& decode(wireId_t id) const;
+    // Drop the replaced strings no operation still queued can point to,
+    // takenCount being the count of operations taken from the queue
+    void dropReplaced(uint64_t takenCount);
+};
+
+}
@@ -10,68 +10,77 @@ Author: Filippo Lenzi
 #include "NeighborPartitionHandler.hpp"
 
 #include <chrono>
+#include <cmath>
 #include <condition_variable>
 #include <cstdio>
 #include <cstdlib>
 #include <libsumo/TraCIDefs.h>
+#include <libsumo/Simulation.h>
 #include <sstream>
 #include <zmq.hpp>
 #include <thread>
 #include <string>
 #include <mutex>
+#include <variant>
 
 #include "messagingShared.hpp"
 #include "src/ContextPool.hpp"
 #include "src/PartitionEdgesStub.hpp"
 #include "utils.hpp"
 #include "PartitionManager.hpp"
+#include "Tracer.hpp"
 
 using namespace std;
 using namespace psumo;
 
-NeighborPartitionHandler::NeighborPartitionHandler(PartitionManager& owner, int clientId) :
-    owner(owner),
+NeighborPartitionHandler::NeighborPartitionHandler(PartitionManager& owner, int clientId, HandlerReactor* reactor) :
+    reactor(reactor),
+    zcontext(reactor != nullptr ? reactor->getContext() : ContextPool::newContext(1)),
     clientId(clientId),
+    owner(owner),
+    threadWaiting(false),
     listening(false),
     stop_(false),
     term(false),
-    threadWaiting(false),
-    zcontext(ContextPool::newContext(1))
+    fenceReceived(false),
+    neighborDone(false),
+    maxQueuedOperations(owner.getArgs().maxQueuedOps),
+    queueFull(false),
+    queueFullPauses(0),
+    neighborDoneTaken(false),
+    ackedVehicles(0),
+    receiveIds(owner.getIdTable()),
+    applying(false)
 {
-    socket = makeSocket(zcontext, zmq::socket_type::rep);
-    controlSocketMain = makeSocket(zcontext, zmq::socket_type::pair);
-    controlSocketThread = makeSocket(zcontext, zmq::socket_type::pair);
+    if (reactor != nullptr) {
+        transport = reactor->addNeighbor(clientId, this);
+    } else {
+        transport = makeServerTransport(owner.getArgs().transportType, zcontext, 
+            owner.getArgs().dataDir, getPartitionHost(owner.getArgs().partitionHosts, owner.getId()),
+            clientId, owner.getId(), owner.getNumThreads());
+    }
 }
 
-const int DISCONNECT_CONTEXT_TERMINATED_ERR = 156384765;
-    
 NeighborPartitionHandler::~NeighborPartitionHandler() {
     stop();
-    delete socket;
-    delete controlSocketMain;
-    delete controlSocketThread;
+    delete transport;
 }
 
 void NeighborPartitionHandler::start() {
-    const string socketUri = psumo::getSocketName(owner.getArgs().dataDir, clientId, owner.getId(), owner.getNumThreads());
     try {
-        bind(*socket, socketUri);
+        transport->bind();
     } catch (zmq::error_t& e) {
-        logerr("ZMQ error in binding socket {} to {}: {}/{}\n", clientId, socketUri, e.what(), e.num());
+        logerr("ZMQ error in binding sockets for {}: {}/{}\n", clientId, e.what(), e.num());
         exit(EXIT_FAILURE);
-    }
-    try {
-        stringstream uris;
-        uris << "inproc://nb" << clientId << "-" << owner.getId();
-        auto uri = uris.str();
-        bind(*controlSocketThread, uri);
-        connect(*controlSocketMain, uri);
-    } catch (zmq::error_t& e) {
-        logerr("ZMQ error in binding inproc sockets: {}/{}\n", e.what(), e.num());
+    } catch (runtime_error& e) {
+        logerr("Error in creating shared memory link for {}: {}\n", clientId, e.what());
         exit(EXIT_FAILURE);
     }
 
-    listenThread = thread(&NeighborPartitionHandler::listenThreadLogic, this);
+    // The reactor's thread serves it instead
+    if (reactor == nullptr) {
+        listenThread = thread(&NeighborPartitionHandler::listenThreadLogic, this);
+    }
 }
 
 void NeighborPartitionHandler::stop() {
@@ -80,37 +89,11 @@ void NeighborPartitionHandler::stop() {
     log("Terminating...\n");
     term = true;
     stop_ = true;
-    controlSocketMain->send(zmq::str_buffer("stop"), zmq::send_flags::none);
+    transport->wake("stop");
 
     join();
     
-    try {
-        close(*socket);
-    } catch (zmq::error_t& e) {
-        // If the context is already terminated, then not a problem if it didn't disconnect
-        if (e.num() != DISCONNECT_CONTEXT_TERMINATED_ERR) {
-            stringstream msg;
-            logerr("Error in disconnecting socket during destructor: {}/{}\n", e.what(), e.num());
-        }
-    }
-    try {
-        close(*controlSocketMain);
-    } catch (zmq::error_t& e) {
-        // If the context is already terminated, then not a problem if it didn't disconnect
-        if (e.num() != DISCONNECT_CONTEXT_TERMINATED_ERR) {
-            stringstream msg;
-            logerr("Error in disconnecting socket during destructor: {}/{}\n", e.what(), e.num());
-        }
-    }
-    try {
-        close(*controlSocketThread);
-    } catch (zmq::error_t& e) {
-        // If the context is already terminated, then not a problem if it didn't disconnect
-        if (e.num() != DISCONNECT_CONTEXT_TERMINATED_ERR) {
-            stringstream msg;
-            logerr("Error in disconnecting socket during destructor: {}/{}\n", e.what(), e.num());
-        }
-    }
+    transport->close();
 }
 
 void NeighborPartitionHandler::join() {
@@ -128,6 +111,8 @@ void NeighborPartitionHandler::listenOn() {
     listening = true;
     stop_ = false;
     if (threadWaiting) secondThreadCondition.notify_one();
+    // Serve what arrived while not listening
+    if (reactor != nullptr) transport->wake("listen");
 }
 
 void NeighborPartitionHandler::listenOff() {
@@ -136,71 +121,160 @@ void NeighborPartitionHandler::listenOff() {
 }
 
 void NeighborPartitionHandler::listenCheck() {
-    // Wait for the first message between the partition socket and the thread socket,
-    // thread socket meaning work should be interrupted (partition stopped)
-    zmq::pollitem_t pollitems[] = { 
-        { castPollSocket(*socket), 0, ZMQ_POLLIN, 0 }, 
-        { castPollSocket(*controlSocketThread), 0, ZMQ_POLLIN, 0 } 
-    };
+    // After the fence, leave the following operations in the socket
+    // until the current ones are applied, same with a full queue
+    bool readAsync;
+    {
+        lock_guard<mutex> lock(fenceLock);
+        readAsync = !fenceReceived;
+    }
+    readAsync = readAsync && hasQueueSpace();
+    bool readRequests = !applying;
 
+    // Wait for the first message between the partition sockets and the wake up signal,
+    // meaning work should be interrupted (partition stopped) or the async socket can 
+    // be read again
     log("Waiting for requests...\n");
-    int rc = zmq::poll(pollitems, 2);
+    auto event = transport->poll(readAsync, readRequests);
+
+    TransportMessage request;
+    switch (event) {
+        case ServerTransport::INTERRUPTED:
+            logerr("[WARN] poll interrupted\n");
+            return;
+        case ServerTransport::WAKE:
+            log("Woken up\n");
+            return;
+        case ServerTransport::REQUEST: {
+            lock_guard<mutex> lock(requestLock);
+            // Started applying after the poll, left in the transport
+            if (applying) return;
+            transport->receiveRequest(request);
+            serveRequestLocked(request);
+            return;
+        }
+        case ServerTransport::ASYNC:
+            transport->receiveAsync(request);
+            serveAsync(request);
+            return;
+    }
+}
 
-    if (rc == -1) {
-        logerr("[WARN] zmq::poll interrupted\n");
-        return;
+bool NeighborPartitionHandler::serveRequest(TransportMessage& request) {
+    lock_guard<mutex> lock(requestLock);
+    if (applying) return false;
+    serveRequestLocked(request);
+    return true;
+}
+
+void NeighborPartitionHandler::serveRequestLocked(TransportMessage& request) {
+    owner.incMsgCount(false);
+
+    bool alreadyReplied = handleRequest(request);
+    if (!alreadyReplied) {
+        log("Sending generic reply\n");
+        TransportMessage reply("ok", 2);
+        transport->sendReply(reply);
     }
-    if (pollitems[1].revents & ZMQ_POLLIN) {
-        // Received a message on the control socket; quit
-        log("Control socket message received, stopping listen\n");
-        return;
+}
+
+void NeighborPartitionHandler::serveAsync(TransportMessage& message) {
+    owner.incMsgCount(false);
+
+    // No reply on the async socket
+    handleRequest(message);
+    // Once per message, the main thread might be waiting for operations
+    operations.notifyPushed();
+}
+
+bool NeighborPartitionHandler::canServeRequests() {
+    return listening && !stop_ && !applying;
+}
+
+bool NeighborPartitionHandler::canServeAsync() {
+    if (!listening || stop_) return false;
+    {
+        lock_guard<mutex> lock(fenceLock);
+        if (fenceReceived) return false;
     }
-    
-    zmq::message_t request;
-    if (pollitems[0].revents & ZMQ_POLLIN) {
-        zmq::message_t message;
-        auto _ = socket->recv(request, zmq::recv_flags::none);
-    } else {
-        return;
+    return hasQueueSpace();
+}
+
+bool NeighborPartitionHandler::hasQueueSpace() {
+    if (operations.size() < maxQueuedOperations) return true;
+
+    bool wasFull = queueFull.exchange(true);
+    // Check again after setting it, in case the main thread
+    // drained the queue before seeing the flag
+    if (operations.size() < maxQueuedOperations) {
+        queueFull = false;
+        return true;
     }
+    if (!wasFull) {
+        queueFullPauses++;
+        log("Operation queue full ({}), pausing async reading\n", operations.size());
+    }
+    return false;
+}
 
-    owner.incMsgCount(false);
+// Names of the trace events, string literals as Tracer keeps the pointers
+static const char* operationTraceName(PartitionEdgesStub::Operations operation) {
+    switch(operation) {
+        case PartitionEdgesStub::GET_EDGE_VEHICLES: return "handleGetEdgeVehicles";
+        case PartitionEdgesStub::HAS_VEHICLE: return "handleHasVehicle";
+        case PartitionEdgesStub::HAS_VEHICLE_IN_EDGE: return "handleHasVehicleInEdge";
+        case PartitionEdgesStub::SET_VEHICLE_SPEED: return "handleSetVehicleSpeed";
+        case PartitionEdgesStub::ADD_VEHICLE: return "handleAddVehicle";
+        case PartitionEdgesStub::ADD_VEHICLES_BATCH: return "handleAddVehiclesBatch";
+        case PartitionEdgesStub::STEP_FENCE: return "handleStepFence";
+        case PartitionEdgesStub::VEHICLE_DELTA: return "handleVehicleDelta";
+        case PartitionEdgesStub::PARTITION_DONE: return "handlePartitionDone";
+        case PartitionEdgesStub::CANCEL_VEHICLES: return "handleCancelVehicles";
+        case PartitionEdgesStub::ACK_VEHICLES: return "handleAckVehicles";
+    }
+    return "handleUnknown";
+}
 
+bool NeighborPartitionHandler::handleRequest(TransportMessage& request) {
     // Read int representing operations to call from the message
     int opcode;
     std::memcpy(&opcode, request.data(), sizeof(int));
     auto operation = static_cast<PartitionEdgesStub::Operations>(opcode);
 
     log("Received request for opcode {}\n", opcode);
-
-    bool alreadyReplied = false;
+    TraceScope trace(operationTraceName(operation), "from", clientId);
 
     switch(operation) {
         case PartitionEdgesStub::GET_EDGE_VEHICLES:
-            alreadyReplied = handleGetEdgeVehicles(request);
-            break;
+            return handleGetEdgeVehicles(request);
         case PartitionEdgesStub::HAS_VEHICLE:
-            alreadyReplied = handleHasVehicle(request);
-            break;
+            return handleHasVehicle(request);
         case PartitionEdgesStub::HAS_VEHICLE_IN_EDGE:
-            alreadyReplied = handleHasVehicleInEdge(request);
-            break;
+            return handleHasVehicleInEdge(request);
         case PartitionEdgesStub::SET_VEHICLE_SPEED:
-            alreadyReplied = handleSetVehicleSpeed(request);
-            break;
+            return handleSetVehicleSpeed(request);
         case PartitionEdgesStub::ADD_VEHICLE:
-            alreadyReplied = handleAddVehicle(request);
-            break;
-    }
-
-    if (!alreadyReplied) {
-        log("Sending generic reply for opcode {}\n", opcode);
-        socket->send(zmq::str_buffer("ok"));
+            return handleAddVehicle(request);
+        case PartitionEdgesStub::ADD_VEHICLES_BATCH:
+            return handleAddVehiclesBatch(request);
+        case PartitionEdgesStub::STEP_FENCE:
+            return handleStepFence(request);
+        case PartitionEdgesStub::VEHICLE_DELTA:
+            return handleVehicleDelta(request);
+        case PartitionEdgesStub::PARTITION_DONE:
+            return handlePartitionDone(request);
+        case PartitionEdgesStub::CANCEL_VEHICLES:
+            return handleCancelVehicles(request);
+        case PartitionEdgesStub::ACK_VEHICLES:
+            return handleAckVehicles(request);
     }
+    logerr("Unknown opcode {}\n", opcode);
+    return false;
 }
 
 void NeighborPartitionHandler::listenThreadLogic() {
     threadDone = false;
+    Tracer::nameThread("handler " + to_string(clientId));
     #ifndef NDEBUG
     try {
     #endif
@@ -232,7 +306,7 @@ void NeighborPartitionHandler::listenThreadLogic() {
     threadDone = true;
 }
 
-bool NeighborPartitionHandler::handleGetEdgeVehicles(zmq::message_t& request) {
+bool NeighborPartitionHandler::handleGetEdgeVehicles(TransportMessage& request) {
     auto data = static_cast<char*>(request.data());
     string edgeId(
         data + sizeof(int), 
@@ -253,11 +327,11 @@ bool NeighborPartitionHandler::handleGetEdgeVehicles(zmq::message_t& request) {
         cout << ss.str();
     }
 
-    socket->send(reply, zmq::send_flags::none);
+    transport->sendReply(reply);
     return true;
 }
 
-bool NeighborPartitionHandler::handleHasVehicle(zmq::message_t& request) {
+bool NeighborPartitionHandler::handleHasVehicle(TransportMessage& request) {
     auto data = static_cast<char*>(request.data());
     string vehId(
         data + sizeof(int), 
@@ -268,15 +342,15 @@ bool NeighborPartitionHandler::handleHasVehicle(zmq::message_t& request) {
 
     bool has = owner.hasVehicle(vehId);
 
-    zmq::message_t reply(sizeof(bool));
+    TransportMessage reply(sizeof(bool));
     std::memcpy(static_cast<char*>(reply.data()), &has, sizeof(bool));
     log("Sending reply to hasVehicle({}): {}\n", vehId, has);
 
-    socket->send(reply, zmq::send_flags::none);
+    transport->sendReply(reply);
     return true;
 }
 
-bool NeighborPartitionHandler::handleHasVehicleInEdge(zmq::message_t& request) {
+bool NeighborPartitionHandler::handleHasVehicleInEdge(TransportMessage& request) {
     auto strings = readStringsFromMessage(request, sizeof(int));
     string& vehId = strings[0];
     string& edgeId = strings[1];
@@ -285,52 +359,39 @@ bool NeighborPartitionHandler::handleHasVehicleInEdge(zmq::message_t& request) {
 
     bool has = owner.hasVehicleInEdge(vehId, edgeId);
 
-    zmq::message_t reply(sizeof(bool));
+    TransportMessage reply(sizeof(bool));
     std::memcpy(static_cast<char*>(reply.data()), &has, sizeof(bool));
     log("Sending reply to hasVehicleInEdge({}, {}): {}\n", vehId, edgeId, has);
 
-    socket->send(reply, zmq::send_flags::none);
+    transport->sendReply(reply);
     return true;
 }
 
-bool NeighborPartitionHandler::handleSetVehicleSpeed(zmq::message_t& request) {
-    double speed;
-    const char* data = static_cast<char*>(request.data());
-    std::memcpy(&speed, data + sizeof(int), sizeof(double));
-    string veh(
-        data + sizeof(double) + sizeof(int), 
-        data + request.size() - 1
-    );
+bool NeighborPartitionHandler::handleSetVehicleSpeed(TransportMessage& request) {
+    MessageReader reader(holdMessage(request), sizeof(int));
+    double speed = reader.read<double>();
+    string_view veh = reader.readString();
     
     log("Queueing setVehicleSpeed ({}, {})\n", veh, speed);
 
-    // lock to be 100% sure with the applying of operations later
-    operationsBufferLock.lock();
-    // TODO: add retry later on fail
-    bool success = setSpeedQueue.append({veh, speed});
-    operationsBufferLock.unlock();
+    queueOperation(set_veh_speed_t{veh, speed}, true);
 
     return false;
 }
 
-bool NeighborPartitionHandler::handleAddVehicle(zmq::message_t& request) {
-    int laneIndex;
-    double lanePos, speed;
-    const char* data = static_cast<char*>(request.data());
-    std::memcpy(&laneIndex, data + sizeof(int), sizeof(int));
-    std::memcpy(&lanePos,   data + sizeof(int) * 2, sizeof(double));
-    std::memcpy(&speed,     data + sizeof(int) * 2 + sizeof(double), sizeof(double));
+bool NeighborPartitionHandler::handleAddVehicle(TransportMessage& request) {
+    const TransportMessage& held = holdMessage(request);
+    MessageReader reader(held, sizeof(int));
+    int laneIndex = reader.read<int>();
+    double lanePos = reader.read<double>();
+    double speed = reader.read<double>();
 
-    int stringsOffset = sizeof(int) * 2 + sizeof(double) * 2;
-    auto strings = readStringsFromMessage(request, stringsOffset);
+    auto strings = readStringViewsFromMessage(held, reader.position());
 
     log("Queueing addVehicle (addVehicle({}, {}, {}, {}, {}, {})\n",
         strings[0], strings[1], strings[2], strings[3], laneIndex, lanePos, speed);
 
-    // lock to be 100% sure with the applying of operations later
-    operationsBufferLock.lock();
-    // TODO: add retry later on fail
-    bool success = addVehicleQueue.append({
+    queueOperation(add_veh_view_t{
         strings[0],
         strings[1],
         strings[2],
@@ -338,50 +399,270 @@ bool NeighborPartitionHandler::handleAddVehicle(zmq::message_t& request) {
         laneIndex,
         lanePos,
         speed,
-    });
-    operationsBufferLock.unlock();
+        // Not stamped, applied whenever received
+        -1,
+    }, true);
+
+    return false;
+}
+
+bool NeighborPartitionHandler::handleAddVehiclesBatch(TransportMessage& request) {
+    // See PartitionEdgesStub::flushAddVehicles for the layout
+    MessageReader reader(request, sizeof(int));
+    int numDefinitions = reader.read<int>();
+    int count = reader.read<int>();
+    double time = reader.read<double>();
+
+    const size_t definitionsOffset = reader.position();
+    const size_t entriesOffset = definitionsOffset + sizeof(wireId_t) * numDefinitions;
+    const size_t entrySize = sizeof(wireId_t) * 4 + sizeof(int) + sizeof(double) * 2;
+
+    // The definitions are copied in the dictionary, and the queued
+    // operations point there, so the message is not needed after this
+    MessageReader definitionIds(request, definitionsOffset);
+    MessageReader definitionStrings(request, entriesOffset + entrySize * count + sizeof(int));
+    receiveIds.dropReplaced(operations.popCount());
+    for (int i = 0; i < numDefinitions; i++) {
+        receiveIds.define(definitionIds.read<wireId_t>(), definitionStrings.readString(), operations.pushCount());
+    }
+
+    log("Queueing addVehiclesBatch ({} vehicles, {} new ids, time {})\n", count, numDefinitions, time);
+
+    MessageReader entries(request, entriesOffset);
+    for (int i = 0; i < count; i++) {
+        wireId_t ids[4];
+        entries.readBytes(ids, sizeof(wireId_t) * 4);
+        int laneIndex = entries.read<int>();
+        double lanePos = entries.read<double>();
+        double speed = entries.read<double>();
+
+        queueOperation(add_veh_view_t{
+            receiveIds.decode(ids[0]),
+            receiveIds.decode(ids[1]),
+            receiveIds.decode(ids[2]),
+            receiveIds.decode(ids[3]),
+            laneIndex,
+            lanePos,
+            speed,
+            time,
+        }, false);
+    }
+
+    return false;
+}
+
+bool NeighborPartitionHandler::handleCancelVehicles(TransportMessage& request) {
+    const TransportMessage& held = holdMessage(request);
+    // See PartitionEdgesStub::sendCancelVehicles for the layout
+    MessageReader reader(held, sizeof(int));
+    int count = reader.read<int>();
+    MessageReader times(held, reader.position());
+    auto strings = readStringViewsFromMessage(held, reader.position() + sizeof(double) * count);
+
+    log("Queueing cancelVehicles ({} vehicles)\n", count);
+
+    for (int i = 0; i < count; i++) {
+        queueOperation(cancel_veh_t{strings[i], times.read<double>()}, true);
+    }
+
+    return false;
+}
 
+bool NeighborPartitionHandler::handleAckVehicles(TransportMessage& request) {
+    MessageReader reader(request, sizeof(int));
+    uint64_t count = reader.read<uint64_t>();
+    log("Received ackVehicles({})\n", count);
+    // Not an operation to apply, only read by takeOperations
+    ackedVehicles = count;
     return false;
 }
 
+bool NeighborPartitionHandler::handleVehicleDelta(TransportMessage& request) {
+    const TransportMessage& held = holdMessage(request);
+    MessageReader reader(held, sizeof(int));
+    int numAdded = reader.read<int>();
+    auto strings = readStringViewsFromMessage(held, reader.position());
+
+    log("Queueing vehicleDelta(+{}, -{})\n", numAdded, strings.size() - numAdded);
+
+    for (int i = 0; i < strings.size(); i++) {
+        queueOperation(neighbor_vehicle_t{strings[i], i < numAdded}, true);
+    }
+
+    return false;
+}
+
+const TransportMessage& NeighborPartitionHandler::holdMessage(TransportMessage& request) {
+    // Parse only after moving, small messages keep their data
+    // inside the message object
+    return heldMessages.push(std::move(request));
+}
+
+template<typename T>
+void NeighborPartitionHandler::queueOperation(T&& operation, bool held) {
+    uint64_t heldCount = heldMessages.pushCount();
+    operations.push(queued_operation_t{std::forward<T>(operation), held ? heldCount - 1 : heldCount});
+}
+
+bool NeighborPartitionHandler::handleStepFence(TransportMessage& request) {
+    log("Received step fence\n");
+
+    // Before stopping, so the main thread finds it in the queue
+    queueOperation(step_fence_mark_t{}, false);
+    lock_guard<mutex> lock(fenceLock);
+    fenceReceived = true;
+
+    return false;
+}
+
+bool NeighborPartitionHandler::handlePartitionDone(TransportMessage& request) {
+    log("Received partition done\n");
+
+    queueOperation(partition_done_mark_t{}, false);
+    lock_guard<mutex> lock(fenceLock);
+    neighborDone = true;
+
+    return false;
+}
+
+bool NeighborPartitionHandler::isNeighborDone() {
+    lock_guard<mutex> lock(fenceLock);
+    return neighborDone;
+}
+
+void NeighborPartitionHandler::resumeAsync() {
+    {
+        lock_guard<mutex> lock(fenceLock);
+        fenceReceived = false;
+    }
+    // Wake up the listen thread to poll the async socket again
+    transport->wake("resume");
+}
+
+void NeighborPartitionHandler::pauseRequests() {
+    applying = true;
+    // Wait for the request being served, if any; the following ones
+    // see the flag
+    lock_guard<mutex> lock(requestLock);
+}
+
+void NeighborPartitionHandler::resumeRequests() {
+    if (applying.exchange(false)) transport->wake("requests");
+}
+
+void NeighborPartitionHandler::wakeIfQueueDrained() {
+    // Half the limit, to not wake up the listen thread for each operation
+    if (queueFull && operations.size() <= maxQueuedOperations / 2 && queueFull.exchange(false)) {
+        transport->wake("queue");
+    }
+}
+
+void NeighborPartitionHandler::releaseHeldMessages(uint64_t heldFrom) {
+    while (heldMessages.popCount() < heldFrom) {
+        heldMessages.pop();
+    }
+}
+
 // Execute the queued operations that other partitions ran
 void NeighborPartitionHandler::applyMutableOperations() {
-    int num = addVehicleQueue.currentSize + setSpeedQueue.currentSize;
-    if (num > 0) {
-        log("Applying modifying operations (has {} addVehicle, {} setSpeed)\n", addVehicleQueue.currentSize, setSpeedQueue.currentSize);
-        bool wasListening = listening;
-        if (listening) {
-            log("Listen off to apply modifying operations\n");
-            listenOff();
+    // Both partitions should be at the same step when handoffs are applied,
+    // or the synchronization is broken
+    double currentTime = libsumo::Simulation::getTime();
+    double halfDeltaT = libsumo::Simulation::getDeltaT() / 2;
+
+    int numAdded = 0;
+    int numSetSpeed = 0;
+    uint64_t heldFrom = 0;
+    // Operations arrive asynchronously, apply them until
+    // the neighbor sent all of them for this step
+    bool stepDone = neighborDoneTaken;
+    queued_operation_t queued;
+    while (!stepDone) {
+        uint64_t seen = operations.pushCount();
+        if (!operations.tryPop(queued)) {
+            // Neighbors can be waiting for a reply before sending their fence
+            resumeRequests();
+            log("Waiting for step fence\n");
+            operations.waitPushed(seen);
+            continue;
+        }
+        wakeIfQueueDrained();
+        heldFrom = queued.heldFrom;
+
+        // Requests read the simulation state, which is modified here
+        if (!applying && (holds_alternative<add_veh_view_t>(queued.operation)
+            || holds_alternative<set_veh_speed_t>(queued.operation))
+        ) {
+            pauseRequests();
         }
-        // Lock to avoid other threads adding more operations in the meantime
-        // if it was inbetween one of them when we set this to stop
-        operationsBufferLock.lock();
-
-        log("Modifying ops passed lock\n");
 
-        for (int i = 0; i < addVehicleQueue.currentSize; i++) {
-            auto addVeh = addVehicleQueue.queue[i];
+        if (auto addVeh = get_if<add_veh_view_t>(&queued.operation)) {
+            if (addVeh->time >= 0 && abs(addVeh->time - currentTime) > halfDeltaT) {
+                logerr("[WARN] Applying vehicle {} sent at time {} at time {}\n", addVeh->vehId, addVeh->time, currentTime);
+            }
             owner.addVehicle(
-                addVeh.vehId, addVeh.routeId, addVeh.vehType, 
-                addVeh.laneId, addVeh.laneIndex, addVeh.lanePos, addVeh.speed
+                addVeh->vehId, addVeh->routeId, addVeh->vehType, 
+                addVeh->laneId, addVeh->laneIndex, addVeh->lanePos, addVeh->speed
             );
+            numAdded++;
+        } else if (auto setSpeed = get_if<set_veh_speed_t>(&queued.operation)) {
+            owner.setVehicleSpeed(setSpeed->vehId, setSpeed->speed);
+            numSetSpeed++;
+        } else if (auto vehicle = get_if<neighbor_vehicle_t>(&queued.operation)) {
+            (vehicle->added ? neighborVehiclesAdded : neighborVehiclesRemoved).push_back(vehicle->vehId);
+        } else if (holds_alternative<step_fence_mark_t>(queued.operation)) {
+            stepDone = true;
+        } else if (holds_alternative<partition_done_mark_t>(queued.operation)) {
+            neighborDoneTaken = true;
+            stepDone = true;
         }
+        // Cancels are only sent in optimistic mode, see takeOperations
+    }
 
-        for (int i = 0; i < setSpeedQueue.currentSize; i++) {
-            auto setSpeed = setSpeedQueue.queue[i];
-            owner.setVehicleSpeed(setSpeed.vehId, setSpeed.speed);
-        }
-        
-        addVehicleQueue.clear();
-        setSpeedQueue.clear();
+    owner.updateNeighborVehicles(clientId, neighborVehiclesAdded, neighborVehiclesRemoved);
+    neighborVehiclesAdded.clear();
+    neighborVehiclesRemoved.clear();
+    releaseHeldMessages(heldFrom);
 
-        operationsBufferLock.unlock();
+    applying = false;
+    log("Done applying modifying operations ({} addVehicle, {} setSpeed)\n", numAdded, numSetSpeed);
 
-        if (wasListening) listenOn();
+    // Also serves the requests left in the transport meanwhile
+    resumeAsync();
+}
 
-        log("Done applying modifying operations (was listening: {})\n", wasListening);
+void NeighborPartitionHandler::takeOperations(TimeWarp& timeWarp) {
+    double currentTime = libsumo::Simulation::getTime();
+
+    uint64_t heldFrom = 0;
+    queued_operation_t queued;
+    while (operations.tryPop(queued)) {
+        wakeIfQueueDrained();
+        heldFrom = queued.heldFrom;
+
+        if (auto addVeh = get_if<add_veh_view_t>(&queued.operation)) {
+            // Copied, as the views are only valid until the held messages are released
+            timeWarp.receive(clientId, addVeh->time < 0 ? currentTime : addVeh->time, {
+                string(addVeh->vehId), string(addVeh->routeId), string(addVeh->vehType),
+                string(addVeh->laneId), addVeh->laneIndex, addVeh->lanePos, addVeh->speed
+            }, currentTime);
+        } else if (auto cancel = get_if<cancel_veh_t>(&queued.operation)) {
+            // In arrival order, after the vehicles they cancel
+            timeWarp.receiveCancel(clientId, cancel->time, cancel->vehId);
+        } else if (auto setSpeed = get_if<set_veh_speed_t>(&queued.operation)) {
+            owner.setVehicleSpeed(setSpeed->vehId, setSpeed->speed);
+        } else if (auto vehicle = get_if<neighbor_vehicle_t>(&queued.operation)) {
+            (vehicle->added ? neighborVehiclesAdded : neighborVehiclesRemoved).push_back(vehicle->vehId);
+        } else if (holds_alternative<partition_done_mark_t>(queued.operation)) {
+            neighborDoneTaken = true;
+        }
     }
+
+    owner.updateNeighborVehicles(clientId, neighborVehiclesAdded, neighborVehiclesRemoved);
+    neighborVehiclesAdded.clear();
+    neighborVehiclesRemoved.clear();
+    releaseHeldMessages(heldFrom);
+    timeWarp.acknowledge(clientId, ackedVehicles);
 }
 
 template<typename... _Args > 
@@ -11,14 +11,24 @@ Author: Filippo Lenzi
 
 #pragma once
 
+#include <atomic>
+#include <cstdint>
+#include <variant>
 #include <vector>
 #include <zmq.hpp>
 #include <string>
+#include <string_view>
 #include <thread>
 #include <mutex>
 #include <condition_variable>
 #include <format>
 
+#include "HandlerReactor.hpp"
+#include "IdDictionary.hpp"
+#include "OperationQueue.hpp"
+#include "TimeWarp.hpp"
+#include "Transport.hpp"
+
 namespace psumo {
   class NeighborPartitionHandler;
 }
@@ -26,55 +36,26 @@ namespace psumo {
 
 namespace psumo {
 
-static const size_t OPERATION_QUEUE_SIZE = 1024;
-
-typedef struct {
-  std::string vehId;
-  double speed;
-} set_veh_speed_t;
-
-typedef struct {
-  std::string vehId;
-  std::string routeId; 
-  std::string vehType;
-  std::string laneId;
-  int laneIndex;
-  double lanePos;
-  double speed;
-} add_veh_t;
-
-template <typename T> class OperationQueue {
-  public:
-  std::array<T, OPERATION_QUEUE_SIZE> queue;
-  int currentSize = 0;
-
-  bool append(T el) {
-    if (currentSize < OPERATION_QUEUE_SIZE) {
-      queue[currentSize] = el;
-      currentSize++;
-      return true;
-    }
-    return false;
-  }
-
-  void clear() {
-    currentSize = 0;
-  }
-};
-
 /**
 Handle the requests from other partitions; immediately reply 
 to getter requests (currently only getVehiclesOnEdge), queue
-up muting methods. Will immediately reply to setters too
-due to the Req/Rep model in ZeroMQ.
+up muting methods. Muting methods arrive on a separate async channel of
+the transport and need no reply; the neighbor sends a fence after the
+last one of each step, after which the channel is not read until
+the operations are applied.
+Operations go to the main thread in arrival order through a queue, which
+the main thread drains while waiting for the fence; the handler stops
+reading async messages while the queue is over --max-queued-ops, to bound
+its memory. Requests are not served while operations are being applied,
+only while the main thread waits for more.
+With a reactor, it has no thread of its own, and the reactor calls
+serveRequest and serveAsync when the handler can take them.
 */
 class NeighborPartitionHandler {
 private:
+  HandlerReactor* reactor;
   zmq::context_t& zcontext; // Separate context to handle stuff while partition manager waits for barrier
-  // Pointers to be 100% sure about memory clearing with ZMQ
-  zmq::socket_t* socket;
-  zmq::socket_t* controlSocketMain;
-  zmq::socket_t* controlSocketThread;
+  ServerTransport* transport;
   const int clientId;
   PartitionManager& owner;
   bool threadWaiting;
@@ -83,30 +64,110 @@ private:
   bool term; // Stop listening thread
   bool threadDone;
   std::thread listenThread;
-  std::mutex operationsBufferLock;
   std::mutex secondThreadSignalLock;
   std::condition_variable secondThreadCondition;
-
-  OperationQueue<set_veh_speed_t> setSpeedQueue;
-  OperationQueue<add_veh_t> addVehicleQueue;
+  // Set when the neighbor's step fence arrives, reset after applying operations
+  bool fenceReceived;
+  // Set when the neighbor stopped, no more fences will arrive
+  bool neighborDone;
+  std::mutex fenceLock;
+
+  // Marks the end of the neighbor's operations for a step
+  typedef struct {} step_fence_mark_t;
+  // The neighbor stopped, see PartitionEdgesStub::sendPartitionDone
+  typedef struct {} partition_done_mark_t;
+  // Change to the vehicles in the neighbor, see PartitionManager::updateNeighborVehicles
+  typedef struct {
+    std::string_view vehId;
+    bool added;
+  } neighbor_vehicle_t;
+  typedef struct {
+    std::variant<add_veh_view_t, set_veh_speed_t, cancel_veh_t, neighbor_vehicle_t,
+      step_fence_mark_t, partition_done_mark_t> operation;
+    // Held messages before this one are not used by this or later operations
+    uint64_t heldFrom;
+  } queued_operation_t;
+
+  // Filled by the listen thread (or reactor), drained by the main thread
+  OperationQueue<queued_operation_t> operations;
+  // Received messages the queued operations point into, kept
+  // until they are applied
+  OperationQueue<TransportMessage> heldMessages;
+  const size_t maxQueuedOperations;
+  // Set when async reading stopped with a full queue, the main thread wakes
+  // the transport after draining it
+  std::atomic<bool> queueFull;
+  std::atomic<uint64_t> queueFullPauses;
+  // Main thread side of the queue, partition done mark already taken
+  bool neighborDoneTaken;
+  // Optimistic sync mode: vehicles and cancellations the neighbor
+  // acknowledged, passed to TimeWarp by the main thread
+  std::atomic<uint64_t> ackedVehicles;
+  // Ids used for the strings in batched messages, only
+  // accessed by the listen thread; queued operations
+  // point to its strings
+  IdDictionary receiveIds;
+  // Collected while draining the queue, see PartitionManager::updateNeighborVehicles
+  std::vector<std::string_view> neighborVehiclesAdded;
+  std::vector<std::string_view> neighborVehiclesRemoved;
+  // Set by the main thread while applying operations, requests are
+  // not served meanwhile; requestLock is held while serving one
+  std::atomic<bool> applying;
+  std::mutex requestLock;
 
   void listenCheck();
   void listenThreadLogic();
-
-  bool handleGetEdgeVehicles(zmq::message_t& request);
-  bool handleHasVehicle(zmq::message_t& request);
-  bool handleHasVehicleInEdge(zmq::message_t& request);
-  bool handleSetVehicleSpeed(zmq::message_t& request);
-  bool handleAddVehicle(zmq::message_t& request);
+  // Returns true if the operation already sent a reply
+  bool handleRequest(TransportMessage& request);
+  bool handleStepFence(TransportMessage& request);
+  bool handlePartitionDone(TransportMessage& request);
+  bool handleVehicleDelta(TransportMessage& request);
+  void resumeAsync();
+  // Keep the message alive until the operations are applied
+  const TransportMessage& holdMessage(TransportMessage& request);
+  // Queue an operation pointing into the last held message, or not
+  // pointing into any (held false)
+  template<typename T> void queueOperation(T&& operation, bool held);
+  // If async messages can be read without going over the queue limit
+  bool hasQueueSpace();
+  // Main thread, after taking an operation: wake the transport if it
+  // stopped reading with a full queue
+  void wakeIfQueueDrained();
+  // Main thread, free the held messages before heldFrom
+  void releaseHeldMessages(uint64_t heldFrom);
+  void serveRequestLocked(TransportMessage& request);
+  void pauseRequests();
+  void resumeRequests();
+
+  bool handleGetEdgeVehicles(TransportMessage& request);
+  bool handleHasVehicle(TransportMessage& request);
+  bool handleHasVehicleInEdge(TransportMessage& request);
+  bool handleSetVehicleSpeed(TransportMessage& request);
+  bool handleAddVehicle(TransportMessage& request);
+  bool handleAddVehiclesBatch(TransportMessage& request);
+  bool handleCancelVehicles(TransportMessage& request);
+  bool handleAckVehicles(TransportMessage& request);
 
   template<typename... _Args > 
     void log(std::format_string<_Args...>  format, _Args&&... args);
   template<typename... _Args > 
     void logerr(std::format_string<_Args...>  format, _Args&&... args);
 public:
-  NeighborPartitionHandler(PartitionManager& owner, int clientId);
+  // Served by the reactor if not null, otherwise by its own thread
+  NeighborPartitionHandler(PartitionManager& owner, int clientId, HandlerReactor* reactor = nullptr);
   ~NeighborPartitionHandler();
 
+  int getClientId() const { return clientId; }
+  // Handle a message received by the transport, replying to requests;
+  // returns false without serving it while operations are being applied
+  bool serveRequest(TransportMessage& request);
+  void serveAsync(TransportMessage& message);
+  // Reactor mode: if requests can be served now (listening, not
+  // applying operations), and async messages (listening, not after
+  // the step fence, queue not full)
+  bool canServeRequests();
+  bool canServeAsync();
+
   void join();
 
   void start();
@@ -115,8 +176,17 @@ public:
   void listenOn();
   void listenOff();
 
-  // Ideally call these when the listen thread is idle, on the main thread
+  // Call on the main thread after the step barrier; applies operations
+  // as they arrive, until the neighbor's fence for the step
   void applyMutableOperations();
+  // Optimistic sync mode: pass the received vehicles to timeWarp instead of
+  // adding them, without waiting for fences; the other operations are applied
+  void takeOperations(TimeWarp& timeWarp);
+  // If the neighbor stopped (see PartitionEdgesStub::sendPartitionDone)
+  bool isNeighborDone();
+  // Queue metrics, see --max-queued-ops
+  size_t getPeakQueuedOperations() const { return operations.getPeakSize(); }
+  uint64_t getQueueFullPauses() const { return queueFullPauses; }
 };
 
 }
\ No newline at end of file
@@ -0,0 +1,140 @@
+/**
+OperationQueue.hpp
+
+Queue used to pass the operations received by a neighbor handler
+to the main thread of the partition.
+
+Author: Filippo Lenzi
+*/
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+namespace psumo {
+
+static const size_t OPERATION_QUEUE_CHUNK_SIZE = 1024;
+
+/**
+Single producer, single consumer queue without locks, growing by
+fixed size chunks linked together, so it never drops elements and pushed
+elements are never moved. The consumer keeps one spent chunk aside for
+the producer to reuse, to not allocate at each chunk in the steady state.
+Bounding its size is left to the producer (see NeighborPartitionHandler,
+which stops reading from the transport), as it knows where it can stop.
+*/
+template <typename T> class OperationQueue {
+private:
+  struct chunk_t {
+    std::array<T, OPERATION_QUEUE_CHUNK_SIZE> items;
+    std::atomic<chunk_t*> next = nullptr;
+  };
+
+  // Producer side
+  alignas(64) chunk_t* tail;
+  size_t tailIndex = 0;
+  std::atomic<size_t> peak = 0;
+  // Elements pushed and popped since the start, on separate cache lines
+  // as each is written by a different thread
+  alignas(64) std::atomic<uint64_t> pushed = 0;
+  alignas(64) std::atomic<uint64_t> popped = 0;
+  // Consumer side
+  chunk_t* head;
+  size_t headIndex = 0;
+  std::atomic<chunk_t*> spare = nullptr;
+
+public:
+  OperationQueue() {
+    head = tail = new chunk_t();
+  }
+
+  ~OperationQueue() {
+    while (head != nullptr) {
+      chunk_t* next = head->next.load();
+      delete head;
+      head = next;
+    }
+    delete spare.load();
+  }
+
+  OperationQueue(const OperationQueue&) = delete;
+  OperationQueue& operator=(const OperationQueue&) = delete;
+
+  // Producer only; the element stays in place until popped
+  T& push(T&& el) {
+    if (tailIndex == OPERATION_QUEUE_CHUNK_SIZE) {
+      chunk_t* chunk = spare.exchange(nullptr);
+      if (chunk == nullptr) {
+        chunk = new chunk_t();
+      } else {
+        chunk->next.store(nullptr, std::memory_order_relaxed);
+      }
+      tail->next.store(chunk, std::memory_order_release);
+      tail = chunk;
+      tailIndex = 0;
+    }
+    T& slot = tail->items[tailIndex];
+    slot = std::move(el);
+    tailIndex++;
+
+    uint64_t count = pushed.load(std::memory_order_relaxed) + 1;
+    pushed.store(count, std::memory_order_release);
+    size_t depth = count - popped.load(std::memory_order_acquire);
+    if (depth > peak.load(std::memory_order_relaxed)) peak.store(depth, std::memory_order_relaxed);
+    return slot;
+  }
+
+  T& push(const T& el) {
+    return push(T(el));
+  }
+
+  // Consumer only; returns false if empty
+  bool tryPop(T& el) {
+    if (popped.load(std::memory_order_relaxed) == pushed.load(std::memory_order_acquire)) {
+      return false;
+    }
+    if (headIndex == OPERATION_QUEUE_CHUNK_SIZE) {
+      chunk_t* spent = head;
+      head = head->next.load(std::memory_order_acquire);
+      headIndex = 0;
+      delete spare.exchange(spent);
+    }
+    el = std::move(head->items[headIndex]);
+    headIndex++;
+    popped.store(popped.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Drop the oldest element, consumer only
+  bool pop() {
+    T el;
+    return tryPop(el);
+  }
+
+  // Any thread, may be outdated by the time it returns
+  size_t size() const {
+    uint64_t poppedCount = popped.load(std::memory_order_acquire);
+    return pushed.load(std::memory_order_acquire) - poppedCount;
+  }
+  bool empty() const { return size() == 0; }
+
+  // Elements pushed and popped since the start
+  uint64_t pushCount() const { return pushed.load(std::memory_order_acquire); }
+  uint64_t popCount() const { return popped.load(std::memory_order_acquire); }
+
+  // Consumer: block until the push count differs from seen (read it
+  // before checking the queue, as with ShmDoorbell)
+  void waitPushed(uint64_t seen) const { pushed.wait(seen); }
+  // Producer: wake the consumer waiting in waitPushed, after
+  // pushing a group of elements
+  void notifyPushed() { pushed.notify_one(); }
+
+  // Highest size seen by the producer
+  size_t getPeakSize() const { return peak.load(std::memory_order_relaxed); }
+};
+
+}
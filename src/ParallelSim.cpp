@@ -10,6 +10,7 @@ Contributions: Filippo Lenzi
 */
 #include "ParallelSim.hpp"
 
+#include <algorithm>
 #include <csignal>
 #include <cstdio>
 #include <cstring>
@@ -43,6 +44,7 @@ Contributions: Filippo Lenzi
 #include "utils.hpp"
 #include "args.hpp"
 #include "psumoTypes.hpp"
+#include "Tracer.hpp"
 
 namespace fs = std::filesystem;
 
@@ -274,6 +276,17 @@ void ParallelSim::startSim(){
   // Context for ZeroMQ message-passing, ideally one per program
   zmq::context_t zctx{1};
 
+  // Bound before creating the partitions, which connect as soon as they start
+  bindSyncSockets(zctx);
+
+  if (!args.trace.empty()) {
+    Tracer::enable(0, "Coordinator");
+    // Left by a previous run, a partition ending with an error would not overwrite its own
+    for (partId_t i = 0; i < numThreads; i++) {
+      filesystem::remove(psumo::getTracePartFile(args.dataDir, i));
+    }
+  }
+
   // Now Python does this
   vector<pid_t> pids(numThreads);
 
@@ -330,6 +343,17 @@ void ParallelSim::startSim(){
 
   waitThread.join();
 
+  // All partitions exited, so their parts are written
+  if (!args.trace.empty()) {
+    vector<string> traceParts;
+    for (partId_t i = 0; i < numThreads; i++) {
+      traceParts.push_back(psumo::getTracePartFile(args.dataDir, i));
+    }
+    Tracer::writeMerged(args.trace, traceParts);
+    for (auto& part : traceParts) filesystem::remove(part);
+    printf("Saved trace to %s\n", args.trace.c_str());
+  }
+
   controlSocketThread->close();
   controlSocketMain->close();
 
@@ -357,17 +381,14 @@ void ParallelSim::startSim(){
   // }
 }
 
-int ParallelSim::coordinatePartitionsSync(zmq::context_t& zctx, shared_ptr<zmq::socket_t> controlSocket) {
-  if (args.verbose)
-    printf("Coordinator | Starting coordinator routine...\n");
-
+void ParallelSim::bindSyncSockets(zmq::context_t& zctx) {
   // Initialize sockets used to sync partitions in a barrier-like fashion
-  vector<unique_ptr<zmq::socket_t>> sockets(numThreads);
+  syncSockets.resize(numThreads);
   for (int i = 0; i < numThreads; i++) {
-    string uri = psumo::getSyncSocketId(args.dataDir, i);
+    string uri = psumo::getSyncSocketId(args.dataDir, args.coordinatorHost, i, args.transportType);
     try {
-      sockets[i] = unique_ptr<zmq::socket_t>(makeSocket(zctx, zmq::socket_type::rep));
-      sockets[i]->bind(uri);
+      syncSockets[i] = unique_ptr<zmq::socket_t>(makeSocket(zctx, zmq::socket_type::rep));
+      psumo::bind(*syncSockets[i], uri);
     } catch (zmq::error_t& e) {
       stringstream msg;
       msg << "Coordinator | ZMQ error in binding socket " << i << " to '" << uri
@@ -379,6 +400,13 @@ int ParallelSim::coordinatePartitionsSync(zmq::context_t& zctx, shared_ptr<zmq::
 
   if (args.verbose)
     printf("Coordinator | Bound sockets\n");
+}
+
+int ParallelSim::coordinatePartitionsSync(zmq::context_t& zctx, shared_ptr<zmq::socket_t> controlSocket) {
+  if (args.verbose)
+    printf("Coordinator | Starting coordinator routine...\n");
+
+  auto& sockets = syncSockets;
 
   vector<zmq::pollitem_t> pollitems(numThreads + 1);
   for (int i = 0; i < numThreads; i++) {
@@ -402,7 +430,23 @@ int ParallelSim::coordinatePartitionsSync(zmq::context_t& zctx, shared_ptr<zmq::
 
   int barrierPartitions = 0;
   int stepPartitions = 0;
+  int readyPartitions = 0;
+  // Startup: seconds each partition took to be ready, and when the
+  // coordinator started waiting
+  vector<double> partitionReadySeconds(numThreads, -1);
+  auto startupBegin = high_resolution_clock::now();
   int stoppedPartitions = 0;
+  // Neighbor sync modes: last step each partition reported, and since which
+  // step it has been empty (-1 if not); partitions report at different steps,
+  // the simulation is finished once all were empty at a step all reached
+  vector<int> partitionLatestStep(numThreads, -1);
+  vector<int> partitionEmptySince(numThreads, -1);
+  vector<double> partitionEmptySinceTime(numThreads, -1);
+  bool allEmptyInStep = false;
+  // Optimistic sync mode: lowest time each partition can still send vehicles for
+  // at its last report, the minimum is the global virtual time (GVT); messages
+  // in flight are counted by their sender's next report
+  vector<double> partitionLocalTime(numThreads, 0);
 
   high_resolution_clock::time_point time0;
   bool setTime = false;
@@ -410,6 +454,9 @@ int ParallelSim::coordinatePartitionsSync(zmq::context_t& zctx, shared_ptr<zmq::
   steps = 0;
   syncBarrierTimes = 0;
 
+  Tracer::nameThread("coordinator");
+  Tracer::begin("startup");
+
   zmq::message_t message;
 
   int returnStatus;
@@ -450,6 +497,8 @@ int ParallelSim::coordinatePartitionsSync(zmq::context_t& zctx, shared_ptr<zmq::
             if (!partitionReachedBarrier[i]) {
               partitionReachedBarrier[i] = true;
               barrierPartitions++;
+              if (barrierPartitions == 1) Tracer::begin("barrier");
+              Tracer::instant("arrived", "partition", i);
               if (args.verbose)
                 printf("Coordinator | Partition %d reached barrier (%d/%d)\n", i, barrierPartitions, numThreads);
             } else {
@@ -468,6 +517,10 @@ int ParallelSim::coordinatePartitionsSync(zmq::context_t& zctx, shared_ptr<zmq::
               std::memcpy(&empty, data + sizeof(int), sizeof(bool));
               partitionEmpty[i] = empty;
               stepPartitions++;
+              // From the first partition to arrive to the release, arrivals
+              // in between show the skew between partitions
+              if (stepPartitions == 1) Tracer::begin("stepBarrier", "step", steps);
+              Tracer::instant("arrived", "partition", i);
               if (args.verbose)
                 printf("Coordinator | Partition %d reached step barrier (%d/%d)\n", i, stepPartitions, numThreads);
             } else {
@@ -479,6 +532,64 @@ int ParallelSim::coordinatePartitionsSync(zmq::context_t& zctx, shared_ptr<zmq::
             }
             break;
 
+          case SyncOps::STEP_STATUS: {
+            int step, emptySince;
+            double localTime, emptySinceTime;
+            std::memcpy(&step, data + sizeof(int), sizeof(int));
+            std::memcpy(&emptySince, data + sizeof(int) * 2, sizeof(int));
+            std::memcpy(&localTime, data + sizeof(int) * 3, sizeof(double));
+            std::memcpy(&emptySinceTime, data + sizeof(int) * 3 + sizeof(double), sizeof(double));
+            steps = max(steps, step);
+            partitionLatestStep[i] = step;
+            partitionEmptySince[i] = emptySince;
+            partitionEmptySinceTime[i] = emptySinceTime;
+            partitionLocalTime[i] = localTime;
+            double gvt = *min_element(partitionLocalTime.begin(), partitionLocalTime.end());
+            if (!allEmptyInStep) {
+              int lastEmptied = *max_element(partitionEmptySince.begin(), partitionEmptySince.end());
+              int minStep = *min_element(partitionLatestStep.begin(), partitionLatestStep.end());
+              bool allEmpty = *min_element(partitionEmptySince.begin(), partitionEmptySince.end()) >= 0;
+              // Optimistic mode: partitions can still roll back to before the
+              // GVT, so they must also all be empty at a time at or before it
+              // (vehicles in flight count in it, see TimeWarp::getLocalTime)
+              bool beforeGvt = args.syncMode != SyncMode::OPTIMISTIC
+                || *max_element(partitionEmptySinceTime.begin(), partitionEmptySinceTime.end()) <= gvt;
+              if (allEmpty && lastEmptied <= minStep && beforeGvt) {
+                allEmptyInStep = true;
+                if (args.verbose)
+                  printf("Coordinator | All partitions empty since step %d\n", lastEmptied);
+              }
+            }
+
+            // Does not wait for the others, partitions only wait for their neighbors
+            zmq::message_t reply(sizeof(bool) + sizeof(double));
+            auto replyData = static_cast<char*>(reply.data());
+            std::memcpy(replyData, &allEmptyInStep, sizeof(bool));
+            std::memcpy(replyData + sizeof(bool), &gvt, sizeof(double));
+            socket.send(reply, zmq::send_flags::none);
+
+            if (!setTime) {
+              setTime = true;
+              time0 = high_resolution_clock::now();
+            }
+            break;
+          }
+
+          case SyncOps::READY:
+            if (partitionReadySeconds[i] < 0) {
+              std::memcpy(&partitionReadySeconds[i], data + sizeof(int), sizeof(double));
+              readyPartitions++;
+              if (args.verbose)
+                printf("Coordinator | Partition %d ready after %.3fs (%d/%d)\n", i, partitionReadySeconds[i], readyPartitions, numThreads);
+            } else {
+              stringstream msg;
+              msg << "Partition sent ready message twice! Is " << i << endl;
+              cerr << msg.str();
+              // Send message just incase, but this is undefined behavior
+              socket.send(zmq::str_buffer("repeated"), zmq::send_flags::none);
+            }
+            break;
+
           case SyncOps::FINISHED:
             if (!partitionStopped[i]) {
               partitionStopped[i] = true;
@@ -501,11 +612,32 @@ int ParallelSim::coordinatePartitionsSync(zmq::context_t& zctx, shared_ptr<zmq::
       allFinished = true;
       break;
     }
+    if (readyPartitions >= numThreads) {
+      readyPartitions = 0;
+      Tracer::end("startup");
+      if (args.verbose) {
+        auto slowest = max_element(partitionReadySeconds.begin(), partitionReadySeconds.end());
+        double waited = duration_cast<duration<double>>(high_resolution_clock::now() - startupBegin).count();
+        printf("Coordinator | All partitions ready after %.3fs, slowest was %ld (%.3fs)\n",
+          waited, distance(partitionReadySeconds.begin(), slowest), *slowest);
+      }
+
+      for (int i = 0; i < numThreads; i++) {
+        sockets[i]->send(zmq::str_buffer("ok"), zmq::send_flags::none);
+      }
+
+      if (!setTime) {
+        setTime = true;
+        // start time once all are ready
+        time0 = high_resolution_clock::now();
+      }
+    }
     if (barrierPartitions >= numThreads) {
       if (args.verbose)
         printf("Coordinator | All partitions reached barrier\n");
       syncBarrierTimes++;
       barrierPartitions = 0;
+      Tracer::end("barrier");
       for (int i = 0; i < numThreads; i++) partitionReachedBarrier[i] = false;
 
       // All partitions reached barrier, reply to each to unlock it
@@ -522,7 +654,9 @@ int ParallelSim::coordinatePartitionsSync(zmq::context_t& zctx, shared_ptr<zmq::
     if (stepPartitions >= numThreads) {
       if (args.verbose)
         printf("Coordinator | All partitions reached step barrier\n");
-      steps++;
+      Tracer::end("stepBarrier");
+      // Partitions run syncInterval steps between barriers
+      steps += max(1, args.syncInterval);
       stepPartitions = 0;
       for (int i = 0; i < numThreads; i++) partitionReachedStepBarrier[i] = false;
 
@@ -558,6 +692,7 @@ int ParallelSim::coordinatePartitionsSync(zmq::context_t& zctx, shared_ptr<zmq::
   for (int i = 0; i < numThreads; i++) {
     sockets[i]->close();
   }
+  syncSockets.clear();
 
   if (earlyReturn) {
     return returnStatus;
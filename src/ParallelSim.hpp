@@ -11,6 +11,8 @@ Contributions: Filippo Lenzi
 #pragma once
 
 #include <cstdlib>
+#include <memory>
+#include <vector>
 #include <zmq.hpp>
 #include "args.hpp"
 #include "psumoTypes.hpp"
@@ -28,10 +30,14 @@ class ParallelSim {
     int syncBarrierTimes;
     bool allFinished = false;
     Args args;
+    // One per partition, bound before the partitions start so they
+    // can connect right away
+    std::vector<std::unique_ptr<zmq::socket_t>> syncSockets;
     // sets the border edges for all partitions
     void calcBorderEdges(std::vector<std::vector<psumo::border_edge_t>>& borderEdges, std::vector<std::vector<psumo::partId_t>>& partNeighbors);
     void loadRealNumThreads();
 
+    void bindSyncSockets(zmq::context_t&);
     int coordinatePartitionsSync(zmq::context_t&, std::shared_ptr<zmq::socket_t> controlSocket);
     void waitForPartitions(std::vector<pid_t> pids, std::shared_ptr<zmq::socket_t> controlSocket);
 
@@ -49,6 +55,14 @@ class ParallelSim {
     enum SyncOps {
         BARRIER,
         BARRIER_STEP,
-        FINISHED
+        FINISHED,
+        // Sent once by each partition when its simulation is loaded and its
+        // handlers are listening, with the seconds it took; replied once all
+        // are ready, after which they connect to each other
+        READY,
+        // Neighbor sync modes: step number, since which step the partition
+        // is empty (-1 if not) and its local time (see TimeWarp), replied
+        // immediately with whether all partitions are empty and the GVT
+        STEP_STATUS,
     };
 };
@@ -0,0 +1,332 @@
+/**
+PartitionData.cpp
+
+Data of a partition generated by partitiondatagen.py: its border edges,
+neighbors and the routes of each neighbor. Mapped from partDataN.bin and
+used in place, or parsed from partDataN.json for older data.
+
+Author: Filippo Lenzi
+*/
+
+#include "PartitionData.hpp"
+
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#ifndef USING_WIN
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <nlohmann/json.hpp>
+
+#include "utils.hpp"
+
+using namespace std;
+
+namespace psumo {
+
+/*
+Binary layout, little endian, sections 8 byte aligned; offsets are from
+the start of the file, strings are referred to by their index.
+
+header (64 bytes):
+    char magic[8]; u32 version; i32 partId; f64 lastDepart;
+    u32 stringCount, stringsOffset;         -> {u32 offset, u32 length}[]
+    u32 neighborCount, neighborsOffset;     -> {i32 id, u32 routesTable, f64 lookahead (NaN if none)}[]
+    u32 borderEdgeCount, borderEdgesOffset; -> {u32 id, i32 from, i32 to, u32 laneCount, u32 lanesOffset}[]
+    u32 routeEndsTable;                     -> border edge id: routes table
+    u32 routeCount, routesOffset;           -> u32[]
+    u32 flags;                              -> PART_DATA_HAS_ROUTES if the routes are there
+hash table:
+    u32 bucketCount (power of 2), u32 reserved, {u32 key, u32 value}[bucketCount]
+    key is the string index + 1 (0 for empty buckets), placed by FNV-1a
+    hash of the string with linear probing; sets have value 0
+*/
+static const char MAGIC[8] = {'P', 'S', 'U', 'M', 'O', 'P', 'D', '\0'};
+static const uint32_t VERSION = 1;
+static const size_t HEADER_SIZE = 64;
+static const size_t NEIGHBOR_ENTRY_SIZE = 16;
+static const size_t BORDER_EDGE_ENTRY_SIZE = 20;
+static const uint32_t PART_DATA_HAS_ROUTES = 1;
+
+static inline uint32_t fnv1a(string_view str) {
+    uint32_t hash = 2166136261u;
+    for (char c : str) {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+PartitionData::PartitionData(const string& dataFolder, partId_t id) {
+    if (!loadBinary(getPartitionDataFile(dataFolder, id, ".bin"))) {
+        loadJson(getPartitionDataFile(dataFolder, id));
+    }
+}
+
+PartitionData::~PartitionData() {
+    #ifndef USING_WIN
+    if (mapped) munmap(const_cast<char*>(mapped), mappedSize);
+    #else
+    delete[] mapped;
+    #endif
+}
+
+bool PartitionData::loadBinary(const string& file) {
+    #ifndef USING_WIN
+    int fd = open(file.c_str(), O_RDONLY);
+    // Older partition data, JSON only
+    if (fd < 0) return false;
+
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) != 0 || fileStat.st_size < static_cast<off_t>(HEADER_SIZE)) {
+        ::close(fd);
+        std::cerr << "Invalid partition data file: " << file << std::endl;
+        exit(-3);
+    }
+    mappedSize = fileStat.st_size;
+    void* data = mmap(nullptr, mappedSize, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED) {
+        std::cerr << "Failed to map the data file: " << file << ": " << strerror(errno) << std::endl;
+        exit(-2);
+    }
+    mapped = static_cast<const char*>(data);
+    #else
+    // No mmap, read in memory instead: the pages are not shared between
+    // the partitions, the lookups are the same
+    ifstream in(file, ios::binary | ios::ate);
+    // Older partition data, JSON only
+    if (!in) return false;
+
+    streamoff fileSize = in.tellg();
+    if (fileSize < static_cast<streamoff>(HEADER_SIZE)) {
+        std::cerr << "Invalid partition data file: " << file << std::endl;
+        exit(-3);
+    }
+    mappedSize = fileSize;
+    char* data = new char[mappedSize];
+    in.seekg(0);
+    if (!in.read(data, mappedSize)) {
+        delete[] data;
+        std::cerr << "Failed to read the data file: " << file << std::endl;
+        exit(-2);
+    }
+    mapped = data;
+    #endif
+
+    if (memcmp(mapped, MAGIC, sizeof(MAGIC)) != 0 || readAt<uint32_t>(8) != VERSION) {
+        std::cerr << "Invalid partition data file (wrong magic or version): " << file << std::endl;
+        exit(-3);
+    }
+
+    auto invalid = [&](const char* section) {
+        std::cerr << "Invalid partition data file (" << section << " out of the file): " << file << std::endl;
+        exit(-3);
+    };
+
+    lastDepartTime = readAt<double>(16);
+    stringCount = readAt<uint32_t>(24);
+    uint32_t neighborCount = readAt<uint32_t>(32);
+    neighborsOffset = readAt<uint32_t>(36);
+    uint32_t borderEdgeCount = readAt<uint32_t>(40);
+    uint32_t borderEdgesOffset = readAt<uint32_t>(44);
+    routeEndsTable = readAt<uint32_t>(48);
+    uint32_t routeCount = readAt<uint32_t>(52);
+    uint32_t routesOffset = readAt<uint32_t>(56);
+    routeTable = readAt<uint32_t>(60) & PART_DATA_HAS_ROUTES;
+
+    if (!validStrings()) invalid("strings");
+    if (!inFile(neighborsOffset, neighborCount, NEIGHBOR_ENTRY_SIZE)) invalid("neighbors");
+    for (uint32_t i = 0; i < neighborCount; i++) {
+        if (!validTable(readAt<uint32_t>(neighborsOffset + i * NEIGHBOR_ENTRY_SIZE + 4))) invalid("neighbor routes");
+    }
+    if (!inFile(borderEdgesOffset, borderEdgeCount, BORDER_EDGE_ENTRY_SIZE)) invalid("border edges");
+    if (!validTable(routeEndsTable, true)) invalid("route ends");
+    if (!inFile(routesOffset, routeCount, sizeof(uint32_t))) invalid("routes");
+
+    for (uint32_t i = 0; i < neighborCount; i++) {
+        size_t entry = neighborsOffset + i * NEIGHBOR_ENTRY_SIZE;
+        partId_t neighId = readAt<int32_t>(entry);
+        neighbors.push_back(neighId);
+        double lookahead = readAt<double>(entry + 8);
+        if (!isnan(lookahead)) neighborLookaheads[neighId] = lookahead;
+    }
+
+    for (uint32_t i = 0; i < borderEdgeCount; i++) {
+        size_t entry = borderEdgesOffset + i * BORDER_EDGE_ENTRY_SIZE;
+        border_edge_t edge;
+        uint32_t idIndex = readAt<uint32_t>(entry);
+        if (idIndex >= stringCount) invalid("border edge id");
+        edge.id = stringAt(idIndex);
+        edge.from = readAt<int32_t>(entry + 4);
+        edge.to = readAt<int32_t>(entry + 8);
+        uint32_t laneCount = readAt<uint32_t>(entry + 12);
+        uint32_t lanesOffset = readAt<uint32_t>(entry + 16);
+        if (!inFile(lanesOffset, laneCount, sizeof(uint32_t))) invalid("border edge lanes");
+        for (uint32_t lane = 0; lane < laneCount; lane++) {
+            uint32_t laneIndex = readAt<uint32_t>(lanesOffset + lane * 4);
+            if (laneIndex >= stringCount) invalid("lane id");
+            edge.lanes.emplace_back(stringAt(laneIndex));
+        }
+        borderEdges.push_back(std::move(edge));
+    }
+
+    routeIds.reserve(routeCount);
+    for (uint32_t i = 0; i < routeCount; i++) {
+        uint32_t routeIndex = readAt<uint32_t>(routesOffset + i * 4);
+        if (routeIndex >= stringCount) invalid("route id");
+        routeIds.push_back(stringAt(routeIndex));
+    }
+    return true;
+}
+
+bool PartitionData::inFile(uint64_t offset, uint64_t count, uint64_t entrySize) const {
+    // Counts and offsets are 32 bit, no overflow in 64
+    return offset + count * entrySize <= mappedSize;
+}
+
+bool PartitionData::validStrings() const {
+    uint32_t stringsOffset = readAt<uint32_t>(28);
+    if (!inFile(stringsOffset, stringCount, 8)) return false;
+    for (uint32_t i = 0; i < stringCount; i++) {
+        uint32_t offset = readAt<uint32_t>(stringsOffset + i * 8);
+        uint32_t length = readAt<uint32_t>(stringsOffset + i * 8 + 4);
+        if (!inFile(offset, length, 1)) return false;
+    }
+    return true;
+}
+
+bool PartitionData::validTable(uint32_t table, bool nested) const {
+    if (!inFile(table, 1, 8)) return false;
+    uint32_t bucketCount = readAt<uint32_t>(table);
+    if (bucketCount == 0 || (bucketCount & (bucketCount - 1)) != 0) return false;
+    if (!inFile(table + 8ull, bucketCount, 8)) return false;
+    // Lookups stop at the first empty bucket, there must be one
+    bool anyEmpty = false;
+    for (uint32_t i = 0; i < bucketCount; i++) {
+        uint32_t bucketKey = readAt<uint32_t>(table + 8ull + i * 8ull);
+        if (bucketKey == 0) {
+            anyEmpty = true;
+            continue;
+        }
+        if (bucketKey - 1 >= stringCount) return false;
+        if (nested && !validTable(readAt<uint32_t>(table + 12ull + i * 8ull))) return false;
+    }
+    return anyEmpty;
+}
+
+void PartitionData::loadJson(const string& file) {
+    ifstream input(file);
+    if (!input) {
+        std::cerr << "Failed to open the data file: " << file << std::endl;
+        exit(-2);
+    }
+
+    nlohmann::json data;
+    try {
+        input >> data;
+    } catch(const exception& e) {
+        std::cerr << "Failed to parse data file JSON: " << e.what() << std::endl;
+        exit(-3);
+    }
+    input.close();
+
+    borderEdges = data["borderEdges"].template get<vector<border_edge_t>>();
+    neighbors = data["neighbors"].template get<vector<partId_t>>();
+
+    map<string, vector<string>> partNeighborLists = data["neighborRoutes"].template get<map<string, vector<string>>>();
+    for (auto& [neighIdString, routesVector] : partNeighborLists) {
+        jsonNeighborRoutes[stoi(neighIdString)] = string_set(routesVector.begin(), routesVector.end());
+    }
+
+    auto routeEnds = data["borderRouteEnds"].template get<map<string, vector<string>>>();
+    for (auto& [edgeId, routesVector] : routeEnds) {
+        jsonRouteEnds[edgeId] = string_set(routesVector.begin(), routesVector.end());
+    }
+    lastDepartTime = data["lastDepart"].template get<float>();
+
+    // Older partition data doesn't have it, lookahead mode will sync every step then
+    if (data.contains("neighborLookahead")) {
+        auto lookaheads = data["neighborLookahead"].template get<map<string, double>>();
+        for (auto& [neighIdString, lookahead] : lookaheads) {
+            neighborLookaheads[stoi(neighIdString)] = lookahead;
+        }
+    }
+    // Same, the route file will be read for the route ids then
+    if (data.contains("routes")) {
+        routeTable = true;
+        jsonRouteIds = data["routes"].template get<vector<string>>();
+        routeIds.assign(jsonRouteIds.begin(), jsonRouteIds.end());
+    }
+}
+
+string_view PartitionData::stringAt(uint32_t index) const {
+    uint32_t stringsOffset = readAt<uint32_t>(28);
+    uint32_t offset = readAt<uint32_t>(stringsOffset + index * 8);
+    uint32_t length = readAt<uint32_t>(stringsOffset + index * 8 + 4);
+    return string_view(mapped + offset, length);
+}
+
+bool PartitionData::findInTable(uint32_t table, string_view key, uint32_t* value) const {
+    uint32_t mask = readAt<uint32_t>(table) - 1;
+    size_t buckets = table + 8;
+    // At most half full, always ends at an empty bucket
+    for (uint32_t i = fnv1a(key) & mask; ; i = (i + 1) & mask) {
+        uint32_t bucketKey = readAt<uint32_t>(buckets + i * 8);
+        if (bucketKey == 0) return false;
+        if (stringAt(bucketKey - 1) == key) {
+            if (value) *value = readAt<uint32_t>(buckets + i * 8 + 4);
+            return true;
+        }
+    }
+}
+
+bool PartitionData::neighborHasRoute(partId_t neighbor, string_view route) const {
+    if (!mapped) {
+        auto it = jsonNeighborRoutes.find(neighbor);
+        return it != jsonNeighborRoutes.end() && it->second.contains(route);
+    }
+    for (size_t i = 0; i < neighbors.size(); i++) {
+        if (neighbors[i] == neighbor) {
+            uint32_t routesTable = readAt<uint32_t>(neighborsOffset + i * NEIGHBOR_ENTRY_SIZE + 4);
+            return findInTable(routesTable, route);
+        }
+    }
+    return false;
+}
+
+bool PartitionData::routeEndsInEdge(string_view edge, string_view route) const {
+    if (!mapped) {
+        auto it = jsonRouteEnds.find(edge);
+        return it != jsonRouteEnds.end() && it->second.contains(route);
+    }
+    uint32_t routesTable;
+    return findInTable(routeEndsTable, edge, &routesTable) && findInTable(routesTable, route);
+}
+
+vector<string_view> PartitionData::getRoutesEndingInEdge(string_view edge) const {
+    vector<string_view> routes;
+    if (!mapped) {
+        auto it = jsonRouteEnds.find(edge);
+        if (it != jsonRouteEnds.end()) routes.assign(it->second.begin(), it->second.end());
+        return routes;
+    }
+    uint32_t routesTable;
+    if (!findInTable(routeEndsTable, edge, &routesTable)) return routes;
+    uint32_t bucketCount = readAt<uint32_t>(routesTable);
+    size_t buckets = routesTable + 8;
+    for (uint32_t i = 0; i < bucketCount; i++) {
+        uint32_t bucketKey = readAt<uint32_t>(buckets + i * 8);
+        if (bucketKey != 0) routes.push_back(stringAt(bucketKey - 1));
+    }
+    return routes;
+}
+
+}
@@ -0,0 +1,97 @@
+/**
+PartitionData.hpp
+
+Data of a partition generated by partitiondatagen.py: its border edges,
+neighbors and the routes of each neighbor. Mapped from partDataN.bin and
+used in place, or parsed from partDataN.json for older data.
+
+Author: Filippo Lenzi
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "psumoTypes.hpp"
+
+namespace psumo {
+
+/**
+The binary file is mapped read only, so partitions on the same host share
+its pages, and route lookups go through the hash tables it contains
+instead of building sets at startup. Small sections (border edges,
+neighbors) are still copied out.
+*/
+class PartitionData {
+private:
+    // nullptr if loaded from JSON; read in memory instead of
+    // mapped on Windows
+    const char* mapped = nullptr;
+    size_t mappedSize = 0;
+    uint32_t stringCount = 0;
+    uint32_t neighborsOffset = 0;
+    uint32_t routeEndsTable = 0;
+
+    // Only used if loaded from JSON
+    std::unordered_map<partId_t, string_set> jsonNeighborRoutes;
+    string_map<string_set> jsonRouteEnds;
+    std::vector<std::string> jsonRouteIds;
+
+    std::vector<border_edge_t> borderEdges;
+    std::vector<partId_t> neighbors;
+    std::unordered_map<partId_t, double> neighborLookaheads;
+    std::vector<std::string_view> routeIds;
+    float lastDepartTime = 0;
+    bool routeTable = false;
+
+    template<typename T> T readAt(size_t offset) const {
+        T value;
+        std::memcpy(&value, mapped + offset, sizeof(T));
+        return value;
+    }
+    std::string_view stringAt(uint32_t index) const;
+    // Checks of the mapped file, so lookups can read it without bounds checks
+    bool inFile(uint64_t offset, uint64_t count, uint64_t entrySize) const;
+    bool validStrings() const;
+    // With nested, the values are tables too (see routeEndsTable)
+    bool validTable(uint32_t table, bool nested = false) const;
+    // If the key is in the hash table at offset, setting its value
+    bool findInTable(uint32_t table, std::string_view key, uint32_t* value = nullptr) const;
+
+    bool loadBinary(const std::string& file);
+    void loadJson(const std::string& file);
+public:
+    // Exits if neither file can be read
+    PartitionData(const std::string& dataFolder, partId_t id);
+    ~PartitionData();
+    PartitionData(const PartitionData&) = delete;
+    PartitionData& operator=(const PartitionData&) = delete;
+
+    bool isMapped() const { return mapped != nullptr; }
+
+    const std::vector<border_edge_t>& getBorderEdges() const { return borderEdges; }
+    const std::vector<partId_t>& getNeighbors() const { return neighbors; }
+    // Missing for neighbors without one (older data)
+    const std::unordered_map<partId_t, double>& getNeighborLookaheads() const { return neighborLookaheads; }
+    // If the data has the route table below, older data does not
+    bool hasRouteIds() const { return routeTable; }
+    // Full ids of the partition's routes (multipart ones with _partN),
+    // can be empty even with the table, if no routes are in the partition
+    const std::vector<std::string_view>& getRouteIds() const { return routeIds; }
+    float getLastDepartTime() const { return lastDepartTime; }
+
+    // If the neighbor has the route (base id, without _partN)
+    bool neighborHasRoute(partId_t neighbor, std::string_view route) const;
+    // If the route (base id) ends in the border edge
+    bool routeEndsInEdge(std::string_view edge, std::string_view route) const;
+    // Routes (base ids) ending in the border edge, views valid as long as this
+    std::vector<std::string_view> getRoutesEndingInEdge(std::string_view edge) const;
+};
+
+}
@@ -10,6 +10,8 @@ Author: Filippo Lenzi
 #include "PartitionManager.hpp"
 #include "utils.hpp"
 #include "messagingShared.hpp"
+#include "Tracer.hpp"
+#include "Transport.hpp"
 
 #include <cstddef>
 #include <cstring>
@@ -19,62 +21,51 @@ Author: Filippo Lenzi
 
 using namespace std;
 
-#ifdef USING_WIN
-#define z_transport tcp
-#else
-#define z_transport ipc
-#endif
-
 // Current implementation of messaging uses constant
 // size to instantiate messages
 #define SUMO_ID_SIZE 256
 
 PartitionEdgesStub::PartitionEdgesStub(PartitionManager& owner, partId_t targetId, int numThreads, zmq::context_t& zcontext, Args& args):
+    args(args),
     owner(owner),
     id(targetId),
     connected(false),
-    socketUri(psumo::getSocketName(args.dataDir, owner.getId(), targetId, numThreads)),
-    args(args),
-    socket(makeSocket(zcontext, zmq::socket_type::req))
+    transport(makeClientTransport(args.transportType, zcontext, args.dataDir,
+        getPartitionHost(args.partitionHosts, targetId), owner.getId(), targetId, numThreads, args.handlerMode)),
+    sendIds(owner.getIdTable())
 {
 
 }
 
-const int DISCONNECT_CONTEXT_TERMINATED_ERR = 156384765;
-
 PartitionEdgesStub::~PartitionEdgesStub() {
-    if (connected) {
-        try {
-            close(*socket);
-        } catch (zmq::error_t& e) {
-            // If the context is already terminated, then not a problem if it didn't disconnect
-            if (e.num() != DISCONNECT_CONTEXT_TERMINATED_ERR) {
-                logerr("Error in disconnecting socket during destructor: {}/{}\n", e.what(), e.num());
-            }
-        }
-    }
-
-    delete socket;
+    delete transport;
 }
 
 void PartitionEdgesStub::connect() {
-    psumo::connect(*socket, socketUri);
+    try {
+        transport->connect();
+    } catch (runtime_error& e) {
+        // Shared memory errors, zmq errors are handled by the caller
+        logerr("Error in connecting to partition {}: {}\n", id, e.what());
+        exit(EXIT_FAILURE);
+    }
     connected = true;
 }
 
 void PartitionEdgesStub::disconnect() {
     connected = false;
-    close(*socket);
+    transport->disconnect();
 }
 
 std::vector<std::string> PartitionEdgesStub::getEdgeVehicles(const std::string& edgeId) {
+    TraceScope trace("getEdgeVehicles", "to", id);
     int opcode = Operations::GET_EDGE_VEHICLES;
 
     log("Preparing getEdge\n");
 
     // As usual, add +1 to string size to include NULL endpoint
     int msgLength = sizeof(int) + edgeId.size() + 1;
-    zmq::message_t message(msgLength);
+    TransportMessage message(msgLength);
 
     auto data = static_cast<char*>(message.data());
     
@@ -82,12 +73,12 @@ std::vector<std::string> PartitionEdgesStub::getEdgeVehicles(const std::string&
     std::memcpy( data + sizeof(int), edgeId.data(),  edgeId.size() + 1);
 
     log("Sending getEdge\n");
-    socket->send(message, zmq::send_flags::none);
+    transport->sendRequest(message);
     owner.incMsgCount(true);
 
     log("Receiving getEdge reply\n");
-    zmq::message_t reply;
-    auto response = socket->recv(reply);
+    TransportMessage reply;
+    transport->receiveReply(reply);
 
     auto out = readStringsFromMessage(reply);
 
@@ -103,13 +94,14 @@ std::vector<std::string> PartitionEdgesStub::getEdgeVehicles(const std::string&
 }
 
 bool PartitionEdgesStub::hasVehicle(const std::string& vehId) {
+    TraceScope trace("hasVehicle", "to", id);
     int opcode = Operations::HAS_VEHICLE;
 
     // As usual, add +1 to string size to include NULL endpoint
     int msgLength = sizeof(int) + vehId.size() + 1;
     log("Preparing hasVehicle({}) [{}]\n", vehId, msgLength);
 
-    zmq::message_t message(msgLength);
+    TransportMessage message(msgLength);
 
     auto data = static_cast<char*>(message.data());
     
@@ -117,12 +109,12 @@ bool PartitionEdgesStub::hasVehicle(const std::string& vehId) {
     std::memcpy(data + sizeof(int), vehId.data(), vehId.size() + 1);
 
     log("Sending hasVehicle\n");
-    socket->send(message, zmq::send_flags::none);
+    transport->sendRequest(message);
     owner.incMsgCount(true);
 
     log("Receiving hasVehicle reply\n");
-    zmq::message_t reply;
-    auto response = socket->recv(reply);
+    TransportMessage reply;
+    transport->receiveReply(reply);
 
     bool result;
     std::memcpy(&result, static_cast<char*>(reply.data()), sizeof(bool));
@@ -133,6 +125,7 @@ bool PartitionEdgesStub::hasVehicle(const std::string& vehId) {
 }
 
 bool PartitionEdgesStub::hasVehicleInEdge(const std::string& vehId, const std::string& edgeId) {
+    TraceScope trace("hasVehicleInEdge", "to", id);
     int opcode = Operations::HAS_VEHICLE_IN_EDGE;
 
     log("Preparing hasVehicleInEdge({}, {})\n", vehId, edgeId);
@@ -146,12 +139,12 @@ bool PartitionEdgesStub::hasVehicleInEdge(const std::string& vehId, const std::s
     std::memcpy(data, &opcode, sizeof(int));
 
     log("Sending hasVehicleInEdge\n");
-    socket->send(message, zmq::send_flags::none);
+    transport->sendRequest(message);
     owner.incMsgCount(true);
 
     log("Receiving hasVehicleInEdge reply\n");
-    zmq::message_t reply;
-    auto response = socket->recv(reply);
+    TransportMessage reply;
+    transport->receiveReply(reply);
 
     bool result;
     std::memcpy(&result, static_cast<char*>(reply.data()), sizeof(bool));
@@ -162,13 +155,14 @@ bool PartitionEdgesStub::hasVehicleInEdge(const std::string& vehId, const std::s
 }
 
 void PartitionEdgesStub::setVehicleSpeed(const string& vehId, double speed) {
+    TraceScope trace("setVehicleSpeed", "to", id);
     int opcode = Operations::SET_VEHICLE_SPEED;
 
     log("Preparing setVehicleSpeed({}, {})\n", vehId, speed);
 
     // As usual, add +1 to string size to include NULL endpoint
     size_t msgLength = sizeof(int) + sizeof(double) + vehId.size() + 1;
-    zmq::message_t message(msgLength);
+    TransportMessage message(msgLength);
 
     char* data = static_cast<char*>(message.data());
     std::memcpy(data,
@@ -179,19 +173,15 @@ void PartitionEdgesStub::setVehicleSpeed(const string& vehId, double speed) {
         vehId.data(), vehId.size() + 1);
 
     log("Sending setSpeed\n");
-    socket->send(message, zmq::send_flags::none);
+    transport->sendAsync(message);
     owner.incMsgCount(true);
-
-    log("Receiving setSpeed reply\n");
-    // unused reply, required by zeroMQ
-    zmq::message_t reply;
-    auto response = socket->recv(reply);
 }
 
 void PartitionEdgesStub::addVehicle(
     const std::string& vehId, const std::string& routeId, const std::string& vehType,
     const std::string& laneId, int laneIndex, double lanePos, double speed
 ) {
+    TraceScope trace("addVehicle", "to", id);
     int opcode = Operations::ADD_VEHICLE;
 
     log("Preparing addVehicle({}, {}, {}, {}, {}, {})\n",
@@ -217,13 +207,199 @@ void PartitionEdgesStub::addVehicle(
         &speed,  sizeof(double));
 
     log("Sending addVehicle\n");
-    socket->send(message, zmq::send_flags::none);
+    transport->sendAsync(message);
     owner.incMsgCount(true);
+}
+
+void PartitionEdgesStub::queueAddVehicle(
+    const std::string& vehId, const std::string& routeId, const std::string& vehType,
+    const std::string& laneId, int laneIndex, double lanePos, double speed
+) {
+    log("Queueing addVehicle({}, {}, {}, {}, {}, {})\n",
+        vehId, routeId, vehType, laneId, laneIndex, lanePos, speed);
+
+    pendingAddVehicles.push_back({
+        vehId, routeId, vehType, laneId, laneIndex, lanePos, speed
+    });
+}
+
+void PartitionEdgesStub::flushAddVehicles(double time) {
+    if (pendingAddVehicles.empty()) return;
+
+    TraceScope trace("flushAddVehicles", "to", id);
+    int opcode = Operations::ADD_VEHICLES_BATCH;
+    int count = pendingAddVehicles.size();
+
+    log("Preparing addVehiclesBatch({} vehicles)\n", count);
+
+    // Strings are sent as ids, see IdDictionary, with the
+    // strings sent for the first time defined in the same message
+    vector<pair<wireId_t, string_view>> definitions;
+    vector<wireId_t> entryIds;
+    entryIds.reserve(count * 4);
+    for (auto& addVeh : pendingAddVehicles) {
+        entryIds.push_back(sendIds.encode(addVeh.vehId, definitions));
+        entryIds.push_back(sendIds.encode(addVeh.routeId, definitions));
+        entryIds.push_back(sendIds.encode(addVeh.vehType, definitions));
+        entryIds.push_back(sendIds.encode(addVeh.laneId, definitions));
+    }
+    int numDefinitions = definitions.size();
+
+    // opcode, definitions num, vehicles num, time, then the ids of the definitions,
+    // then vehicle, route, type, lane ids, laneIndex, lanePos, speed for each vehicle,
+    // then the strings of the definitions (with the count, as in createMessageWithStrings)
+    const size_t entrySize = sizeof(wireId_t) * 4 + sizeof(int) + sizeof(double) * 2;
+    size_t msgLength = sizeof(int) * 3 + sizeof(double) + sizeof(wireId_t) * numDefinitions
+        + entrySize * count + sizeof(int);
+    for (auto& definition : definitions) {
+        msgLength += messageStringSize(definition.second);
+    }
+    // Write everything directly in the message, without intermediate copies
+    TransportMessage message(msgLength);
+    MessageWriter writer(message);
+
+    writer.write(opcode);
+    writer.write(numDefinitions);
+    writer.write(count);
+    writer.write(time);
+    for (auto& definition : definitions) {
+        writer.write(definition.first);
+    }
+    for (int i = 0; i < count; i++) {
+        auto& addVeh = pendingAddVehicles[i];
+        writer.writeBytes(&entryIds[i * 4], sizeof(wireId_t) * 4);
+        writer.write(addVeh.laneIndex);
+        writer.write(addVeh.lanePos);
+        writer.write(addVeh.speed);
+    }
+    writer.write(numDefinitions);
+    for (auto& definition : definitions) {
+        writer.writeString(definition.second);
+    }
+
+    // Vehicles only cross the link once per handoff, their ids are given
+    // to the next ones instead of growing the dictionary
+    for (auto& addVeh : pendingAddVehicles) {
+        sendIds.release(addVeh.vehId);
+    }
+    pendingAddVehicles.clear();
+
+    log("Sending addVehiclesBatch ({} new ids)\n", numDefinitions);
+    transport->sendAsync(message);
+    owner.incMsgCount(true);
+}
 
-    log("Receiving addVehicle reply\n");
-    // unused reply, required by zeroMQ
-    zmq::message_t reply;
-    auto response = socket->recv(reply);
+void PartitionEdgesStub::queueVehicleDelta(const vector<string>& added, const vector<string>& removed) {
+    pendingDeltaAdded.insert(added.begin(), added.end());
+    for (auto& vehId : removed) {
+        // Added and removed before being sent, the target never needs to know
+        auto pendingIt = pendingDeltaAdded.find(vehId);
+        if (pendingIt != pendingDeltaAdded.end()) {
+            pendingDeltaAdded.erase(pendingIt);
+            continue;
+        }
+        auto it = reportedVehicles.find(vehId);
+        if (it != reportedVehicles.end()) {
+            reportedVehicles.erase(it);
+            pendingDeltaRemoved.push_back(vehId);
+        }
+    }
+}
+
+void PartitionEdgesStub::flushVehicleDelta() {
+    if (pendingDeltaAdded.empty() && pendingDeltaRemoved.empty()) return;
+
+    TraceScope trace("flushVehicleDelta", "to", id);
+    int opcode = Operations::VEHICLE_DELTA;
+    int numAdded = pendingDeltaAdded.size();
+    int numStrings = numAdded + pendingDeltaRemoved.size();
+    log("Sending vehicleDelta(+{}, -{})\n", numAdded, pendingDeltaRemoved.size());
+
+    // opcode, amount of added vehicles, then added and removed ids as strings
+    size_t msgLength = sizeof(int) * 3;
+    for (auto& vehId : pendingDeltaAdded) msgLength += messageStringSize(vehId);
+    for (auto& vehId : pendingDeltaRemoved) msgLength += messageStringSize(vehId);
+
+    TransportMessage message(msgLength);
+    MessageWriter writer(message);
+    writer.write(opcode);
+    writer.write(numAdded);
+    writer.write(numStrings);
+    for (auto& vehId : pendingDeltaAdded) writer.writeString(vehId);
+    for (auto& vehId : pendingDeltaRemoved) writer.writeString(vehId);
+
+    reportedVehicles.insert(pendingDeltaAdded.begin(), pendingDeltaAdded.end());
+    pendingDeltaAdded.clear();
+    pendingDeltaRemoved.clear();
+
+    transport->sendAsync(message);
+    owner.incMsgCount(true);
+}
+
+void PartitionEdgesStub::sendStepFence() {
+    TraceScope trace("sendStepFence", "to", id);
+    int opcode = Operations::STEP_FENCE;
+
+    TransportMessage message(sizeof(int));
+    std::memcpy(message.data(), &opcode, sizeof(int));
+
+    log("Sending step fence\n");
+    // Messages on the same socket arrive in order, so once the
+    // neighbor receives this it has all the operations of the step
+    transport->sendAsync(message);
+    owner.incMsgCount(true);
+}
+
+void PartitionEdgesStub::sendPartitionDone() {
+    TraceScope trace("sendPartitionDone", "to", id);
+    int opcode = Operations::PARTITION_DONE;
+
+    TransportMessage message(sizeof(int));
+    std::memcpy(message.data(), &opcode, sizeof(int));
+
+    log("Sending partition done\n");
+    // After the last fence, on the same channel
+    transport->sendAsync(message);
+    owner.incMsgCount(true);
+}
+
+void PartitionEdgesStub::sendCancelVehicles(const vector<pair<string, double>>& vehicles) {
+    if (vehicles.empty()) return;
+
+    TraceScope trace("sendCancelVehicles", "to", id);
+    int opcode = Operations::CANCEL_VEHICLES;
+    int count = vehicles.size();
+    log("Sending cancelVehicles ({} vehicles)\n", count);
+
+    // opcode, count, time of each vehicle, then the vehicle ids as strings
+    size_t msgLength = sizeof(int) * 3 + sizeof(double) * count;
+    for (auto& vehicle : vehicles) msgLength += messageStringSize(vehicle.first);
+
+    TransportMessage message(msgLength);
+    MessageWriter writer(message);
+    writer.write(opcode);
+    writer.write(count);
+    for (auto& vehicle : vehicles) writer.write(vehicle.second);
+    writer.write(count);
+    for (auto& vehicle : vehicles) writer.writeString(vehicle.first);
+
+    // Same channel as the vehicles, so it arrives after them
+    transport->sendAsync(message);
+    owner.incMsgCount(true);
+}
+
+void PartitionEdgesStub::sendAckVehicles(uint64_t count) {
+    TraceScope trace("sendAckVehicles", "to", id);
+    int opcode = Operations::ACK_VEHICLES;
+
+    TransportMessage message(sizeof(int) + sizeof(uint64_t));
+    MessageWriter writer(message);
+    writer.write(opcode);
+    writer.write(count);
+
+    log("Sending ackVehicles({})\n", count);
+    transport->sendAsync(message);
+    owner.incMsgCount(true);
 }
 
 template<typename... _Args > 
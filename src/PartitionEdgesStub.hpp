@@ -10,6 +10,10 @@ Author: Filippo Lenzi
 
 #include <zmq.hpp>
 #include <format>
+#include <unordered_set>
+
+#include "IdDictionary.hpp"
+#include "Transport.hpp"
 
 class PartitionEdgesStub;
 
@@ -23,8 +27,20 @@ private:
     PartitionManager& owner;
     partId_t id;
     bool connected;
-    const std::string socketUri;
-    zmq::socket_t* socket;
+    // Requests with a reply for getters, async messages for operations that
+    // modify the target partition, which are applied after the step barrier
+    // anyways so need no reply
+    ClientTransport* transport;
+    // addVehicle calls buffered during the step, sent together by flushAddVehicles
+    std::vector<add_veh_t> pendingAddVehicles;
+    // Ids used for the strings in batched messages
+    IdDictionary sendIds;
+    // Vehicles the target partition was told are in this partition,
+    // to only send removals for those
+    std::unordered_set<std::string> reportedVehicles;
+    // Vehicle changes not sent yet, see queueVehicleDelta
+    string_set pendingDeltaAdded;
+    std::vector<std::string> pendingDeltaRemoved;
 
     template<typename... _Args > 
         void log(std::format_string<_Args...>  format, _Args&&... args);
@@ -37,6 +53,12 @@ public:
         HAS_VEHICLE_IN_EDGE,
         SET_VEHICLE_SPEED,
         ADD_VEHICLE,
+        ADD_VEHICLES_BATCH,
+        STEP_FENCE,
+        VEHICLE_DELTA,
+        PARTITION_DONE,
+        CANCEL_VEHICLES,
+        ACK_VEHICLES,
     };
 
     PartitionEdgesStub(PartitionManager& owner, partId_t targetId, int numThreads, zmq::context_t& zcontext, Args& args);
@@ -52,6 +74,31 @@ public:
         const std::string& vehId, const std::string& routeId, const std::string& vehType,
         const std::string& laneId, int laneIndex, double lanePos, double speed
     );
+    // Same as addVehicle, but buffered locally until flushAddVehicles is called,
+    // to send all of a step's vehicles in a single message
+    void queueAddVehicle(
+        const std::string& vehId, const std::string& routeId, const std::string& vehType,
+        const std::string& laneId, int laneIndex, double lanePos, double speed
+    );
+    // time: simulation time the vehicles should be added at, checked by the target
+    void flushAddVehicles(double time);
+    // Signal that all of this step's modifying operations were sent,
+    // must be called once per step before the step barrier
+    void sendStepFence();
+    // Neighbor sync mode: this partition stopped, so the target
+    // should not wait for its step fences anymore
+    void sendPartitionDone();
+    // Optimistic sync mode: undo vehicles (id and time) sent in steps this
+    // partition rolled back, see TimeWarp
+    void sendCancelVehicles(const std::vector<std::pair<std::string, double>>& vehicles);
+    // Optimistic sync mode: the first count vehicles and cancellations
+    // from the target were taken, see TimeWarp::getLocalTime
+    void sendAckVehicles(uint64_t count);
+    // Update the target partition's copy of which vehicles are in this one,
+    // added should only contain vehicles relevant to the target; buffered
+    // until flushVehicleDelta, to only send changes at synchronization steps
+    void queueVehicleDelta(const std::vector<std::string>& added, const std::vector<std::string>& removed);
+    void flushVehicleDelta();
 
     void connect();
     void disconnect();
@@ -11,7 +11,10 @@ Contributions: Filippo Lenzi
 #include "PartitionManager.hpp"
 
 #include <bits/chrono.h>
+#include <cctype>
+#include <charconv>
 #include <cstddef>
+#include <cmath>
 #include <cstdlib>
 #include <exception>
 #include <filesystem>
@@ -21,14 +24,17 @@ Contributions: Filippo Lenzi
 #include <iterator>
 #include <libsumo/Edge.h>
 #include <libsumo/Simulation.h>
+#include <libsumo/TraCIConstants.h>
 #include <libsumo/Vehicle.h>
 #include <mutex>
 #include <queue>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <chrono>
 #include <thread>
 #include <time.h>
+#include <sys/resource.h>
 #include <algorithm>
 #include <unordered_map>
 #include <vector>
@@ -42,6 +48,7 @@ Contributions: Filippo Lenzi
 #include "NeighborPartitionHandler.hpp"
 #include "PartitionEdgesStub.hpp"
 #include "ParallelSim.hpp"
+#include "Tracer.hpp"
 #include "partArgs.hpp"
 #include "src/globals.hpp"
 #include "src/psumoTypes.hpp"
@@ -49,6 +56,9 @@ Contributions: Filippo Lenzi
 #include "args.hpp"
 
 static int numInstancesRunning = 0;
+// Meters around the outgoing border edges the context subscriptions
+// select vehicles in, see subscribeOutgoingEdges
+static const double OUTGOING_EDGE_RANGE = 1;
 
 using namespace libsumo;
 using namespace std;
@@ -61,10 +71,10 @@ Note that LibSumo is static, so each PartitionManager must be on its own process
 PartitionManager::PartitionManager(
   const string binary,
   partId_t id, string& cfg, int endTime,
-  vector<partId_t>& neighborPartitions,
-  unordered_map<partId_t, unordered_set<string>>& neighborRoutes,
-  unordered_map<string, unordered_set<string>>& routeEndsInEdges,
+  const vector<partId_t>& neighborPartitions,
+  const PartitionData& partData,
   float lastDepartTime,
+  const IdTable& idTable,
   zmq::context_t& zcontext, int numThreads,
   vector<string> sumoArgs,
   PartArgs& args
@@ -74,9 +84,9 @@ PartitionManager::PartitionManager(
   cfg(cfg),
   endTime(endTime),
   neighborPartitions(neighborPartitions),
-  neighborRoutes(neighborRoutes),
-  routeEndsInEdges(routeEndsInEdges),
+  partData(partData),
   lastDepartTime(lastDepartTime),
+  idTable(idTable),
   zcontext(zcontext),
   sumoArgs(sumoArgs),
   args(args),
@@ -84,10 +94,17 @@ PartitionManager::PartitionManager(
   running(false)
   {
     coordinatorSocket = makeSocket(zcontext, zmq::socket_type::req);
+    if (args.syncMode == SyncMode::GLOBAL) {
+      stepBarrier = makeStepBarrier(args.barrierType, zcontext, *coordinatorSocket,
+        args.dataDir, args.partitionHosts, id, numThreads, args.transportType, args.barrierSpin);
+    }
+    if (args.handlerMode == HandlerMode::REACTOR) {
+      handlerReactor = new HandlerReactor(args, id);
+    }
     for (partId_t partId : neighborPartitions) {
       auto stub = new PartitionEdgesStub(*this, partId, numThreads, zcontext, args);
       neighborPartitionStubs[partId] = stub;
-      auto clientHandler = new NeighborPartitionHandler(*this, partId);
+      auto clientHandler = new NeighborPartitionHandler(*this, partId, handlerReactor);
       neighborClientHandlers[partId] = clientHandler;
     }
 
@@ -95,14 +112,18 @@ PartitionManager::PartitionManager(
   }
 
 PartitionManager::~PartitionManager() {
+  delete stepBarrier;
   delete coordinatorSocket;
+  delete timeWarp;
   for (partId_t partId : neighborPartitions) {
     delete neighborPartitionStubs[partId];
     delete neighborClientHandlers[partId];
   }
+  // After the handlers, which wake it when stopping
+  delete handlerReactor;
 }
 
-void PartitionManager::setBorderEdges(vector<border_edge_t>& borderEdges) {
+void PartitionManager::setBorderEdges(const vector<border_edge_t>& borderEdges) {
   for(border_edge_t e : borderEdges) {
     if(e.to == id)
       incomingBorderEdges.push_back(e);
@@ -111,7 +132,49 @@ void PartitionManager::setBorderEdges(vector<border_edge_t>& borderEdges) {
   }
 }
 
-const char* getRoutesFilesValue(string cfg) {
+void PartitionManager::setNeighborLookaheads(const unordered_map<partId_t, double>& lookaheads) {
+  neighborLookaheads = lookaheads;
+}
+
+void PartitionManager::computeSyncIntervals() {
+  double deltaT = Simulation::getDeltaT();
+  statusInterval = -1;
+  for (partId_t partId : neighborPartitions) {
+    // Optimistic mode exchanges vehicles every step, without waiting
+    int interval = 1;
+    auto it = neighborLookaheads.find(partId);
+    if (args.syncMode == SyncMode::LOOKAHEAD && it != neighborLookaheads.end()) {
+      // Both neighbors get the same value, as the lookahead is the same both ways
+      interval = max(1, (int) floor(it->second / deltaT));
+    }
+    if (args.syncInterval > 0) {
+      // Same for all partitions, so global sync can skip the barrier in between
+      interval = args.syncInterval;
+      if (it != neighborLookaheads.end() && interval * deltaT > it->second) {
+        logerr("[WARN] Sync interval of {} steps ({}s) longer than vehicles take to cross the border with partition {} ({:.2f}s, {} steps), vehicles may be lost\n",
+          interval, interval * deltaT, partId, it->second, max(1, (int) floor(it->second / deltaT)));
+      }
+    }
+    neighborSyncIntervals[partId] = interval;
+    if (statusInterval < 0 || interval < statusInterval) statusInterval = interval;
+  }
+  if (statusInterval < 0) statusInterval = max(1, args.syncInterval);
+  // Only needed for the end and fossil collection, no need to report every step
+  if (args.syncMode == SyncMode::OPTIMISTIC) statusInterval = args.checkpointInterval;
+
+  if (args.syncMode == SyncMode::LOOKAHEAD || args.syncInterval > 1) {
+    for (auto& [partId, interval] : neighborSyncIntervals) {
+      log("Syncing with partition {} every {} steps\n", partId, interval);
+    }
+  }
+}
+
+bool PartitionManager::isSyncStep(partId_t partId) {
+  // All partitions start from step 0, so neighbors agree on the sync steps
+  return (step + 1) % neighborSyncIntervals[partId] == 0;
+}
+
+string getRoutesFilesValue(string cfg) {
   tinyxml2::XMLDocument cfgDoc;
   tinyxml2::XMLError e = cfgDoc.LoadFile(cfg.c_str());
   if(e) {
@@ -142,42 +205,131 @@ const char* getRoutesFilesValue(string cfg) {
   return routeFilesValue;
 }
 
-void PartitionManager::loadRouteMetadata() {
-  auto routeFilesValue = getRoutesFilesValue(cfg);
-
-  // NOTE: this assumes that there is only one route file, which is the output for 
-  // the partitioning script
-  const filesystem::path dir = filesystem::path(cfg).relative_path().parent_path();
-  const filesystem::path routeFile = dir / routeFilesValue;
-  tinyxml2::XMLDocument routeDoc;
-  tinyxml2::XMLError e = routeDoc.LoadFile(routeFile.c_str());
-  if(e) {
-    logerr("{} - when loading {}\n", routeDoc.ErrorIDToName(e), routeFile.string());
+// Ids of the top level route elements in the routes file, only for older
+// partition data without the route table
+static vector<string> readRouteIds(const filesystem::path& routeFile) {
+  tinyxml2::XMLDocument routesDoc;
+  tinyxml2::XMLError e = routesDoc.LoadFile(routeFile.c_str());
+  if (e) {
+    cerr << "Failed to read routes file " << routeFile << ": " << routesDoc.ErrorIDToName(e) << endl;
     exit(EXIT_FAILURE);
   }
-  tinyxml2::XMLElement* routesEl = routeDoc.FirstChildElement("routes");
+  tinyxml2::XMLElement* routesEl = routesDoc.FirstChildElement("routes");
   if (routesEl == nullptr) {
-    std::cout << "sumo routes file error: no routes" << std::endl;
+    cerr << "sumo routes file error: no routes" << endl;
     exit(EXIT_FAILURE);
   }
 
-  for (
-    tinyxml2::XMLElement* route = routesEl->FirstChildElement("route"); 
-    route; 
-    route = route->NextSiblingElement("route")
+  vector<string> routeIds;
+  for (auto routeEl = routesEl->FirstChildElement("route"); routeEl != nullptr;
+    routeEl = routeEl->NextSiblingElement("route")
   ) {
-    auto routeId = route->Attribute("id");
-    if (routeId) {
-      string routeIdStr(routeId);
-      int partIndex = routeIdStr.find("_part");
-      // Route id contains part -> is multipart
-      if (partIndex != string::npos) {
-        multipartRoutes.insert(routeIdStr.substr(0, partIndex));
+    const char* routeId = routeEl->Attribute("id");
+    if (!routeId) {
+      cerr << "sumo routes file error: route with no id!" << endl;
+      exit(EXIT_FAILURE);
+    }
+    routeIds.emplace_back(routeId);
+  }
+  return routeIds;
+}
+
+void PartitionManager::loadRouteMetadata() {
+  // Older partition data doesn't have the route table, read it from the routes file
+  if (!partData.hasRouteIds()) {
+    // NOTE: this assumes that there is only one route file, which is the output for 
+    // the partitioning script
+    const filesystem::path dir = filesystem::path(cfg).relative_path().parent_path();
+    const filesystem::path routeFile = dir / getRoutesFilesValue(cfg);
+    log("No route table in partition data, reading {}\n", routeFile.string());
+    auto fileRouteIds = readRouteIds(routeFile);
+    indexRoutes(vector<string_view>(fileRouteIds.begin(), fileRouteIds.end()));
+  } else {
+    indexRoutes(partData.getRouteIds());
+  }
+
+  buildOutgoingRouteTables();
+
+  baseRouteNeighbors.assign(baseRouteIds.size(), {});
+  for (size_t baseIndex = 0; baseIndex < baseRouteIds.size(); baseIndex++) {
+    for (partId_t partId : neighborPartitions) {
+      if (partData.neighborHasRoute(partId, baseRouteIds[baseIndex])) {
+        baseRouteNeighbors[baseIndex].push_back(partId);
+      }
+    }
+  }
+}
+
+void PartitionManager::indexRoutes(const vector<string_view>& partRouteIds) {
+  for (string_view routeId : partRouteIds) {
+    string routeIdStr(routeId);
+    string baseRouteId = routeIdStr;
+    int partNum = -1;
+    size_t partIndex = routeIdStr.find("_part");
+    // Route id ends with _partN -> is multipart; other ids containing
+    // _part are plain routes
+    if (partIndex != string::npos) {
+      const char* numberStart = routeIdStr.data() + partIndex + 5;
+      const char* numberEnd = routeIdStr.data() + routeIdStr.size();
+      int number;
+      auto [end, err] = from_chars(numberStart, numberEnd, number);
+      if (err == errc() && end == numberEnd && numberStart != numberEnd && number >= 0) {
+        baseRouteId = routeIdStr.substr(0, partIndex);
+        partNum = number;
       }
+    }
+
+    auto baseIt = baseRouteIndex.find(baseRouteId);
+    int baseIndex;
+    if (baseIt == baseRouteIndex.end()) {
+      baseIndex = baseRouteIds.size();
+      baseRouteIds.push_back(baseRouteId);
+      baseRouteParts.emplace_back();
+      baseRouteIndex[baseRouteId] = baseIndex;
     } else {
-      logerr("sumo routes file error: route with no id!\n");
-      exit(EXIT_FAILURE);
+      baseIndex = baseIt->second;
     }
+    routeIndex[routeIdStr] = {baseIndex, partNum};
+
+    if (partNum >= 0) {
+      auto& parts = baseRouteParts[baseIndex];
+      if (parts.size() <= (size_t) partNum) parts.resize(partNum + 1);
+      parts[partNum] = routeIdStr;
+    }
+  }
+}
+
+void PartitionManager::buildOutgoingRouteTables() {
+  outgoingEdgeRoutes.assign(outgoingBorderEdges.size(), {});
+  // Local routes ending in each border edge, read once per edge from the
+  // partition data instead of checking every route against every edge
+  string_map<vector<int>> edgeRouteEnds;
+  for (int outEdgeIdx = 0; outEdgeIdx < outgoingBorderEdges.size(); outEdgeIdx++) {
+    auto& borderEdge = outgoingBorderEdges[outEdgeIdx];
+
+    auto endsIt = edgeRouteEnds.find(borderEdge.id);
+    if (endsIt == edgeRouteEnds.end()) {
+      vector<int> routeEnds;
+      for (string_view route : partData.getRoutesEndingInEdge(borderEdge.id)) {
+        auto baseIt = baseRouteIndex.find(route);
+        if (baseIt != baseRouteIndex.end()) routeEnds.push_back(baseIt->second);
+      }
+      endsIt = edgeRouteEnds.emplace(borderEdge.id, std::move(routeEnds)).first;
+    }
+
+    vector<bool> edgeRoutes(baseRouteIds.size(), false);
+    bool any = false;
+    for (int baseIndex : endsIt->second) {
+      // The vehicle passes to the neighbor, and from this edge (not
+      // always the case in some simulation edge cases)
+      if (partData.neighborHasRoute(borderEdge.to, baseRouteIds[baseIndex])) {
+        edgeRoutes[baseIndex] = true;
+        any = true;
+      }
+    }
+    // No local routes ending in this edge means no vehicles will pass
+    // to the next from here; left empty then
+    if (any) outgoingEdgeRoutes[outEdgeIdx] = std::move(edgeRoutes);
   }
 }
 
@@ -235,29 +387,8 @@ vector<string> PartitionManager::getEdgeVehicles(const strarg_ edgeId) {
 }
 
 bool PartitionManager::hasVehicle(const string vehId) {
-  refreshVehicleIds();
-  
-  string vehIdToCheck(vehId);
-
-  // if (args.verbose) {
-  //   stringstream msg;
-  //   format_to(ostream_iterator<char>(msg), "\tManager {} | hasVehicle: current vehicles are [", id);
-  //   int i = 0;
-  //   for (auto id : allVehicleIds) {
-  //     msg << id;
-  //     if (i < allVehicleIds.size() - 1) msg << ", ";
-  //     i++;
-  //   }
-  //   msg << "]" << endl;
-  //   cout << msg.str();
-  // }
-
-  // logminor("PRE CONTAINS\n");
-  // TODO: it seems that this sometimes leads to a segfault when multiple neighbor handler threads
-  // access it, but it should be thread-safe; investigate later
-  auto found = std::find(allVehicleIds.begin(), allVehicleIds.end(), vehIdToCheck);
-  // logminor("POST CONTAINS\n");
-  return found != allVehicleIds.end();
+  shared_lock<shared_mutex> lock(allVehicleIds_lock);
+  return allVehicleIds.contains(vehId);
 }
 
 bool PartitionManager::hasVehicleInEdge(const strarg_ vehId, const strarg_ edgeId) {
@@ -266,7 +397,19 @@ bool PartitionManager::hasVehicleInEdge(const strarg_ vehId, const strarg_ edgeI
   return idx != edgeVehicles.end();
 }
 
-void PartitionManager::setVehicleSpeed(const strarg_ vehId, double speed) {
+void PartitionManager::updateNeighborVehicles(partId_t partId, const vector<string_view>& added, const vector<string_view>& removed) {
+  auto& vehicles = neighborVehicles[partId];
+  for (auto vehId : removed) {
+    auto it = vehicles.find(vehId);
+    if (it != vehicles.end()) vehicles.erase(it);
+  }
+  for (auto vehId : added) {
+    vehicles.emplace(vehId);
+  }
+}
+
+void PartitionManager::setVehicleSpeed(string_view vehIdView, double speed) {
+  const string vehId(vehIdView);
   // Using slowDown instead of setspeed as original program did it
   // Also use .c_str() for same reason as [getEdgeVehicles]
   #ifndef NDEBUG
@@ -285,37 +428,49 @@ void PartitionManager::setVehicleSpeed(const strarg_ vehId, double speed) {
 }
 
 void PartitionManager::addVehicle(
-  const strarg_ vehId, const strarg_ routeId, const strarg_ vehType,
-  const strarg_ laneId, int laneIndex, double lanePos, double speed
+  string_view vehIdView, string_view routeIdView, string_view vehTypeView,
+  string_view laneIdView, int laneIndex, double lanePos, double speed
 ) {
   // Regardless of outcome of following code, remove the added vehicle id
   // to handle multipart routes in where vehicles should be sent more than once
-  sentVehicles.erase(vehId);
+  auto sentIt = sentVehicles.find(vehIdView);
+  if (sentIt != sentVehicles.end()) sentVehicles.erase(sentIt);
+
+  // Neighbors check their copy of this partition's vehicles, which is one step
+  // behind, so a vehicle that just departed here might be sent anyways
+  // No lock needed, only this thread writes it
+  if (allVehicleIds.contains(vehIdView)) {
+    logminor("Vehicle {} already in partition, not adding\n", vehIdView);
+    return;
+  }
 
-  string routeIdAdapted;
+  // Only create strings when needed by SUMO
+  const string vehId(vehIdView), routeId(routeIdView),
+    vehType(vehTypeView), laneId(laneIdView);
+
+  const string* routeIdAdapted = &routeId;
   // Adapt vehicle routes in case of multipart routes
-  if (multipartRoutes.contains(routeId)) {
-    if (vehicleMultipartRouteProgress.contains(vehId)) {
+  auto baseIt = baseRouteIndex.find(routeId);
+  if (baseIt != baseRouteIndex.end() && !baseRouteParts[baseIt->second].empty()) {
+    size_t newPartProgress;
+    auto progressIt = vehicleMultipartRouteProgress.find(vehId);
+    if (progressIt != vehicleMultipartRouteProgress.end()) {
       // Will be set again when the vehicle exits, no need to set it here
-      int newPartProgress = vehicleMultipartRouteProgress[vehId] + 1;
-      routeIdAdapted = routeId + "_part" + to_string(newPartProgress); 
+      newPartProgress = progressIt->second + 1;
     } else {
       // Initialize it here, came from other partition
       vehicleMultipartRouteProgress[vehId] = 0;
-      routeIdAdapted = routeId + "_part0"; 
+      newPartProgress = 0;
     }
 
-    auto routes = Route::getIDList();
-    auto routeIt = find(routes.begin(), routes.end(), routeIdAdapted);
-
+    auto& parts = baseRouteParts[baseIt->second];
     // Edge case: if this part's route doesn't exist, it means a vehicle was added again after 
     // it did all the route parts, meaning its total route ends on another partition and on a
     // border edge TO this partition
-    if (routeIt == routes.end()) {
+    if (newPartProgress >= parts.size() || parts[newPartProgress].empty()) {
       return;
     }
-  } else {
-    routeIdAdapted = routeId;
+    routeIdAdapted = &parts[newPartProgress];
   }
 
   string lanePosStr = std::to_string(lanePos);
@@ -326,7 +481,7 @@ void PartitionManager::addVehicle(
   #endif
 
     Vehicle::add(
-      vehId, routeIdAdapted, vehType, "now", 
+      vehId, *routeIdAdapted, vehType, "now", 
       "first", "base", speedStr
     );
 
@@ -335,7 +490,8 @@ void PartitionManager::addVehicle(
     #endif
 
       Vehicle::moveTo(vehId, laneId, lanePos);
-      if (allVehicleIdsUpdated) {
+      {
+        unique_lock<shared_mutex> lock(allVehicleIds_lock);
         allVehicleIds.insert(vehId);
       }
 
@@ -397,84 +553,108 @@ void PartitionManager::handleIncomingEdges(int num, vector<vector<string>>& prev
   */
 }
 
-void PartitionManager::handleOutgoingEdges(int num, vector<vector<string>>& prevOutgoingVehicles) {
-  for(int outEdgeIdx = 0; outEdgeIdx < num; outEdgeIdx++) {
-    auto borderEdge = outgoingBorderEdges[outEdgeIdx];
-    vector<string> edgeVehicles = Edge::getLastStepVehicleIDs(borderEdge.id.c_str());
-    partId_t toId = borderEdge.to;
+void PartitionManager::subscribeOutgoingEdges() {
+  for (int outEdgeIdx = 0; outEdgeIdx < outgoingBorderEdges.size(); outEdgeIdx++) {
+    // No vehicles to send from the others
+    if (outgoingEdgeRoutes[outEdgeIdx].empty()) continue;
+    // Vehicles are selected by distance to the edge shape, a small range keeps
+    // the ones laterally offset or at rounding distance; the ones on other
+    // edges it catches (at the junctions) are skipped by road id
+    Edge::subscribeContext(outgoingBorderEdges[outEdgeIdx].id, CMD_GET_VEHICLE_VARIABLE, OUTGOING_EDGE_RANGE, {
+      VAR_ROAD_ID, VAR_ROUTE_ID, VAR_TYPE, VAR_LANE_ID, VAR_LANE_INDEX, VAR_LANEPOSITION, VAR_SPEED
+    });
+  }
+}
 
-    if(!edgeVehicles.empty()) {
-      auto toRoutesIt = neighborRoutes.find(toId);
-      if (toRoutesIt == neighborRoutes.end()) {
-        // No routes in neighbor somehow, continue
-        continue;
-      }
-      unordered_set<string> toRoutes = toRoutesIt->second;
+static inline const string& resultString(const TraCIResults& vars, int var) {
+  return static_cast<const TraCIString*>(vars.at(var).get())->value;
+}
 
-      auto routesEndingInEdgeIt = routeEndsInEdges.find(borderEdge.id);
-      if (routesEndingInEdgeIt == routeEndsInEdges.end()) {
-        // No local routes ending in this edge (meaning no vehicles
-        // will pass to the next from here), continue
-        continue;
-      }
-      unordered_set<string> routesEndingInEdge = routesEndingInEdgeIt->second;
+static inline int resultInt(const TraCIResults& vars, int var) {
+  return static_cast<const TraCIInt*>(vars.at(var).get())->value;
+}
+
+static inline double resultDouble(const TraCIResults& vars, int var) {
+  return static_cast<const TraCIDouble*>(vars.at(var).get())->value;
+}
+
+void PartitionManager::handleOutgoingEdges(int num) {
+  // All the border edges' vehicles and their variables in one call,
+  // see subscribeOutgoingEdges
+  const ContextSubscriptionResults edgeResults = Edge::getAllContextSubscriptionResults();
+  outgoingOccupancy.beginScan();
 
+  for(int outEdgeIdx = 0; outEdgeIdx < num; outEdgeIdx++) {
+    const auto& borderEdge = outgoingBorderEdges[outEdgeIdx];
+    partId_t toId = borderEdge.to;
+    // Vehicles entered since the last sync are still in the edge, see computeSyncIntervals
+    if (!isSyncStep(toId)) continue;
+    // Routes whose vehicles pass to the neighbor from here, see buildOutgoingRouteTables
+    const auto& edgeRoutes = outgoingEdgeRoutes[outEdgeIdx];
+    if (edgeRoutes.empty()) continue;
+    // Edges without vehicles can be left out
+    auto edgeIt = edgeResults.find(borderEdge.id);
+
+    if(edgeIt != edgeResults.end() && !edgeIt->second.empty()) {
       PartitionEdgesStub* partStub = neighborPartitionStubs[toId];
       
-      for(string veh : edgeVehicles) {
+      for(const auto& [veh, vars] : edgeIt->second) {
+        // Near the edge but not in it, see subscribeOutgoingEdges
+        if (resultString(vars, VAR_ROAD_ID) != borderEdge.id) continue;
+        // Whether the vehicle was not in the edge at its previous scan
+        bool entered = outgoingOccupancy.visit(outEdgeIdx, veh);
         // If we already sent this vehicle, do not waste
         // time in asking the target partition if it's there
         if (sentVehicles.contains(veh)) {
           continue;
         }
 
-        auto c_veh = veh.c_str();
-        string route = Vehicle::getRouteID(c_veh);
-
-        // check if vehicle is on split route
-        int routePartIdx = route.find("_part");
-        bool isMultipart = routePartIdx != string::npos;
-        if (isMultipart) {
-          // Pass just the "main" route id to addvehicle
-          string numStr = route.substr(routePartIdx + 5, route.size() - routePartIdx - 5);
-          int routePartNum = std::stoi(numStr);
-          vehicleMultipartRouteProgress[veh] = routePartNum;
-          route = route.substr(0, routePartIdx);
+        const string& route = resultString(vars, VAR_ROUTE_ID);
+        auto routeIt = routeIndex.find(route);
+        if (routeIt == routeIndex.end()) {
+          // Not from the route file, cannot be in the neighbor
+          continue;
         }
+        const route_index_t& routeInfo = routeIt->second;
 
-        if (!toRoutes.contains(route)) {
-          // Vehicle doesn't need to pass to neighbor
-          continue;
+        // check if vehicle is on split route
+        if (routeInfo.part >= 0) {
+          vehicleMultipartRouteProgress[veh] = routeInfo.part;
         }
 
-        if (!routesEndingInEdge.contains(route)) {
-          // Vehicle passes to neighbor, but not from this edge
-          // (Happens in some simulation edge cases)
+        if (!edgeRoutes[routeInfo.base]) {
+          // Vehicle doesn't need to pass to neighbor, or not from this edge
           continue;
         }
 
-        auto it = std::find(prevOutgoingVehicles[outEdgeIdx].begin(), prevOutgoingVehicles[outEdgeIdx].end(), veh);
         // vehicle is to be inserted in next partition
-        if(it == prevOutgoingVehicles[outEdgeIdx].end()) {
+        if(entered) {
           // check if vehicle not already on edge (if a vehicle starts on a border edge)
           // Used to check vehicles in the edge, change to this to save
           // message space, and to handle some edge cases a vehicle goes
           // from one border edge to another
-          bool alreayInTarget = partStub->hasVehicle(veh);
+          // Checked on the local copy of the neighbor's vehicles, which is
+          // up to date with the neighbor's previous step
+          // Not in optimistic mode, where the neighbor can be at any time and
+          // roll back; it drops the duplicates when adding them instead
+          bool alreayInTarget = timeWarp == nullptr && neighborVehicles[toId].contains(veh);
           if(!alreayInTarget) {
 
             #ifndef PSUMO_NO_EXC_CATCH
             try {
             #endif
-              // add vehicle to next partition
-              partStub->addVehicle(
-                veh, route, Vehicle::getTypeID(c_veh),
-                Vehicle::getLaneID(c_veh), 
-                Vehicle::getLaneIndex(c_veh),
-                Vehicle::getLanePosition(c_veh),
-                Vehicle::getSpeed(c_veh)
+              // add vehicle to next partition, will be sent
+              // with the other vehicles at the end of the scan
+              // Pass just the "main" route id to addvehicle
+              partStub->queueAddVehicle(
+                veh, baseRouteIds[routeInfo.base], resultString(vars, VAR_TYPE),
+                resultString(vars, VAR_LANE_ID), 
+                resultInt(vars, VAR_LANE_INDEX),
+                resultDouble(vars, VAR_LANEPOSITION),
+                resultDouble(vars, VAR_SPEED)
               );
               sentVehicles.insert(veh);
+              if (timeWarp != nullptr) timeWarp->recordSent(toId, Simulation::getTime(), veh);
             #ifndef PSUMO_NO_EXC_CATCH
             }
             catch(std::exception& e){
@@ -487,11 +667,47 @@ void PartitionManager::handleOutgoingEdges(int num, vector<vector<string>>& prev
         }
       }
     }
-    prevOutgoingVehicles[outEdgeIdx] = edgeVehicles;
+    outgoingOccupancy.finishEdge(outEdgeIdx);
+  }
+
+}
+
+void PartitionManager::sendVehicleDeltas(const vector<string>& entered, const vector<string>& left) {
+  // The copies are not used in optimistic mode, see handleOutgoingEdges
+  if (neighborPartitions.empty() || timeWarp != nullptr) return;
+
+  unordered_map<partId_t, vector<string>> neighborEntered, neighborLeft;
+  for (auto& veh : entered) {
+    auto routeIt = routeIndex.find(Vehicle::getRouteID(veh));
+    // Not from the route file, cannot be in the neighbors
+    if (routeIt == routeIndex.end()) continue;
+    int base = routeIt->second.base;
+    if (baseRouteNeighbors[base].empty()) continue;
+    deltaVehicleRoutes[veh] = base;
+    // Neighbors only check vehicles on the routes they have
+    for (partId_t neighId : baseRouteNeighbors[base]) {
+      neighborEntered[neighId].push_back(veh);
+    }
+  }
+  // Arrived vehicles are not in the simulation anymore, use the
+  // route they entered with
+  for (auto& veh : left) {
+    auto routeIt = deltaVehicleRoutes.find(veh);
+    if (routeIt == deltaVehicleRoutes.end()) continue;
+    for (partId_t neighId : baseRouteNeighbors[routeIt->second]) {
+      neighborLeft[neighId].push_back(veh);
+    }
+    deltaVehicleRoutes.erase(routeIt);
+  }
+
+  for (auto& stub : neighborPartitionStubs) {
+    stub.second->queueVehicleDelta(neighborEntered[stub.first], neighborLeft[stub.first]);
+    if (isSyncStep(stub.first)) stub.second->flushVehicleDelta();
   }
 }
 
 void PartitionManager::arriveWaitBarrier() {
+  TraceScope trace("barrier");
   int opcode = ParallelSim::SyncOps::BARRIER;
   zmq::message_t message(sizeof(int));
   std::memcpy(message.data(), &opcode, sizeof(int));
@@ -506,25 +722,133 @@ void PartitionManager::arriveWaitBarrier() {
   logminor("Reached barrier...\n", id); //TEMP
 }
 
+void PartitionManager::reportReady(double startupSeconds) {
+  TraceScope trace("ready");
+  int opcode = ParallelSim::SyncOps::READY;
+  zmq::message_t message(sizeof(int) + sizeof(double));
+  auto data = static_cast<char*>(message.data());
+  std::memcpy(data, &opcode, sizeof(int));
+  std::memcpy(data + sizeof(int), &startupSeconds, sizeof(double));
+  coordinatorSocket->send(message, zmq::send_flags::none);
+
+  logminor("Ready after {}s, waiting for the other partitions...\n", startupSeconds);
+
+  auto _ = coordinatorSocket->recv(message);
+
+  logminor("All partitions ready\n");
+}
+
 void PartitionManager::finishStepWait() {
-  int opcode = ParallelSim::SyncOps::BARRIER_STEP;
   bool maybeFinished = isMaybeFinished();
 
-  zmq::message_t message(sizeof(int) + sizeof(bool));
+  logminor("Waiting for step end barrier, maybe finished: {}...\n", maybeFinished);
+
+  // Blocks until all partitions arrived, finished if all of them are
+  Tracer::begin("stepBarrier", "step", step);
+  finished = stepBarrier->arriveAndWait(maybeFinished);
+  Tracer::end("stepBarrier");
+
+  logminor("Reached step end barrier, is finished: {}...\n", finished);
+}
+
+void PartitionManager::reportStepStatus() {
+  TraceScope trace("stepStatus", "step", step);
+  int opcode = ParallelSim::SyncOps::STEP_STATUS;
+
+  // Lowest time this partition can send vehicles for, see TimeWarp
+  double localTime = Simulation::getTime();
+  if (timeWarp != nullptr) localTime = timeWarp->getLocalTime(localTime);
+
+  // Send since when instead of if, as partitions can report at different steps
+  zmq::message_t message(sizeof(int) * 3 + sizeof(double) * 2);
   auto data = static_cast<char*>(message.data());
   std::memcpy(data, &opcode, sizeof(int));
-  std::memcpy(data + sizeof(int), &maybeFinished, sizeof(bool));
+  std::memcpy(data + sizeof(int), &step, sizeof(int));
+  std::memcpy(data + sizeof(int) * 2, &emptySince, sizeof(int));
+  std::memcpy(data + sizeof(int) * 3, &localTime, sizeof(double));
+  std::memcpy(data + sizeof(int) * 3 + sizeof(double), &emptySinceTime, sizeof(double));
 
   coordinatorSocket->send(message, zmq::send_flags::none);
 
-  logminor("Waiting for step end barrier, maybe finished: {}...\n", maybeFinished);
-
-  // Receive response, essentially blocking
-  zmq::message_t reply(sizeof(bool));
+  // Replied immediately
+  zmq::message_t reply(sizeof(bool) + sizeof(double));
   auto result = coordinatorSocket->recv(reply);
-  std::memcpy(&finished, reply.data(), sizeof(bool));
+  auto replyData = static_cast<char*>(reply.data());
+  std::memcpy(&finished, replyData, sizeof(bool));
+  std::memcpy(&gvt, replyData + sizeof(bool), sizeof(double));
+
+  if (timeWarp != nullptr) {
+    timeWarp->fossilCollect(gvt);
+    // Only after the coordinator has the report including them, so the
+    // senders stop counting them in their local time after that
+    for (auto& stub : neighborPartitionStubs) {
+      uint64_t count;
+      if (timeWarp->takeAck(stub.first, count)) stub.second->sendAckVehicles(count);
+    }
+  }
 
-  logminor("Reached step end barrier, is finished: {}...\n", finished);
+  logminor("Reported step {} status, empty since: {}, is finished: {}, gvt: {}\n", step, emptySince, finished, gvt);
+}
+
+bool PartitionManager::handleOptimisticOperations() {
+  for (partId_t partId : neighborPartitions) {
+    neighborClientHandlers[partId]->takeOperations(*timeWarp);
+  }
+
+  if (timeWarp->needsRollback()) {
+    unordered_map<partId_t, vector<pair<string, double>>> cancel;
+    int restoredStep = timeWarp->rollback(step, cancel, vehicleMultipartRouteProgress);
+    if (restoredStep >= 0) {
+      log("Rolled back from step {} to step {}\n", step, restoredStep);
+      step = restoredStep;
+      for (auto& stub : neighborPartitionStubs) {
+        stub.second->sendCancelVehicles(cancel[stub.first]);
+        // Will be sent again if they get there in the new run
+        for (auto& vehicle : cancel[stub.first]) sentVehicles.erase(vehicle.first);
+      }
+      // Vehicles in the border edges are checked again from scratch
+      outgoingOccupancy.reset();
+      rebuildVehicleIds();
+      emptySince = -1;
+      // Not empty anymore, or the restored state will be simulated again
+      finished = false;
+      return true;
+    }
+  }
+
+  for (auto vehicle : timeWarp->takeDue(Simulation::getTime())) {
+    addVehicle(
+      vehicle->vehId, vehicle->routeId, vehicle->vehType,
+      vehicle->laneId, vehicle->laneIndex, vehicle->lanePos, vehicle->speed
+    );
+  }
+  return false;
+}
+
+bool PartitionManager::canStopOptimistic() {
+  reportStepStatus();
+  if (handleOptimisticOperations()) return false;
+
+  // All partitions reached this time, or were all empty
+  if (gvt >= Simulation::getTime() - Simulation::getDeltaT() / 2 || (endTime < 0 && finished)) return true;
+  for (partId_t partId : neighborPartitions) {
+    if (neighborClientHandlers[partId]->isNeighborDone()) return true;
+  }
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  return false;
+}
+
+void PartitionManager::writeTimeWarpMetrics() {
+  int simulated = timeWarp->getSimulatedSteps();
+  double rollbackRate = simulated > 0 ? (double) timeWarp->getRollbacks() / simulated : 0;
+  log("{} rollbacks ({} steps rolled back) in {} simulated steps, {} checkpoints\n",
+    timeWarp->getRollbacks(), timeWarp->getRolledBackSteps(), simulated, timeWarp->getCheckpointsSaved());
+
+  auto metricsFile = filesystem::path(args.dataDir) / ("timewarp" + to_string(id) + ".csv");
+  ofstream(metricsFile) << "rollbacks,rolled_back_steps,simulated_steps,checkpoints,rollback_rate\n"
+    << timeWarp->getRollbacks() << "," << timeWarp->getRolledBackSteps() << ","
+    << simulated << "," << timeWarp->getCheckpointsSaved() << "," << rollbackRate << "\n";
 }
 
 void PartitionManager::signalFinish() {
@@ -568,6 +892,19 @@ bool isFinished(float simTime, int endTime, bool finished) {
 // Only run in new process
 void PartitionManager::runSimulation() {
   logminor("Starting simulation logic\n", id);
+  auto startupBegin = chrono::steady_clock::now();
+
+  // The coordinator binds before starting the partitions, connecting
+  // here overlaps with loading the simulation
+  try {
+    // In case it is not up yet (partitions started by hand), retry sooner
+    // than the default 100ms
+    coordinatorSocket->set(zmq::sockopt::reconnect_ivl, 10);
+    connect(*coordinatorSocket, psumo::getSyncSocketId(args.dataDir, args.coordinatorHost, id, args.transportType));
+  } catch(zmq::error_t& e) {
+    logerr("ZMQ Error in connecting to coordinator process: {}\n", e.what());
+    exit(EXIT_FAILURE);
+  }
 
   // filesystem::path outputDir = filesystem::path(OUTDIR) / ("part" + to_string(id) + "/");
   // filesystem::create_directories(outputDir);
@@ -625,7 +962,15 @@ void PartitionManager::runSimulation() {
     exit(EXIT_FAILURE);
   }
 
+  computeSyncIntervals();
+  subscribeOutgoingEdges();
+  if (args.syncMode == SyncMode::OPTIMISTIC) {
+    timeWarp = new TimeWarp(filesystem::path(args.dataDir) / "checkpoints", id, Simulation::getDeltaT());
+  }
+
   try {
+    if (stepBarrier != nullptr) stepBarrier->bind();
+    if (handlerReactor != nullptr) handlerReactor->start();
     for (auto partId : neighborPartitions) {
       neighborClientHandlers[partId]->start();
     }
@@ -644,27 +989,28 @@ void PartitionManager::runSimulation() {
     std::ofstream(logMsgsFile, std::ios::out) << "time,msgs_in,msgs_out\n";
   }
 
-  // Wait for coordinator process to bind socket
-  std::this_thread::sleep_for(std::chrono::milliseconds(1000));
-
-  try {
-    connect(*coordinatorSocket, psumo::getSyncSocketId(args.dataDir, id));
-  } catch(zmq::error_t& e) {
-    logerr("ZMQ Error in connecting to coordinator process: {}\n", e.what());
-    exit(EXIT_FAILURE);
-  }
-
-  // ensure all servers have started before simulation begins
-  arriveWaitBarrier();
-
-  try {
-    for (auto stub : neighborPartitionStubs) {
-      stub.second->connect();
+  // ZMQ sockets connect in the background, retrying until the neighbor
+  // binds, so they connect while the others are still loading; shared
+  // memory segments only exist once their owner is ready
+  auto connectLinks = [&](bool beforeReady) {
+    try {
+      if ((args.transportType != TransportType::SHM) == beforeReady) {
+        for (auto stub : neighborPartitionStubs) {
+          stub.second->connect();
+        }
+      }
+      if (stepBarrier != nullptr && (args.barrierType != BarrierType::SHM) == beforeReady) {
+        stepBarrier->connect();
+      }
+    } catch(zmq::error_t& e) {
+      logerr("ZMQ Error in connecting partition stub: {}\n", e.what());
+      exit(EXIT_FAILURE);
     }
-  } catch(zmq::error_t& e) {
-    logerr("ZMQ Error in connecting partition stub: {}\n", e.what());
-    exit(EXIT_FAILURE);
-  }
+  };
+  connectLinks(true);
+  // ensure all servers have started before using them
+  reportReady(chrono::duration<double>(chrono::steady_clock::now() - startupBegin).count());
+  connectLinks(false);
 
   stringstream msg;
   msg << "-- partition " << id << " started in process " << getPid() << "--" << std::endl;
@@ -673,24 +1019,51 @@ void PartitionManager::runSimulation() {
   int numFromEdges = outgoingBorderEdges.size();
   int numToEdges = incomingBorderEdges.size();
   vector<vector<string>> prevIncomingVehicles(numToEdges);
-  vector<vector<string>> prevOutgoingVehicles(numFromEdges);
+  outgoingOccupancy.resize(numFromEdges);
+
+  // Before the handlers can read it
+  rebuildVehicleIds();
 
   for (partId_t partId : neighborPartitions) {
     neighborClientHandlers[partId]->listenOn();
   }
 
+  // Vehicles already in before the first step, will be read by
+  // the neighbors at the first step end
+  sendVehicleDeltas(Vehicle::getIDList(), {});
+
   chrono::steady_clock::duration simTime, commTime;//, handleTime;
   simTime = chrono::steady_clock::duration::zero();
   commTime = chrono::steady_clock::duration::zero();
   // handleTime = chrono::steady_clock::duration::zero();
-  chrono::steady_clock::time_point timeBefore;
 
-  while(running && !isFinished(Simulation::getTime(), endTime, finished)) {
-    if (measureSimTime) timeBefore = chrono::steady_clock::now();
-    Simulation::step();
-    if (measureSimTime) simTime += chrono::steady_clock::now() - timeBefore;
+  while(running) {
+    if (isFinished(Simulation::getTime(), endTime, finished)) {
+      // Optimistic mode: neighbors still behind can send vehicles for past steps
+      if (timeWarp == nullptr || canStopOptimistic()) break;
+      continue;
+    }
 
-    allVehicleIdsUpdated = false;
+    if (timeWarp != nullptr && step % args.checkpointInterval == 0) {
+      timeWarp->checkpoint(step, vehicleMultipartRouteProgress);
+    }
+
+    if (measureSimTime) phaseProfiler.begin();
+    Tracer::begin("simStep", "step", step);
+    Simulation::step();
+    Tracer::end("simStep");
+    if (measureSimTime) simTime += phaseProfiler.end(StepPhase::SIM_STEP);
+    if (timeWarp != nullptr) timeWarp->countStep();
+
+    // Teleporting vehicles are not in the network, as with getIDList, so they
+    // leave when starting to teleport and enter again when ending it
+    vector<string> entered = Simulation::getDepartedIDList();
+    vector<string> left = Simulation::getArrivedIDList();
+    const vector<string> teleportStarted = Simulation::getStartingTeleportIDList();
+    const vector<string> teleportEnded = Simulation::getEndingTeleportIDList();
+    entered.insert(entered.end(), teleportEnded.begin(), teleportEnded.end());
+    left.insert(left.end(), teleportStarted.begin(), teleportStarted.end());
+    updateVehicleIds(entered, left);
 
     if (endTime >= 0)
       logminor("Step done ({}/{})\n", (int) Simulation::getTime(), endTime);
@@ -701,25 +1074,95 @@ void PartitionManager::runSimulation() {
       ofstream(logVehiclesFile, ios::app) << Simulation::getTime() << "," << Vehicle::getIDCount() << "\n";
     }
 
-    if (measureInteractTime) timeBefore = chrono::steady_clock::now();
+    if (measureInteractTime) phaseProfiler.begin();
 
+    sendVehicleDeltas(entered, left);
+    if (measureInteractTime) commTime += phaseProfiler.end(StepPhase::REMOTE_CALLS);
+    Tracer::begin("borderScan");
     handleIncomingEdges(numToEdges, prevIncomingVehicles);
     logminor("Handled incoming edges\n");
-    handleOutgoingEdges(numFromEdges, prevOutgoingVehicles);
+    handleOutgoingEdges(numFromEdges);
     logminor("Handled outgoing edges\n");
+    Tracer::end("borderScan");
+    if (measureInteractTime) commTime += phaseProfiler.end(StepPhase::BORDER_SCAN);
+
+    // Send all vehicles found in the scan to each neighbor in one message
+    for (auto& stub : neighborPartitionStubs) {
+      if (isSyncStep(stub.first)) stub.second->flushAddVehicles(Simulation::getTime());
+    }
+    // Signal neighbors that this step's operations were all sent
+    // Optimistic mode needs none, vehicles are added at the step they were sent at
+    for (auto& stub : neighborPartitionStubs) {
+      if (timeWarp == nullptr && isSyncStep(stub.first)) stub.second->sendStepFence();
+    }
+    if (measureInteractTime) commTime += phaseProfiler.end(StepPhase::REMOTE_CALLS);
 
-    if (measureInteractTime) commTime += chrono::steady_clock::now() - timeBefore;
+    if (timeWarp != nullptr) {
+      bool rolledBack = handleOptimisticOperations();
+      if (measureInteractTime) commTime += phaseProfiler.end(StepPhase::APPLY_OPERATIONS);
+      if (rolledBack) {
+        if (measureInteractTime) phaseProfiler.finishStep();
+        continue;
+      }
+    }
+
+    // Optimistic mode: vehicles sent but not taken by the neighbor yet
+    // could still make it non-empty
+    if (isMaybeFinished() && (timeWarp == nullptr || (!timeWarp->hasPending() && !timeWarp->hasUnacked()))) {
+      if (emptySince < 0) {
+        emptySince = step;
+        emptySinceTime = Simulation::getTime();
+      }
+    } else {
+      emptySince = -1;
+    }
 
-    // make sure every time step across partitions is synchronized
-    finishStepWait();
+    if ((step + 1) % statusInterval == 0) {
+      if (measureInteractTime) phaseProfiler.begin();
+      if (args.syncMode != SyncMode::GLOBAL) {
+        // Steps are synchronized with the neighbors only, by waiting
+        // for their fences when applying the operations below
+        reportStepStatus();
+      } else {
+        // make sure every time step across partitions is synchronized,
+        // or every statusInterval steps with --sync-interval
+        finishStepWait();
+      }
+      if (measureInteractTime) phaseProfiler.end(StepPhase::BARRIER_WAIT);
+    }
 
     // if (measureInteractTime) timeBefore = chrono::steady_clock::now();
 
     // Neighbor handler buffers add vehicle and set speed operations while the 
     // edge handling is going on in each barrier, apply them after to avoid
     // interference and then start again
+    bool applied = false;
+    if (measureInteractTime) phaseProfiler.begin();
     for (partId_t partId : neighborPartitions) {
-      neighborClientHandlers[partId]->applyMutableOperations();
+      if (timeWarp == nullptr && isSyncStep(partId)) {
+        TraceScope trace("applyOperations", "from", partId);
+        neighborClientHandlers[partId]->applyMutableOperations();
+        applied = true;
+      }
+    }
+    if (measureInteractTime) {
+      if (applied) phaseProfiler.end(StepPhase::APPLY_OPERATIONS);
+      phaseProfiler.finishStep();
+    }
+    step++;
+
+    if (args.syncMode != SyncMode::GLOBAL) {
+      // Partitions learn the simulation ended at different steps, stop when
+      // the first neighbor does as it will not send fences anymore
+      for (partId_t partId : neighborPartitions) {
+        if (neighborClientHandlers[partId]->isNeighborDone()) finished = true;
+      }
+      // Optimistic mode sends it after checking no rollback is needed anymore
+      if (timeWarp == nullptr && isFinished(Simulation::getTime(), endTime, finished)) {
+        for (auto& stub : neighborPartitionStubs) {
+          stub.second->sendPartitionDone();
+        }
+      }
     }
 
     if (args.logMsgNum) {
@@ -733,6 +1176,13 @@ void PartitionManager::runSimulation() {
     // if (measureInteractTime) handleTime += chrono::steady_clock::now() - timeBefore;
   }
 
+  if (timeWarp != nullptr) {
+    for (auto& stub : neighborPartitionStubs) {
+      stub.second->sendPartitionDone();
+    }
+    writeTimeWarpMetrics();
+  }
+
   if (measureSimTime) {
     double duration = duration_cast<chrono::milliseconds>(simTime).count() / 1000.0;
     log("Took {}s for simulation, writing to file...\n", duration);
@@ -745,6 +1195,26 @@ void PartitionManager::runSimulation() {
     auto timeFile = filesystem::path(args.dataDir) / ("commtime" + to_string(id) + ".txt");
     ofstream(timeFile) << duration << endl;
 
+    // For all threads of the process, to compare the handler modes
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    log("Context switches: {} voluntary, {} involuntary\n", usage.ru_nvcsw, usage.ru_nivcsw);
+    auto switchesFile = filesystem::path(args.dataDir) / ("ctxswitches" + to_string(id) + ".txt");
+    ofstream(switchesFile) << usage.ru_nvcsw << "," << usage.ru_nivcsw << endl;
+
+    // Percentiles of each step phase, to find where the slowest steps come from
+    auto phasesFile = filesystem::path(args.dataDir) / ("phasetimes" + to_string(id) + ".csv");
+    phaseProfiler.writeCsv(phasesFile.string());
+
+    // Peak operations waiting to be applied, and times reading stopped with a full queue
+    auto queuesFile = filesystem::path(args.dataDir) / ("opqueues" + to_string(id) + ".csv");
+    ofstream queuesOut(queuesFile);
+    queuesOut << "neighbor,peak,fullPauses" << endl;
+    for (partId_t partId : neighborPartitions) {
+      auto handler = neighborClientHandlers[partId];
+      queuesOut << partId << "," << handler->getPeakQueuedOperations() << "," << handler->getQueueFullPauses() << endl;
+    }
+
     // double handleDuration = duration_cast<chrono::milliseconds>(handleTime).count() / 1000.0;
     // log("Took {}s for handling interactions, writing to file...\n", handleDuration);
     // auto timeFile2 = filesystem::path(args.dataDir) / ("handletime" + to_string(id) + ".txt");
@@ -761,25 +1231,29 @@ void PartitionManager::runSimulation() {
   for (partId_t partId : neighborPartitions) {
     neighborClientHandlers[partId]->join();
   }
+  if (handlerReactor != nullptr) handlerReactor->stop();
 
   log("FINISHED!\n");
 
   signalFinish();
+  if (stepBarrier != nullptr) stepBarrier->close();
   close(*coordinatorSocket);
  
   Simulation::close("ParallelSim terminated.");
   numInstancesRunning--;
 }
 
-void PartitionManager::refreshVehicleIds() {
-  if (!allVehicleIdsUpdated) {
-    lock_guard<mutex> lock(allVehicleIds_lock);
+void PartitionManager::rebuildVehicleIds() {
+  vector<string> idVector = Vehicle::getIDList(); 
+  unique_lock<shared_mutex> lock(allVehicleIds_lock);
+  allVehicleIds.clear();
+  allVehicleIds.insert(idVector.begin(), idVector.end());
+}
 
-    vector<string> idVector = Vehicle::getIDList(); 
-    allVehicleIds.clear();
-    allVehicleIds.insert(idVector.begin(), idVector.end());
-    allVehicleIdsUpdated = true;
-  }
+void PartitionManager::updateVehicleIds(const vector<string>& entered, const vector<string>& left) {
+  unique_lock<shared_mutex> lock(allVehicleIds_lock);
+  allVehicleIds.insert(entered.begin(), entered.end());
+  for (auto& vehId : left) allVehicleIds.erase(vehId);
 }
 
 template<typename... _Args > 
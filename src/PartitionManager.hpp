@@ -13,7 +13,9 @@ Contributions: Filippo Lenzi
 
 #include <cstdlib>
 #include <mutex>
+#include <shared_mutex>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
@@ -25,6 +27,13 @@ Contributions: Filippo Lenzi
 #include "args.hpp"
 #include "psumoTypes.hpp"
 #include "partArgs.hpp"
+#include "EdgeOccupancyTracker.hpp"
+#include "HandlerReactor.hpp"
+#include "IdDictionary.hpp"
+#include "PartitionData.hpp"
+#include "PhaseProfiler.hpp"
+#include "StepBarrier.hpp"
+#include "TimeWarp.hpp"
 
 class PartitionManager;
 
@@ -40,28 +49,63 @@ private:
     std::vector<border_edge_t> incomingBorderEdges;
     std::vector<border_edge_t> outgoingBorderEdges;
     const std::vector<partId_t> neighborPartitions;
-    const std::unordered_map<partId_t, std::unordered_set<std::string>> neighborRoutes;
-    const std::unordered_map<std::string, std::unordered_set<std::string>> routeEndsInEdges;
+    // Routes of the neighbors and routes ending in each border edge
+    const PartitionData& partData;
     const float lastDepartTime;
-    std::unordered_set<std::string> multipartRoutes;
+    const IdTable& idTable;
+    // Dense indices for the routes in the route file, so vehicles on border
+    // edges are checked without string operations; base routes are the
+    // ids without the _part suffix of multipart routes
+    typedef struct {
+        int base;
+        // -1 if not multipart
+        int part;
+    } route_index_t;
+    string_map<route_index_t> routeIndex;
+    string_map<int> baseRouteIndex;
+    std::vector<std::string> baseRouteIds;
+    // For each base route, the ids of its parts by part number (empty strings
+    // for parts not in this partition); empty if not multipart
+    std::vector<std::vector<std::string>> baseRouteParts;
+    // For each base route, the neighbors that have it, used to filter the
+    // vehicle deltas
+    std::vector<std::vector<partId_t>> baseRouteNeighbors;
+    // Base route of the vehicles sent in the deltas, to send their
+    // removal to the same neighbors
+    string_map<int> deltaVehicleRoutes;
+    // For each outgoing border edge, for each base route, if vehicles on it pass
+    // to the edge's target from the edge; empty if none do
+    std::vector<std::vector<bool>> outgoingEdgeRoutes;
+    // Vehicles in the outgoing border edges at their last scan
+    EdgeOccupancyTracker outgoingOccupancy;
     // Tracks vehicles added to other partitions, reset for multipart route
-    std::unordered_set<std::string> sentVehicles;
+    string_set sentVehicles;
     std::map<int, PartitionEdgesStub*> neighborPartitionStubs;
     std::map<int, NeighborPartitionHandler*> neighborClientHandlers;
+    // Serves all the handlers in reactor handler mode, null otherwise
+    HandlerReactor* handlerReactor = nullptr;
     // For vehicles with more than one route part, count last one the vehicle used
     std::unordered_map<std::string, int> vehicleMultipartRouteProgress;
     zmq::context_t& zcontext;
     // Pointer to handle ZMQ memory with certainty
     zmq::socket_t* coordinatorSocket;
-    std::unordered_set<std::string> allVehicleIds;
-    std::mutex allVehicleIds_lock;
-    bool allVehicleIdsUpdated = false;
+    // Global sync mode only, see --barrier
+    StepBarrier* stepBarrier = nullptr;
+    // Vehicles in each neighbor that could be sent there from this partition,
+    // kept updated by the neighbors at each step; empty in optimistic mode
+    std::unordered_map<partId_t, string_set> neighborVehicles;
+    // Vehicles in this partition, kept updated at each step by the main
+    // thread (the only writer) and read by the neighbor handler threads
+    string_set allVehicleIds;
+    std::shared_mutex allVehicleIds_lock;
     std::string cfg;
     int endTime = -1;
     // Measure time spent in simulation
     bool measureSimTime = false;
     // Measure time spent in comm and interaction handling
     bool measureInteractTime = false;
+    // Time of each step phase, written at the end with the measures above
+    PhaseProfiler phaseProfiler;
     int msgCountIn = 0;
     int msgCountOut = 0;
     std::mutex msgCountLockIn, msgCountLockOut;
@@ -70,20 +114,68 @@ private:
     PartArgs& args;
     bool running;
     bool finished = false;
+    int step = 0;
+    // Least time a vehicle takes to cross a border edge shared with each
+    // neighbor, and the steps between syncs (from it in lookahead sync mode,
+    // or --sync-interval)
+    std::unordered_map<partId_t, double> neighborLookaheads;
+    std::unordered_map<partId_t, int> neighborSyncIntervals;
+    // Steps between status reports to the coordinator (global barriers
+    // in global sync mode)
+    int statusInterval = 1;
+    // Step since which this partition has been empty, -1 if it is not,
+    // and the simulation time at its end
+    int emptySince = -1;
+    double emptySinceTime = -1;
+    // Optimistic sync mode only, otherwise null
+    TimeWarp* timeWarp = nullptr;
+    // Lowest time any partition can still send vehicles for, from the coordinator
+    double gvt = 0;
 
     // handle border edges where vehicles are incoming
     void handleIncomingEdges(int, std::vector<std::vector<std::string>>&);
     // handle border edges where vehicles are outgoing
-    void handleOutgoingEdges(int, std::vector<std::vector<std::string>>&);
+    void handleOutgoingEdges(int);
+    // fill routeIndex and the base route tables from the route ids
+    void indexRoutes(const std::vector<std::string_view>&);
+    // fill outgoingEdgeRoutes, after loading the border edges and route file
+    void buildOutgoingRouteTables();
+    // subscribe to the variables of the vehicles in the outgoing border edges
+    // used by handleOutgoingEdges, after starting the simulation
+    void subscribeOutgoingEdges();
+    // send vehicles entering and leaving this partition to the neighbors,
+    // teleports included (see updateVehicleIds)
+    void sendVehicleDeltas(const std::vector<std::string>& entered, const std::vector<std::string>& left);
     // barrier-like behavior via message passing
     void arriveWaitBarrier();
+    // tell the coordinator the simulation is loaded and the handlers are
+    // listening, and wait for the other partitions to be
+    void reportReady(double startupSeconds);
     // barrier-like behavior via message passing, plus pass amount of vehicles left
     void finishStepWait();
+    // neighbor sync mode: tell the coordinator if this partition is empty, without
+    // waiting for the others, and get if all of them are
+    void reportStepStatus();
     // signal to main process that we finished
     void signalFinish();
 
     bool isMaybeFinished();
-    void refreshVehicleIds();
+    // Needs the simulation step length, call after starting it
+    void computeSyncIntervals();
+    // Whether messages are exchanged with the neighbor at the end of this step
+    bool isSyncStep(partId_t partId);
+    // Optimistic sync mode: get the neighbors' operations, then roll back if
+    // needed (returns true then) or add the vehicles for this step
+    bool handleOptimisticOperations();
+    // Optimistic sync mode, after reaching the end: if no vehicles for earlier
+    // steps can still arrive, otherwise wait a bit
+    bool canStopOptimistic();
+    void writeTimeWarpMetrics();
+    // Full rebuild from the simulation, at the start and after rollbacks
+    void rebuildVehicleIds();
+    // Apply a step's changes: departed vehicles and ones ending a teleport
+    // entered, arrived vehicles and ones starting a teleport left
+    void updateVehicleIds(const std::vector<std::string>& entered, const std::vector<std::string>& left);
 
     template<typename... _Args > 
         void log(std::format_string<_Args...>  format, _Args&&... args);
@@ -98,10 +190,10 @@ protected:
 public:
     // params: sumo binary, id, barrier, lock, cond, sumo config, host, port, end time
     PartitionManager(const std::string binary, partId_t id, std::string& cfg, int endTime,
-        std::vector<partId_t>& neighborPartitions, 
-        std::unordered_map<partId_t, std::unordered_set<std::string>>& neighborRoutes,
-        std::unordered_map<std::string, std::unordered_set<std::string>>& routeEndsInEdges,
+        const std::vector<partId_t>& neighborPartitions, 
+        const PartitionData& partData,
         float lastDepartTime,
+        const IdTable& idTable,
         zmq::context_t& zcontext, int numThreads,
         std::vector<std::string> sumoArgs, 
         PartArgs& args
@@ -113,9 +205,12 @@ public:
     /* Starts this partition in this process */
     void startPartitionLocalProcess();
     // set this partition's border edges
-    void setBorderEdges(std::vector<border_edge_t>&);
-    // Load route file to initialize assorted metadata
-    // (Filename obtained from args)
+    void setBorderEdges(const std::vector<border_edge_t>&);
+    // set the lookahead (in seconds) with each neighbor, used in lookahead sync mode
+    void setNeighborLookaheads(const std::unordered_map<partId_t, double>&);
+    // Initialize assorted route metadata from the partition's route ids
+    // in the partition data; if missing, scan the route file for them
+    // (filename obtained from the config)
     void loadRouteMetadata();
     // Enable counting time spent inside simulation and messages
     void enableTimeMeasures();
@@ -129,16 +224,20 @@ public:
     #endif
 
     // No string ref in debug, to allow calling from lldb
-    void setVehicleSpeed(_str_arg_type vehId, double speed);
     std::vector<std::string> getEdgeVehicles(_str_arg_type edgeId);
+    // Called with views into the messages received by the handlers
+    void setVehicleSpeed(std::string_view vehId, double speed);
     void addVehicle(
-        _str_arg_type vehId, _str_arg_type routeId, _str_arg_type vehType,
-        _str_arg_type laneId, int laneIndex, double lanePos, double speed
+        std::string_view vehId, std::string_view routeId, std::string_view vehType,
+        std::string_view laneId, int laneIndex, double lanePos, double speed
     );
     bool hasVehicle(_str_arg_type vehId);
     bool hasVehicleInEdge(_str_arg_type vehId, _str_arg_type edgeId);
+    // Only call from the main thread
+    void updateNeighborVehicles(partId_t partId, const std::vector<std::string_view>& added, const std::vector<std::string_view>& removed);
 
     const int getId() { return id; }
     const int getNumThreads() { return numThreads; }
     const Args& getArgs() { return args; }
+    const IdTable& getIdTable() { return idTable; }
 };
\ No newline at end of file
@@ -0,0 +1,119 @@
+/**
+PhaseProfiler.cpp
+
+Time spent by a partition in each phase of its steps (simulation, border
+scan, messages to the neighbors, barrier, applying the neighbors' operations),
+kept in histograms to tell apart where the slow steps come from.
+
+Author: Filippo Lenzi
+*/
+
+#include "PhaseProfiler.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <fstream>
+
+using namespace std;
+
+namespace psumo {
+
+static const uint64_t SUB_BUCKETS = 1ull << LATENCY_HISTOGRAM_SUB_BITS;
+static const uint64_t HALF_SUB_BUCKETS = SUB_BUCKETS / 2;
+// Linear buckets below SUB_BUCKETS, then half as many for each
+// power of two up to 2^64
+static const size_t BUCKET_COUNT = SUB_BUCKETS + (64 - LATENCY_HISTOGRAM_SUB_BITS) * HALF_SUB_BUCKETS;
+
+static const double CSV_PERCENTILES[] = {50, 90, 99, 99.9};
+
+LatencyHistogram::LatencyHistogram():
+    counts(BUCKET_COUNT, 0)
+{}
+
+size_t LatencyHistogram::bucketIndex(uint64_t value) {
+    if (value < SUB_BUCKETS) return value;
+    // Drop the bits below the precision kept for this power of two,
+    // leaving a value in [HALF_SUB_BUCKETS, SUB_BUCKETS)
+    int shift = bit_width(value) - LATENCY_HISTOGRAM_SUB_BITS;
+    return SUB_BUCKETS + (shift - 1) * HALF_SUB_BUCKETS + ((value >> shift) - HALF_SUB_BUCKETS);
+}
+
+uint64_t LatencyHistogram::bucketHighest(size_t index) {
+    if (index < SUB_BUCKETS) return index;
+    size_t shift = (index - SUB_BUCKETS) / HALF_SUB_BUCKETS + 1;
+    uint64_t sub = (index - SUB_BUCKETS) % HALF_SUB_BUCKETS + HALF_SUB_BUCKETS;
+    return (sub << shift) + ((1ull << shift) - 1);
+}
+
+void LatencyHistogram::record(uint64_t nanos) {
+    counts[bucketIndex(nanos)]++;
+    count++;
+    total += nanos;
+    if (nanos < lowest) lowest = nanos;
+    if (nanos > highest) highest = nanos;
+}
+
+uint64_t LatencyHistogram::valueAtPercentile(double percentile) const {
+    if (count == 0) return 0;
+    uint64_t rank = max<uint64_t>(1, ceil(percentile / 100.0 * count));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < counts.size(); i++) {
+        seen += counts[i];
+        if (seen >= rank) return clamp(bucketHighest(i), lowest, highest);
+    }
+    return highest;
+}
+
+PhaseProfiler::PhaseProfiler() {
+    stepTimes.fill(chrono::steady_clock::duration::zero());
+    ranInStep.fill(false);
+}
+
+chrono::steady_clock::duration PhaseProfiler::end(StepPhase phase) {
+    auto now = chrono::steady_clock::now();
+    auto took = now - mark;
+    mark = now;
+    stepTimes[static_cast<int>(phase)] += took;
+    ranInStep[static_cast<int>(phase)] = true;
+    return took;
+}
+
+void PhaseProfiler::finishStep() {
+    for (int i = 0; i < STEP_PHASE_COUNT; i++) {
+        if (!ranInStep[i]) continue;
+        histograms[i].record(stepTimes[i]);
+        stepTimes[i] = chrono::steady_clock::duration::zero();
+        ranInStep[i] = false;
+    }
+}
+
+void PhaseProfiler::writeCsv(const string& file) const {
+    ofstream out(file);
+    out << "phase,count,mean,min";
+    for (double percentile : CSV_PERCENTILES) out << ",p" << percentile;
+    out << ",max" << endl;
+
+    for (int i = 0; i < STEP_PHASE_COUNT; i++) {
+        const LatencyHistogram& histogram = histograms[i];
+        out << getStepPhaseName(static_cast<StepPhase>(i)) << "," << histogram.getCount()
+            << "," << histogram.getMean() / 1000.0 << "," << histogram.getMin() / 1000.0;
+        for (double percentile : CSV_PERCENTILES) {
+            out << "," << histogram.valueAtPercentile(percentile) / 1000.0;
+        }
+        out << "," << histogram.getMax() / 1000.0 << endl;
+    }
+}
+
+const char* getStepPhaseName(StepPhase phase) {
+    switch (phase) {
+        case StepPhase::SIM_STEP: return "simStep";
+        case StepPhase::BORDER_SCAN: return "borderScan";
+        case StepPhase::REMOTE_CALLS: return "remoteCalls";
+        case StepPhase::BARRIER_WAIT: return "barrierWait";
+        case StepPhase::APPLY_OPERATIONS: return "applyOperations";
+        default: return "unknown";
+    }
+}
+
+}
@@ -0,0 +1,104 @@
+/**
+PhaseProfiler.hpp
+
+Time spent by a partition in each phase of its steps (simulation, border
+scan, messages to the neighbors, barrier, applying the neighbors' operations),
+kept in histograms to tell apart where the slow steps come from.
+
+Author: Filippo Lenzi
+*/
+
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace psumo {
+
+// Values above 2^LATENCY_HISTOGRAM_SUB_BITS are kept with a relative error
+// of at most 1 / 2^(LATENCY_HISTOGRAM_SUB_BITS - 1), 1/128 (under 0.8%) with 8
+static const int LATENCY_HISTOGRAM_SUB_BITS = 8;
+
+/**
+Histogram of durations in nanoseconds, with log-linear buckets as in
+HdrHistogram: values below 2^SUB_BITS get a bucket each, larger ones
+are split in 2^(SUB_BITS - 1) buckets per power of two. Fixed size (a few
+thousand counters), recording is a couple of shifts and an increment.
+*/
+class LatencyHistogram {
+private:
+    std::vector<uint64_t> counts;
+    uint64_t count = 0;
+    uint64_t lowest = UINT64_MAX;
+    uint64_t highest = 0;
+    // Sum in nanoseconds, for the mean
+    double total = 0;
+
+    static size_t bucketIndex(uint64_t value);
+    // Highest value counted in the bucket
+    static uint64_t bucketHighest(size_t index);
+public:
+    LatencyHistogram();
+
+    void record(uint64_t nanos);
+    void record(std::chrono::steady_clock::duration duration) {
+        record(std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count());
+    }
+
+    uint64_t getCount() const { return count; }
+    uint64_t getMin() const { return count > 0 ? lowest : 0; }
+    uint64_t getMax() const { return highest; }
+    double getMean() const { return count > 0 ? total / count : 0; }
+    // Least value at least percentile% of the values are lower or equal to,
+    // within the bucket precision; 0 if empty
+    uint64_t valueAtPercentile(double percentile) const;
+};
+
+enum class StepPhase {
+    // Simulation::step
+    SIM_STEP,
+    // Finding the vehicles to hand off in the border edges
+    BORDER_SCAN,
+    // Vehicle deltas, handoffs and fences sent to the neighbors
+    REMOTE_CALLS,
+    // Step barrier in global sync mode, status report otherwise
+    BARRIER_WAIT,
+    // Neighbors' operations applied at sync steps, including waiting for
+    // their fences in neighbor sync modes; rollbacks in optimistic mode
+    APPLY_OPERATIONS,
+    COUNT
+};
+
+static const int STEP_PHASE_COUNT = static_cast<int>(StepPhase::COUNT);
+
+/**
+Used by the main thread of the partition: phases are timed between begin
+and end, and can run more than once per step (their times are summed), then
+finishStep records each phase that ran in the step in its histogram.
+*/
+class PhaseProfiler {
+private:
+    std::array<LatencyHistogram, STEP_PHASE_COUNT> histograms;
+    std::array<std::chrono::steady_clock::duration, STEP_PHASE_COUNT> stepTimes;
+    std::array<bool, STEP_PHASE_COUNT> ranInStep;
+    std::chrono::steady_clock::time_point mark;
+public:
+    PhaseProfiler();
+
+    void begin() { mark = std::chrono::steady_clock::now(); }
+    // Add the time since begin, or the previous end, to the phase;
+    // returns it, to be also added to other totals
+    std::chrono::steady_clock::duration end(StepPhase phase);
+    void finishStep();
+
+    const LatencyHistogram& getHistogram(StepPhase phase) const { return histograms[static_cast<int>(phase)]; }
+    // Percentiles of each phase in microseconds, one row per phase
+    void writeCsv(const std::string& file) const;
+};
+
+const char* getStepPhaseName(StepPhase phase);
+
+}
@@ -0,0 +1,201 @@
+/**
+ShmLink.cpp
+
+Shared memory transport between two partitions on the same host, used
+instead of the ZMQ sockets when running with --transport shm.
+
+Author: Filippo Lenzi
+*/
+
+#ifndef USING_WIN
+
+#include "ShmLink.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <thread>
+#include <unistd.h>
+
+using namespace std;
+
+namespace psumo {
+
+static const uint32_t WRAP_MARKER = 0xFFFFFFFF;
+
+struct shm_link_header_t {
+    shm_ring_header_t requests;
+    shm_ring_header_t async;
+    shm_ring_header_t replies;
+    ShmDoorbell handlerBell;
+    ShmDoorbell replyBell;
+};
+
+static inline size_t recordSize(size_t size) {
+    return (sizeof(uint32_t) + size + 7) & ~size_t(7);
+}
+
+// Keep the ring buffers on their own cache lines
+static inline size_t headerSize() {
+    return (sizeof(shm_link_header_t) + 63) & ~size_t(63);
+}
+
+// Not FUTEX_PRIVATE, as the word is shared between processes
+static inline void futexWait(atomic<uint32_t>* word, uint32_t expected) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAIT, expected, nullptr, nullptr, 0);
+}
+
+static inline void futexWakeAll(atomic<uint32_t>* word) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAKE, INT32_MAX, nullptr, nullptr, 0);
+}
+
+void ShmDoorbell::ring() {
+    seq.fetch_add(1);
+    if (waiters.load() > 0) {
+        futexWakeAll(&seq);
+    }
+}
+
+void ShmDoorbell::wait(uint32_t seen) {
+    waiters.fetch_add(1);
+    // Returns immediately if seq changed after seen was read
+    while (seq.load() == seen) {
+        futexWait(&seq, seen);
+    }
+    waiters.fetch_sub(1);
+}
+
+bool ShmRing::tryPush(const void* data, size_t size) {
+    size_t needed = recordSize(size);
+    if (needed > SHM_RING_SIZE) {
+        throw length_error("Message of size " + to_string(size) + " too big for shared memory ring");
+    }
+
+    uint64_t tail = header->tail.load(memory_order_relaxed);
+    uint64_t head = header->head.load(memory_order_acquire);
+    size_t offset = tail % SHM_RING_SIZE;
+    size_t contiguous = SHM_RING_SIZE - offset;
+    size_t skipped = contiguous < needed ? contiguous : 0;
+
+    if (SHM_RING_SIZE - (tail - head) < needed + skipped) {
+        return false;
+    }
+
+    if (skipped > 0) {
+        std::memcpy(buffer + offset, &WRAP_MARKER, sizeof(uint32_t));
+        tail += skipped;
+        offset = 0;
+    }
+    uint32_t size32 = size;
+    std::memcpy(buffer + offset, &size32, sizeof(uint32_t));
+    std::memcpy(buffer + offset + sizeof(uint32_t), data, size);
+
+    // Publish the data to the consumer
+    header->tail.store(tail + needed, memory_order_release);
+    return true;
+}
+
+bool ShmRing::tryPop(TransportMessage& message) {
+    uint64_t head = header->head.load(memory_order_relaxed);
+    uint64_t tail = header->tail.load(memory_order_acquire);
+    if (head == tail) return false;
+
+    size_t offset = head % SHM_RING_SIZE;
+    uint32_t size;
+    std::memcpy(&size, buffer + offset, sizeof(uint32_t));
+    if (size == WRAP_MARKER) {
+        head += SHM_RING_SIZE - offset;
+        offset = 0;
+        std::memcpy(&size, buffer, sizeof(uint32_t));
+    }
+
+    message.rebuild(size);
+    std::memcpy(message.data(), buffer + offset + sizeof(uint32_t), size);
+
+    // Give the space back to the producer
+    header->head.store(head + recordSize(size), memory_order_release);
+    return true;
+}
+
+bool ShmRing::empty() const {
+    return header->head.load(memory_order_acquire) == header->tail.load(memory_order_acquire);
+}
+
+void* mapShmSegment(const string& path, bool create, size_t size) {
+    int fd;
+    if (create) {
+        unlink(path.c_str());
+        fd = open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    } else {
+        fd = open(path.c_str(), O_RDWR);
+    }
+    if (fd < 0) {
+        throw runtime_error("Cannot open shared memory file " + path + ": " + strerror(errno));
+    }
+    // New files are zero filled, which is the initial state of the rings
+    if (create && ftruncate(fd, size) != 0) {
+        ::close(fd);
+        throw runtime_error("Cannot resize shared memory file " + path + ": " + strerror(errno));
+    }
+
+    void* segment = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (segment == MAP_FAILED) {
+        throw runtime_error("Cannot map shared memory file " + path + ": " + strerror(errno));
+    }
+    return segment;
+}
+
+static inline char* ringBuffer(void* segment, int index) {
+    return static_cast<char*>(segment) + headerSize() + SHM_RING_SIZE * index;
+}
+
+ShmLink::ShmLink(const string& path, bool create):
+    path(path),
+    owner(create),
+    segment(mapShmSegment(path, create, headerSize() + SHM_RING_SIZE * 3)),
+    segmentSize(headerSize() + SHM_RING_SIZE * 3),
+    requestRing(&static_cast<shm_link_header_t*>(segment)->requests, ringBuffer(segment, 0)),
+    asyncRing(&static_cast<shm_link_header_t*>(segment)->async, ringBuffer(segment, 1)),
+    replyRing(&static_cast<shm_link_header_t*>(segment)->replies, ringBuffer(segment, 2)),
+    handlerBell_(&static_cast<shm_link_header_t*>(segment)->handlerBell),
+    replyBell_(&static_cast<shm_link_header_t*>(segment)->replyBell)
+{}
+
+ShmLink::~ShmLink() {
+    munmap(segment, segmentSize);
+    // The other side keeps its mapping even after this
+    if (owner) unlink(path.c_str());
+}
+
+void ShmLink::push(ShmRing& ring, ShmDoorbell& bell, const TransportMessage& message, bool ringBell) {
+    while (!ring.tryPush(message.data(), message.size())) {
+        // Full, the other side is still reading the previous messages
+        bell.ring();
+        this_thread::yield();
+    }
+    if (ringBell) bell.ring();
+}
+
+void ShmLink::sendAsyncBatch(const vector<TransportMessage>& messages) {
+    for (auto& message : messages) {
+        push(asyncRing, *handlerBell_, message, false);
+    }
+    handlerBell_->ring();
+}
+
+void ShmLink::receiveReply(TransportMessage& message) {
+    while (true) {
+        uint32_t seen = replyBell_->load();
+        if (replyRing.tryPop(message)) return;
+        replyBell_->wait(seen);
+    }
+}
+
+}
+
+#endif
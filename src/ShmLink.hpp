@@ -0,0 +1,120 @@
+/**
+ShmLink.hpp
+
+Shared memory transport between two partitions on the same host, used
+instead of the ZMQ sockets when running with --transport shm.
+
+Author: Filippo Lenzi
+*/
+
+#pragma once
+
+// Futexes and mmap, not available on Windows (only tcp there, see Args)
+#ifndef USING_WIN
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "TransportMessage.hpp"
+
+namespace psumo {
+
+// Size of the data buffer of each ring, must be a multiple of 8
+static const size_t SHM_RING_SIZE = 4 << 20;
+
+struct shm_ring_header_t {
+    // Bytes read by the consumer and written by the producer since the start,
+    // on separate cache lines as each is written by a different process
+    alignas(64) std::atomic<uint64_t> head;
+    alignas(64) std::atomic<uint64_t> tail;
+};
+
+/**
+Wakes up a process waiting for new messages, using a futex on
+a shared counter. Waiters read the counter before checking for
+messages, then wait only if it did not change in the meantime.
+*/
+struct ShmDoorbell {
+    alignas(64) std::atomic<uint32_t> seq;
+    std::atomic<uint32_t> waiters;
+
+    uint32_t load() const { return seq.load(); }
+    void ring();
+    void wait(uint32_t seen);
+};
+
+// Map the file at path, creating it zero filled (replacing leftovers of
+// previous runs) or opening an existing one; throws runtime_error on failure
+void* mapShmSegment(const std::string& path, bool create, size_t size);
+
+/**
+Single producer, single consumer ring buffer of messages, each stored as
+its size followed by the data, aligned to 8 bytes. Messages that do not fit
+before the end of the buffer are written at the start, after a wrap marker.
+*/
+class ShmRing {
+private:
+    shm_ring_header_t* header;
+    char* buffer;
+public:
+    ShmRing(shm_ring_header_t* header, char* buffer):
+        header(header), buffer(buffer) {}
+
+    // Returns false if there is not enough space left
+    bool tryPush(const void* data, size_t size);
+    // Returns false if the ring is empty
+    bool tryPop(TransportMessage& message);
+    bool empty() const;
+};
+
+/**
+Rings for a link between a stub in one partition and the handler for it
+in the other; mirrors the request/reply socket and the async socket of the
+ZMQ transport, see ShmClientTransport and ShmServerTransport. The segment is
+a file in the sockets folder of the data dir, mapped by both processes,
+created by the handler and opened by the stub.
+*/
+class ShmLink {
+private:
+    std::string path;
+    bool owner;
+    void* segment;
+    size_t segmentSize;
+    ShmRing requestRing;
+    ShmRing asyncRing;
+    ShmRing replyRing;
+    ShmDoorbell* handlerBell_;
+    ShmDoorbell* replyBell_;
+
+    void push(ShmRing& ring, ShmDoorbell& bell, const TransportMessage& message, bool ringBell = true);
+public:
+    // create: create the file (replacing leftovers of previous runs)
+    // instead of opening an existing one
+    ShmLink(const std::string& path, bool create);
+    ~ShmLink();
+
+    // Stub side
+    void sendRequest(const TransportMessage& message) { push(requestRing, *handlerBell_, message); }
+    void sendAsync(const TransportMessage& message) { push(asyncRing, *handlerBell_, message); }
+    // Rings the doorbell only once at the end
+    void sendAsyncBatch(const std::vector<TransportMessage>& messages);
+    // Blocks until the reply arrives
+    void receiveReply(TransportMessage& message);
+
+    // Handler side, nonblocking
+    bool hasRequest() const { return !requestRing.empty(); }
+    bool hasAsync() const { return !asyncRing.empty(); }
+    bool tryReceiveRequest(TransportMessage& message) { return requestRing.tryPop(message); }
+    bool tryReceiveAsync(TransportMessage& message) { return asyncRing.tryPop(message); }
+    void sendReply(const TransportMessage& message) { push(replyRing, *replyBell_, message); }
+    // Rung on requests and async messages; also ring it to wake up the
+    // handler thread for other reasons
+    ShmDoorbell& handlerBell() { return *handlerBell_; }
+};
+
+}
+
+#endif
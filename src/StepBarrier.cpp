@@ -0,0 +1,274 @@
+/**
+StepBarrier.cpp
+
+Barrier all partitions wait at the end of each step in global sync mode,
+through the coordinator or directly between the partitions, chosen
+with --barrier.
+
+Author: Filippo Lenzi
+*/
+
+#include "StepBarrier.hpp"
+
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+#ifndef USING_WIN
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "messagingShared.hpp"
+#include "ParallelSim.hpp"
+
+using namespace std;
+
+namespace psumo {
+
+bool CentralBarrier::arriveAndWait(bool flag) {
+    int opcode = ParallelSim::SyncOps::BARRIER_STEP;
+    zmq::message_t message(sizeof(int) + sizeof(bool));
+    MessageWriter writer(message);
+    writer.write(opcode);
+    writer.write(flag);
+    coordinatorSocket.send(message, zmq::send_flags::none);
+
+    // Replied once all partitions arrived
+    zmq::message_t reply(sizeof(bool));
+    [[maybe_unused]] auto _ = coordinatorSocket.recv(reply);
+    bool all;
+    std::memcpy(&all, reply.data(), sizeof(bool));
+    return all;
+}
+
+PeerBarrier::PeerBarrier(zmq::context_t& zcontext, const string& dataDir, const vector<string>& hosts,
+    partId_t id, int numParts, TransportType transport
+):
+    id(id),
+    numParts(numParts),
+    dataDir(dataDir),
+    hosts(hosts),
+    transport(transport),
+    zcontext(zcontext),
+    socket(makeSocket(zcontext, zmq::socket_type::pull)),
+    episode(0)
+{}
+
+PeerBarrier::~PeerBarrier() {
+    delete socket;
+    for (auto peer : peers) delete peer;
+}
+
+void PeerBarrier::addPeer(partId_t peer) {
+    peerIds.push_back(peer);
+    peers.push_back(makeSocket(zcontext, zmq::socket_type::push));
+    // Can connect before the peer binds
+    peers.back()->set(zmq::sockopt::reconnect_ivl, 10);
+}
+
+void PeerBarrier::bind() {
+    psumo::bind(*socket, getBarrierSocketName(dataDir, getPartitionHost(hosts, id), id, transport));
+}
+
+void PeerBarrier::connect() {
+    for (size_t i = 0; i < peers.size(); i++) {
+        psumo::connect(*peers[i], getBarrierSocketName(dataDir, getPartitionHost(hosts, peerIds[i]), peerIds[i], transport));
+    }
+}
+
+void PeerBarrier::close() {
+    psumo::close(*socket);
+    for (auto peer : peers) psumo::close(*peer);
+}
+
+void PeerBarrier::send(int peer, int round, bool flag) {
+    zmq::message_t message(sizeof(int) * 2 + sizeof(bool));
+    MessageWriter writer(message);
+    writer.write(episode);
+    writer.write(round);
+    writer.write(flag);
+    peers[peer]->send(message, zmq::send_flags::none);
+}
+
+int PeerBarrier::receive(bool& flag, int& messageEpisode) {
+    zmq::message_t message;
+    [[maybe_unused]] auto _ = socket->recv(message, zmq::recv_flags::none);
+    MessageReader reader(message);
+    messageEpisode = reader.read<int>();
+    int round = reader.read<int>();
+    flag = reader.read<bool>();
+    return round;
+}
+
+TreeBarrier::TreeBarrier(zmq::context_t& zcontext, const string& dataDir, const vector<string>& hosts,
+    partId_t id, int numParts, TransportType transport
+):
+    PeerBarrier(zcontext, dataDir, hosts, id, numParts, transport),
+    parent(-1)
+{
+    if (id > 0) {
+        parent = peers.size();
+        addPeer((id - 1) / TREE_BARRIER_ARITY);
+    }
+    for (int i = 1; i <= TREE_BARRIER_ARITY; i++) {
+        partId_t child = id * TREE_BARRIER_ARITY + i;
+        if (child >= numParts) break;
+        children.push_back(peers.size());
+        addPeer(child);
+    }
+}
+
+// Round of the messages going up and down the tree
+static const int TREE_ARRIVE = 0;
+static const int TREE_RELEASE = 1;
+
+bool TreeBarrier::arriveAndWait(bool flag) {
+    // Children can only arrive at the next barrier after being
+    // released from this one, so all messages are for this one
+    bool childFlag;
+    int messageEpisode;
+    for (size_t i = 0; i < children.size(); i++) {
+        receive(childFlag, messageEpisode);
+        flag = flag && childFlag;
+    }
+
+    if (parent >= 0) {
+        send(parent, TREE_ARRIVE, flag);
+        receive(flag, messageEpisode);
+    }
+
+    for (int child : children) {
+        send(child, TREE_RELEASE, flag);
+    }
+    episode++;
+    return flag;
+}
+
+DisseminationBarrier::DisseminationBarrier(zmq::context_t& zcontext, const string& dataDir, const vector<string>& hosts,
+    partId_t id, int numParts, TransportType transport
+):
+    PeerBarrier(zcontext, dataDir, hosts, id, numParts, transport),
+    rounds(0)
+{
+    for (int distance = 1; distance < numParts; distance *= 2) {
+        addPeer((id + distance) % numParts);
+        rounds++;
+    }
+    for (int parity = 0; parity < 2; parity++) {
+        received[parity].assign(rounds, false);
+        receivedFlags[parity].assign(rounds, false);
+    }
+}
+
+bool DisseminationBarrier::arriveAndWait(bool flag) {
+    int parity = episode % 2;
+    for (int round = 0; round < rounds; round++) {
+        send(round, round, flag);
+
+        while (!received[parity][round]) {
+            bool messageFlag;
+            int messageEpisode;
+            int messageRound = receive(messageFlag, messageEpisode);
+            received[messageEpisode % 2][messageRound] = true;
+            receivedFlags[messageEpisode % 2][messageRound] = messageFlag;
+        }
+        received[parity][round] = false;
+        flag = flag && receivedFlags[parity][round];
+    }
+    episode++;
+    return flag;
+}
+
+#ifndef USING_WIN
+ShmBarrier::ShmBarrier(const string& dataDir, partId_t id, int numParts, int spinMicros):
+    id(id),
+    numParts(numParts),
+    path(getShmBarrierName(dataDir)),
+    spinMicros(spinMicros),
+    barrier(nullptr)
+{}
+
+ShmBarrier::~ShmBarrier() {
+    close();
+}
+
+void ShmBarrier::map(bool create) {
+    barrier = static_cast<shm_barrier_t*>(mapShmSegment(path, create, sizeof(shm_barrier_t)));
+}
+
+void ShmBarrier::bind() {
+    // Zero filled, the initial state
+    if (id == 0) map(true);
+}
+
+void ShmBarrier::connect() {
+    if (id != 0) map(false);
+}
+
+void ShmBarrier::close() {
+    if (barrier == nullptr) return;
+    munmap(barrier, sizeof(shm_barrier_t));
+    barrier = nullptr;
+    // The others keep their mapping
+    if (id == 0) unlink(path.c_str());
+}
+
+static inline void spinPause() {
+    #if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+    #endif
+}
+
+bool ShmBarrier::arriveAndWait(bool flag) {
+    // Partitions only see the next barrier's count after it is released,
+    // so the parity does not change until all arrived
+    uint32_t seen = barrier->released.load();
+    int parity = seen % 2;
+    if (!flag) barrier->falseFlags[parity].fetch_add(1);
+
+    if (barrier->arrived.fetch_add(1) + 1 == static_cast<uint32_t>(numParts)) {
+        bool all = barrier->falseFlags[parity].load() == 0;
+        barrier->result[parity].store(all);
+        // Nobody arrived at the next one yet, and the previous one
+        // with the same parity was fully read
+        barrier->falseFlags[1 - parity].store(0);
+        barrier->arrived.store(0);
+        barrier->released.ring();
+        return all;
+    }
+
+    auto spinEnd = chrono::steady_clock::now() + chrono::microseconds(spinMicros);
+    for (int i = 0; barrier->released.load() == seen; i++) {
+        // Checking the clock costs more than a pause
+        if (i % 64 == 63 && chrono::steady_clock::now() >= spinEnd) {
+            barrier->released.wait(seen);
+            break;
+        }
+        spinPause();
+    }
+    return barrier->result[parity].load();
+}
+#endif
+
+StepBarrier* makeStepBarrier(BarrierType type, zmq::context_t& zcontext, zmq::socket_t& coordinatorSocket,
+    const string& dataDir, const vector<string>& hosts, partId_t id, int numParts,
+    TransportType transport, int spinMicros
+) {
+    switch (type) {
+        case BarrierType::SHM:
+            #ifndef USING_WIN
+            return new ShmBarrier(dataDir, id, numParts, spinMicros);
+            #else
+            throw runtime_error("The shm barrier is not supported on Windows");
+            #endif
+        case BarrierType::TREE:
+            return new TreeBarrier(zcontext, dataDir, hosts, id, numParts, transport);
+        case BarrierType::DISSEMINATION:
+            return new DisseminationBarrier(zcontext, dataDir, hosts, id, numParts, transport);
+        case BarrierType::CENTRAL:
+        default:
+            return new CentralBarrier(coordinatorSocket);
+    }
+}
+
+}
@@ -0,0 +1,178 @@
+/**
+StepBarrier.hpp
+
+Barrier all partitions wait at the end of each step in global sync mode,
+through the coordinator or directly between the partitions, chosen
+with --barrier.
+
+Author: Filippo Lenzi
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <zmq.hpp>
+
+#include "psumoTypes.hpp"
+#include "ShmLink.hpp"
+
+namespace psumo {
+
+/**
+Each partition calls arriveAndWait once per step, with a flag (if it is
+empty); it returns once all partitions arrived, with the AND of their flags.
+*/
+class StepBarrier {
+public:
+    virtual ~StepBarrier() {}
+
+    // Bind before the ready handshake, connect after it, as the
+    // barriers between partitions need the others to be bound
+    virtual void bind() {}
+    virtual void connect() {}
+    virtual void close() {}
+    virtual bool arriveAndWait(bool flag) = 0;
+};
+
+/**
+Through the coordinator's sync socket, which replies to all partitions once
+all of them arrived (see ParallelSim::coordinatePartitionsSync): two messages
+per partition, all handled by the coordinator's thread, so latency grows
+linearly with the partition count.
+*/
+class CentralBarrier : public StepBarrier {
+private:
+    // Owned by the caller, connected to the coordinator
+    zmq::socket_t& coordinatorSocket;
+public:
+    CentralBarrier(zmq::socket_t& coordinatorSocket): coordinatorSocket(coordinatorSocket) {}
+
+    bool arriveAndWait(bool flag) override;
+};
+
+/**
+Barriers with messages between the partitions: each binds a PULL socket
+(see getBarrierSocketName) and connects PUSH sockets to the peers it sends to.
+Messages are {int episode, int round, bool flag}, episode being the count
+of barriers the sender passed.
+*/
+class PeerBarrier : public StepBarrier {
+protected:
+    const partId_t id;
+    const int numParts;
+    const std::string dataDir;
+    // Of all partitions, see getPartitionHost
+    const std::vector<std::string> hosts;
+    const TransportType transport;
+    zmq::context_t& zcontext;
+    zmq::socket_t* socket;
+    std::vector<partId_t> peerIds;
+    std::vector<zmq::socket_t*> peers;
+    int episode;
+
+    // Called by the constructor of the subclass
+    void addPeer(partId_t peer);
+    void send(int peer, int round, bool flag);
+    // Blocks until the next message, returns its round
+    int receive(bool& flag, int& messageEpisode);
+public:
+    PeerBarrier(zmq::context_t& zcontext, const std::string& dataDir, const std::vector<std::string>& hosts,
+        partId_t id, int numParts, TransportType transport);
+    ~PeerBarrier();
+
+    void bind() override;
+    void connect() override;
+    void close() override;
+};
+
+static const int TREE_BARRIER_ARITY = 4;
+
+/**
+Combining tree: each partition waits for the arrival of its children, sends
+the AND of their flags and its own to its parent, and the root sends the
+result back down. 2(N - 1) messages per barrier, with the wait depending
+on the depth of the tree (log N with TREE_BARRIER_ARITY children each).
+*/
+class TreeBarrier : public PeerBarrier {
+private:
+    // Index in peers, -1 for the root
+    int parent;
+    std::vector<int> children;
+public:
+    TreeBarrier(zmq::context_t& zcontext, const std::string& dataDir, const std::vector<std::string>& hosts,
+        partId_t id, int numParts, TransportType transport);
+
+    bool arriveAndWait(bool flag) override;
+};
+
+/**
+Dissemination barrier: in round r each partition sends to the one 2^r after
+it and waits for the one 2^r before it, for ceil(log2 N) rounds, combining
+the flags along the way (AND can be combined more than once). No root and
+no release phase, N log N messages per barrier.
+*/
+class DisseminationBarrier : public PeerBarrier {
+private:
+    int rounds;
+    // Messages of the next episode can arrive before the current one is done,
+    // as the sender can already be out of the barrier; indexed by episode parity
+    std::vector<bool> received[2];
+    std::vector<bool> receivedFlags[2];
+public:
+    DisseminationBarrier(zmq::context_t& zcontext, const std::string& dataDir, const std::vector<std::string>& hosts,
+        partId_t id, int numParts, TransportType transport);
+
+    bool arriveAndWait(bool flag) override;
+};
+
+#ifndef USING_WIN
+struct shm_barrier_t {
+    // Partitions arrived at the current barrier
+    alignas(64) std::atomic<uint32_t> arrived;
+    // Partitions that arrived with a false flag, and the combined
+    // flag once all arrived, by barrier parity
+    std::atomic<uint32_t> falseFlags[2];
+    std::atomic<uint32_t> result[2];
+    // Rung by the last partition to arrive, its counter is
+    // the number of barriers passed
+    ShmDoorbell released;
+};
+
+/**
+Counter in a shared memory segment mapped by all partitions (see
+getShmBarrierName), for partitions on the same host: no messages, the last
+partition to arrive wakes the others through a futex. Partitions spin on the
+counter for spinMicros first, as with short steps the wait is often shorter
+than going to sleep and being woken up.
+*/
+class ShmBarrier : public StepBarrier {
+private:
+    const partId_t id;
+    const int numParts;
+    const std::string path;
+    const int spinMicros;
+    shm_barrier_t* barrier;
+
+    void map(bool create);
+public:
+    ShmBarrier(const std::string& dataDir, partId_t id, int numParts, int spinMicros);
+    ~ShmBarrier();
+
+    // Partition 0 creates the segment, the others open it
+    void bind() override;
+    void connect() override;
+    void close() override;
+    bool arriveAndWait(bool flag) override;
+};
+#endif
+
+// coordinatorSocket is only used by the central barrier, spinMicros
+// by the shared memory one
+StepBarrier* makeStepBarrier(BarrierType type, zmq::context_t& zcontext, zmq::socket_t& coordinatorSocket,
+    const std::string& dataDir, const std::vector<std::string>& hosts, partId_t id, int numParts,
+    TransportType transport, int spinMicros = 0);
+
+}
@@ -0,0 +1,210 @@
+/**
+TimeWarp.cpp
+
+State for the optimistic sync mode: partitions run ahead without waiting
+for their neighbors, and roll back to a saved state when a vehicle arrives
+for a step they already simulated.
+
+Author: Filippo Lenzi
+*/
+
+#include "TimeWarp.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <filesystem>
+#include <iostream>
+#include <libsumo/Simulation.h>
+#include <sstream>
+
+using namespace std;
+using namespace libsumo;
+
+namespace psumo {
+
+TimeWarp::TimeWarp(const string& checkpointDir, partId_t id, double deltaT):
+    checkpointDir(checkpointDir),
+    id(id),
+    stragglerTime(numeric_limits<double>::infinity()),
+    halfDeltaT(deltaT / 2)
+{
+    filesystem::create_directories(checkpointDir);
+}
+
+TimeWarp::~TimeWarp() {
+    for (auto& checkpoint : checkpoints) {
+        filesystem::remove(checkpoint.file);
+    }
+}
+
+void TimeWarp::checkpoint(int step, const unordered_map<string, int>& routeProgress) {
+    // Just rolled back here
+    if (!checkpoints.empty() && checkpoints.back().step == step) return;
+
+    string file = filesystem::path(checkpointDir) / ("part" + to_string(id) + "_" + to_string(step) + ".xml");
+    Simulation::saveState(file);
+    checkpoints.push_back({Simulation::getTime(), step, file, routeProgress});
+    checkpointsSaved++;
+}
+
+void TimeWarp::recordUnacked(partId_t to, double time) {
+    time_warp_link_t& link = links[to];
+    link.sentCount++;
+    link.unacked.push_back(time);
+}
+
+void TimeWarp::recordSent(partId_t to, double time, const string& vehId) {
+    sent.push_back({time, to, vehId});
+    recordUnacked(to, time);
+}
+
+void TimeWarp::receive(partId_t from, double time, add_veh_t vehicle, double now) {
+    links[from].receivedCount++;
+    if (time < now - halfDeltaT) {
+        stragglerTime = min(stragglerTime, time);
+    }
+    received.push_back({time, from, std::move(vehicle), false});
+}
+
+void TimeWarp::receiveCancel(partId_t from, double time, string_view vehId) {
+    links[from].receivedCount++;
+    auto it = find_if(received.begin(), received.end(), [&](const received_veh_t& entry) {
+        return entry.from == from && entry.vehicle.vehId == vehId && abs(entry.time - time) < halfDeltaT;
+    });
+    if (it == received.end()) {
+        // Messages from the same neighbor arrive in order, should not happen
+        stringstream msg;
+        msg << "[WARN] Partition " << id << " | Cancelled vehicle " << vehId
+            << " from " << from << " at time " << time << " was never received" << endl;
+        cerr << msg.str();
+        return;
+    }
+    // Already in the simulation, go back to before it was added
+    if (it->applied) {
+        stragglerTime = min(stragglerTime, time);
+    }
+    received.erase(it);
+}
+
+int TimeWarp::rollback(int currentStep, unordered_map<partId_t, vector<pair<string, double>>>& cancel,
+    unordered_map<string, int>& routeProgress
+) {
+    double target = stragglerTime;
+    stragglerTime = numeric_limits<double>::infinity();
+
+    // Latest state from before the straggler's step
+    auto checkpointIt = find_if(checkpoints.rbegin(), checkpoints.rend(), [&](const checkpoint_t& checkpoint) {
+        return checkpoint.time < target - halfDeltaT;
+    });
+    if (checkpointIt == checkpoints.rend()) {
+        stringstream msg;
+        msg << "[WARN] Partition " << id << " | No checkpoint before time " << target
+            << " (already collected), adding the vehicles late" << endl;
+        cerr << msg.str();
+        return -1;
+    }
+
+    checkpoint_t checkpoint = *checkpointIt;
+    Simulation::loadState(checkpoint.file);
+    routeProgress = std::move(checkpoint.routeProgress);
+
+    // States after the restored one will be simulated again
+    while (checkpoints.back().step != checkpoint.step) {
+        filesystem::remove(checkpoints.back().file);
+        checkpoints.pop_back();
+    }
+
+    for (auto& entry : received) {
+        if (entry.time > checkpoint.time + halfDeltaT) entry.applied = false;
+    }
+    auto undoneIt = remove_if(sent.begin(), sent.end(), [&](const sent_veh_t& entry) {
+        if (entry.time > checkpoint.time + halfDeltaT) {
+            // Sent right after, see PartitionManager::handleOptimisticOperations
+            cancel[entry.to].push_back({entry.vehId, entry.time});
+            recordUnacked(entry.to, entry.time);
+            return true;
+        }
+        return false;
+    });
+    sent.erase(undoneIt, sent.end());
+
+    rollbacks++;
+    rolledBackSteps += currentStep - checkpoint.step;
+    return checkpoint.step;
+}
+
+vector<const add_veh_t*> TimeWarp::takeDue(double now) {
+    vector<const add_veh_t*> due;
+    for (auto& entry : received) {
+        // Earlier ones only if there was no checkpoint to roll back to
+        if (!entry.applied && entry.time < now + halfDeltaT) {
+            entry.applied = true;
+            due.push_back(&entry.vehicle);
+        }
+    }
+    return due;
+}
+
+bool TimeWarp::hasPending() const {
+    return any_of(received.begin(), received.end(), [](const received_veh_t& entry) {
+        return !entry.applied;
+    });
+}
+
+bool TimeWarp::hasUnacked() const {
+    return any_of(links.begin(), links.end(), [](const auto& link) {
+        return !link.second.unacked.empty();
+    });
+}
+
+double TimeWarp::getLocalTime(double now) const {
+    double localTime = min(now, stragglerTime);
+    for (auto& entry : received) {
+        if (!entry.applied) localTime = min(localTime, entry.time);
+    }
+    for (auto& [to, link] : links) {
+        for (double time : link.unacked) localTime = min(localTime, time);
+    }
+    return localTime;
+}
+
+bool TimeWarp::takeAck(partId_t from, uint64_t& count) {
+    auto it = links.find(from);
+    if (it == links.end() || it->second.receivedCount == it->second.ackedReceived) return false;
+    count = it->second.ackedReceived = it->second.receivedCount;
+    return true;
+}
+
+void TimeWarp::acknowledge(partId_t to, uint64_t count) {
+    time_warp_link_t& link = links[to];
+    // The unacknowledged ones are the last sent
+    while (!link.unacked.empty() && link.sentCount - link.unacked.size() < count) {
+        link.unacked.pop_front();
+    }
+}
+
+void TimeWarp::fossilCollect(double gvt) {
+    // Keep the latest checkpoint a rollback to gvt would need
+    auto keepIt = find_if(checkpoints.rbegin(), checkpoints.rend(), [&](const checkpoint_t& checkpoint) {
+        return checkpoint.time < gvt - halfDeltaT;
+    });
+    if (keepIt == checkpoints.rend()) return;
+
+    double keptTime = keepIt->time;
+    int keptStep = keepIt->step;
+    while (checkpoints.front().step != keptStep) {
+        filesystem::remove(checkpoints.front().file);
+        checkpoints.pop_front();
+    }
+
+    auto receivedIt = remove_if(received.begin(), received.end(), [&](const received_veh_t& entry) {
+        return entry.applied && entry.time < keptTime + halfDeltaT;
+    });
+    received.erase(receivedIt, received.end());
+    auto sentIt = remove_if(sent.begin(), sent.end(), [&](const sent_veh_t& entry) {
+        return entry.time < keptTime + halfDeltaT;
+    });
+    sent.erase(sentIt, sent.end());
+}
+
+}
@@ -0,0 +1,136 @@
+/**
+TimeWarp.hpp
+
+State for the optimistic sync mode: partitions run ahead without waiting
+for their neighbors, and roll back to a saved state when a vehicle arrives
+for a step they already simulated.
+
+Author: Filippo Lenzi
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <limits>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "psumoTypes.hpp"
+
+namespace psumo {
+
+typedef struct {
+    double time;
+    int step;
+    std::string file;
+    // Not in the SUMO state, see PartitionManager::vehicleMultipartRouteProgress
+    std::unordered_map<std::string, int> routeProgress;
+} checkpoint_t;
+
+typedef struct {
+    double time;
+    partId_t from;
+    add_veh_t vehicle;
+    // Kept after being applied, to apply again after rolling back
+    bool applied;
+} received_veh_t;
+
+typedef struct {
+    double time;
+    partId_t to;
+    std::string vehId;
+} sent_veh_t;
+
+typedef struct {
+    // Vehicles and cancellations sent to the neighbor, the neighbor
+    // counts them in the same order as it takes them
+    uint64_t sentCount = 0;
+    // Times of the ones it did not acknowledge yet, the last ones sent
+    std::deque<double> unacked;
+    // Vehicles and cancellations taken from the neighbor, and the
+    // count last acknowledged to it
+    uint64_t receivedCount = 0;
+    uint64_t ackedReceived = 0;
+} time_warp_link_t;
+
+/**
+Checkpoints of the simulation (Simulation::saveState), vehicles received
+from the neighbors and vehicles sent to them since the oldest checkpoint.
+Times are the simulation times of the steps the vehicles are added at.
+Only used by the main thread of the partition.
+*/
+class TimeWarp {
+private:
+    const std::string checkpointDir;
+    const partId_t id;
+    std::deque<checkpoint_t> checkpoints;
+    std::vector<received_veh_t> received;
+    std::vector<sent_veh_t> sent;
+    // Earliest time of a received vehicle or cancellation for a step
+    // already simulated, infinity if none
+    double stragglerTime;
+    std::unordered_map<partId_t, time_warp_link_t> links;
+    double halfDeltaT;
+
+    void recordUnacked(partId_t to, double time);
+
+    int rollbacks = 0;
+    int rolledBackSteps = 0;
+    int simulatedSteps = 0;
+    int checkpointsSaved = 0;
+public:
+    TimeWarp(const std::string& checkpointDir, partId_t id, double deltaT);
+    ~TimeWarp();
+
+    // Save the current state with the multipart route progress of the
+    // vehicles, unless it was already saved at this step
+    void checkpoint(int step, const std::unordered_map<std::string, int>& routeProgress);
+    void countStep() { simulatedSteps++; }
+
+    void recordSent(partId_t to, double time, const std::string& vehId);
+    void receive(partId_t from, double time, add_veh_t vehicle, double now);
+    // Anti-message: the neighbor rolled back before sending the vehicle
+    void receiveCancel(partId_t from, double time, std::string_view vehId);
+
+    bool needsRollback() const { return stragglerTime < std::numeric_limits<double>::infinity(); }
+    // Load the latest checkpoint before the straggler, returning its step; cancel
+    // is filled with the sent vehicles to undo for each neighbor, and
+    // routeProgress set to the one saved with it
+    // (-1 if there is none, then the vehicles are added late)
+    int rollback(int currentStep, std::unordered_map<partId_t, std::vector<std::pair<std::string, double>>>& cancel,
+        std::unordered_map<std::string, int>& routeProgress);
+    // Vehicles to add at the current step, marked as applied
+    std::vector<const add_veh_t*> takeDue(double now);
+    // If there are received vehicles still to add
+    bool hasPending() const;
+    // If the neighbors did not acknowledge all the vehicles and
+    // cancellations sent to them yet
+    bool hasUnacked() const;
+
+    // Local virtual time to report to the coordinator: the lowest time this
+    // partition or its messages can still make a neighbor roll back to.
+    // Messages count until the neighbor acknowledges them, which it does
+    // only once its own report includes them (see takeAck), so the
+    // coordinator's minimum of the latest reports never skips a message in
+    // flight or a rollback it causes
+    double getLocalTime(double now) const;
+    // Count of messages from the neighbor to acknowledge, after reporting,
+    // if more were taken since the last acknowledgement
+    bool takeAck(partId_t from, uint64_t& count);
+    // The neighbor took the first count messages sent to it
+    void acknowledge(partId_t to, uint64_t count);
+    // Drop checkpoints and messages no rollback can go back to anymore,
+    // gvt is the lowest time any partition can still send a vehicle for
+    void fossilCollect(double gvt);
+
+    int getRollbacks() const { return rollbacks; }
+    int getRolledBackSteps() const { return rolledBackSteps; }
+    int getSimulatedSteps() const { return simulatedSteps; }
+    int getCheckpointsSaved() const { return checkpointsSaved; }
+};
+
+}
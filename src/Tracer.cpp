@@ -0,0 +1,138 @@
+/**
+Tracer.cpp
+
+Timeline of what each thread of the coordinator and partitions is doing
+(steps, messages, barriers), enabled with --trace and written as a Chrome
+trace event file, to be opened with Perfetto or chrome://tracing.
+
+Author: Filippo Lenzi
+*/
+
+#include "Tracer.hpp"
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+
+using namespace std;
+
+namespace psumo {
+
+bool Tracer::enabled = false;
+int Tracer::pid = 0;
+string Tracer::processName;
+mutex Tracer::buffersLock;
+vector<unique_ptr<Tracer::thread_buffer_t>> Tracer::buffers;
+
+Tracer::thread_buffer_t& Tracer::threadBuffer() {
+    thread_local thread_buffer_t* buffer = nullptr;
+    if (buffer == nullptr) {
+        lock_guard<mutex> lock(buffersLock);
+        int tid = buffers.size();
+        buffers.push_back(unique_ptr<thread_buffer_t>(new thread_buffer_t{tid, "thread " + to_string(tid), {}}));
+        buffer = buffers.back().get();
+    }
+    return *buffer;
+}
+
+void Tracer::enable(int pid_, const string& processName_) {
+    pid = pid_;
+    processName = processName_;
+    enabled = true;
+}
+
+void Tracer::nameThread(const string& name) {
+    if (!enabled) return;
+    threadBuffer().name = name;
+}
+
+void Tracer::record(const char* name, char phase, const char* argName, int64_t arg) {
+    int64_t nanos = chrono::duration_cast<chrono::nanoseconds>(
+        chrono::steady_clock::now().time_since_epoch()
+    ).count();
+    threadBuffer().events.push_back({name, argName, arg, nanos, phase});
+}
+
+void Tracer::writeEvents(ostream& out) {
+    lock_guard<mutex> lock(buffersLock);
+
+    out << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << pid
+        << ",\"args\":{\"name\":\"" << processName << "\"}}\n";
+    out << "{\"name\":\"process_sort_index\",\"ph\":\"M\",\"pid\":" << pid
+        << ",\"args\":{\"sort_index\":" << pid << "}}\n";
+
+    char ts[32];
+    for (auto& buffer : buffers) {
+        out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << pid << ",\"tid\":" << buffer->tid
+            << ",\"args\":{\"name\":\"" << buffer->name << "\"}}\n";
+        for (const trace_event_t& event : buffer->events) {
+            // Microseconds, keeping the nanoseconds as decimals
+            snprintf(ts, sizeof(ts), "%lld.%03lld", (long long) (event.nanos / 1000), (long long) (event.nanos % 1000));
+            out << "{\"name\":\"" << event.name << "\",\"ph\":\"" << event.phase << "\",\"ts\":" << ts
+                << ",\"pid\":" << pid << ",\"tid\":" << buffer->tid;
+            // Instant events only in their thread's track
+            if (event.phase == 'i') out << ",\"s\":\"t\"";
+            if (event.argName != nullptr) {
+                out << ",\"args\":{\"" << event.argName << "\":" << event.arg << "}";
+            }
+            out << "}\n";
+        }
+    }
+}
+
+void Tracer::writePart(const string& file) {
+    if (!enabled) return;
+
+    ofstream out(file);
+    if (!out) {
+        cerr << "Failed to open trace file " << file << endl;
+        return;
+    }
+    writeEvents(out);
+}
+
+void Tracer::writeMerged(const string& file, const vector<string>& partFiles) {
+    if (!enabled) return;
+
+    ofstream out(file);
+    if (!out) {
+        cerr << "Failed to open trace file " << file << endl;
+        return;
+    }
+
+    // Events are one per line, in both the parts and the buffer
+    // written by writeEvents: separate them while copying
+    stringstream own;
+    writeEvents(own);
+    out << "{\"traceEvents\":[\n";
+    bool first = true;
+    auto copyLines = [&](istream& in) {
+        string line;
+        while (getline(in, line)) {
+            if (line.empty()) continue;
+            if (!first) out << ",\n";
+            out << line;
+            first = false;
+        }
+    };
+    copyLines(own);
+    for (const string& partFile : partFiles) {
+        ifstream in(partFile);
+        if (!in) {
+            // Partitions that ended with an error do not write theirs
+            cerr << "Missing trace of a partition: " << partFile << endl;
+            continue;
+        }
+        copyLines(in);
+    }
+    out << "\n],\"displayTimeUnit\":\"ms\"}\n";
+}
+
+string getTracePartFile(const string& dataDir, partId_t id) {
+    return dataDir + "/trace" + to_string(id) + ".part.json";
+}
+
+}
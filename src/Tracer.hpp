@@ -0,0 +1,110 @@
+/**
+Tracer.hpp
+
+Timeline of what each thread of the coordinator and partitions is doing
+(steps, messages, barriers), enabled with --trace and written as a Chrome
+trace event file, to be opened with Perfetto or chrome://tracing.
+
+Author: Filippo Lenzi
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <iosfwd>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "psumoTypes.hpp"
+
+namespace psumo {
+
+typedef struct {
+    // Names are string literals, kept as pointers
+    const char* name;
+    const char* argName;
+    int64_t arg;
+    // steady_clock, which is the same for all processes in a host
+    int64_t nanos;
+    // 'B', 'E' or 'i' (instant)
+    char phase;
+} trace_event_t;
+
+/**
+Each thread records its events in its own buffer, registered the first
+time it records (the only time a lock is taken), so recording is only
+reading the clock and appending to a thread local deque. Each process
+writes its buffers at the end (see writePart), and the coordinator merges
+them in the file given to --trace once the partitions exited: processes
+are tracks (the coordinator first), with a track for each of their threads.
+Partitions on different hosts (tcp transport) have unrelated clocks.
+*/
+class Tracer {
+private:
+    typedef struct {
+        int tid;
+        std::string name;
+        std::deque<trace_event_t> events;
+    } thread_buffer_t;
+
+    static bool enabled;
+    static int pid;
+    static std::string processName;
+    // Buffers of all threads that recorded, kept after the threads end
+    static std::mutex buffersLock;
+    static std::vector<std::unique_ptr<thread_buffer_t>> buffers;
+
+    static thread_buffer_t& threadBuffer();
+    static void record(const char* name, char phase, const char* argName, int64_t arg);
+    // One event per line, without separators
+    static void writeEvents(std::ostream& out);
+public:
+    // Call before starting the threads to trace; pid orders the tracks
+    static void enable(int pid, const std::string& processName);
+    static bool isEnabled() { return enabled; }
+    static void nameThread(const std::string& name);
+
+    static void begin(const char* name, const char* argName = nullptr, int64_t arg = 0) {
+        if (enabled) record(name, 'B', argName, arg);
+    }
+    static void end(const char* name) {
+        if (enabled) record(name, 'E', nullptr, 0);
+    }
+    static void instant(const char* name, const char* argName = nullptr, int64_t arg = 0) {
+        if (enabled) record(name, 'i', argName, arg);
+    }
+
+    // Once all traced threads of the process stopped: partitions write their
+    // events to a part file, the coordinator merges them with its own
+    static void writePart(const std::string& file);
+    static void writeMerged(const std::string& file, const std::vector<std::string>& partFiles);
+};
+
+/**
+Begin and end event around a scope, if tracing is enabled.
+*/
+class TraceScope {
+private:
+    const char* name;
+    bool traced;
+public:
+    TraceScope(const char* name, const char* argName = nullptr, int64_t arg = 0):
+        name(name), traced(Tracer::isEnabled())
+    {
+        if (traced) Tracer::begin(name, argName, arg);
+    }
+    ~TraceScope() {
+        if (traced) Tracer::end(name);
+    }
+
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+};
+
+// Events of a partition, written at its end and merged by the coordinator
+std::string getTracePartFile(const std::string& dataDir, partId_t id);
+
+}
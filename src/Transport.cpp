@@ -0,0 +1,305 @@
+/**
+Transport.cpp
+
+Interface for the links between partitions, with the ZMQ socket (ipc, tcp,
+inproc) and shared memory implementations, chosen with --transport.
+
+Author: Filippo Lenzi
+*/
+
+#include "Transport.hpp"
+
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <zmq.hpp>
+
+#include "messagingShared.hpp"
+
+using namespace std;
+
+namespace psumo {
+
+const int DISCONNECT_CONTEXT_TERMINATED_ERR = 156384765;
+
+static void closeSocket(zmq::socket_t& socket) {
+    try {
+        close(socket);
+    } catch (zmq::error_t& e) {
+        // If the context is already terminated, then not a problem if it didn't disconnect
+        if (e.num() != DISCONNECT_CONTEXT_TERMINATED_ERR) {
+            stringstream msg;
+            msg << "Error in disconnecting socket: " << e.what() << "/" << e.num() << endl;
+            cerr << msg.str();
+        }
+    }
+}
+
+void ClientTransport::sendAsyncBatch(vector<TransportMessage>& messages) {
+    for (auto& message : messages) {
+        sendAsync(message);
+    }
+}
+
+ZmqClientTransport::ZmqClientTransport(zmq::context_t& zcontext, const string& socketUri, const string& asyncSocketUri,
+    const string& senderId
+):
+    socketUri(socketUri),
+    asyncSocketUri(asyncSocketUri),
+    senderId(senderId),
+    connected(false),
+    socket(makeSocket(zcontext, zmq::socket_type::req)),
+    asyncSocket(makeSocket(zcontext, zmq::socket_type::push))
+{
+    if (!senderId.empty()) socket->set(zmq::sockopt::routing_id, senderId);
+    // Connected before the neighbor binds, see PartitionManager::runSimulation
+    socket->set(zmq::sockopt::reconnect_ivl, 10);
+    asyncSocket->set(zmq::sockopt::reconnect_ivl, 10);
+}
+
+ZmqClientTransport::~ZmqClientTransport() {
+    if (connected) disconnect();
+    delete socket;
+    delete asyncSocket;
+}
+
+void ZmqClientTransport::connect() {
+    psumo::connect(*socket, socketUri);
+    psumo::connect(*asyncSocket, asyncSocketUri);
+    connected = true;
+}
+
+void ZmqClientTransport::disconnect() {
+    connected = false;
+    closeSocket(*socket);
+    closeSocket(*asyncSocket);
+}
+
+void ZmqClientTransport::sendRequest(TransportMessage& message) {
+    socket->send(message.zmqMessage(), zmq::send_flags::none);
+}
+
+void ZmqClientTransport::receiveReply(TransportMessage& reply) {
+    [[maybe_unused]] auto _ = socket->recv(reply.zmqMessage());
+}
+
+void ZmqClientTransport::sendAsync(TransportMessage& message) {
+    asyncSocket->send(message.zmqMessage(), zmq::send_flags::none);
+}
+
+ZmqServerTransport::ZmqServerTransport(zmq::context_t& zcontext, const string& socketUri,
+    const string& asyncSocketUri, const string& controlUri
+):
+    socketUri(socketUri),
+    asyncSocketUri(asyncSocketUri),
+    controlUri(controlUri),
+    socket(makeSocket(zcontext, zmq::socket_type::rep)),
+    asyncSocket(makeSocket(zcontext, zmq::socket_type::pull)),
+    controlSocketMain(makeSocket(zcontext, zmq::socket_type::pair)),
+    controlSocketThread(makeSocket(zcontext, zmq::socket_type::pair))
+{}
+
+ZmqServerTransport::~ZmqServerTransport() {
+    delete socket;
+    delete asyncSocket;
+    delete controlSocketMain;
+    delete controlSocketThread;
+}
+
+void ZmqServerTransport::bind() {
+    psumo::bind(*socket, socketUri);
+    psumo::bind(*asyncSocket, asyncSocketUri);
+    psumo::bind(*controlSocketThread, controlUri);
+    psumo::connect(*controlSocketMain, controlUri);
+}
+
+void ZmqServerTransport::close() {
+    closeSocket(*socket);
+    closeSocket(*asyncSocket);
+    closeSocket(*controlSocketMain);
+    closeSocket(*controlSocketThread);
+}
+
+ServerTransport::PollEvent ZmqServerTransport::poll(bool readAsync, bool readRequests) {
+    // Wait for the first message between the partition sockets and the thread socket,
+    // only polling the ones to read
+    zmq::pollitem_t pollitems[3] = {
+        { castPollSocket(*controlSocketThread), 0, ZMQ_POLLIN, 0 }
+    };
+    int count = 1;
+    int requestItem = -1, asyncItem = -1;
+    if (readRequests) {
+        requestItem = count++;
+        pollitems[requestItem] = { castPollSocket(*socket), 0, ZMQ_POLLIN, 0 };
+    }
+    if (readAsync) {
+        asyncItem = count++;
+        pollitems[asyncItem] = { castPollSocket(*asyncSocket), 0, ZMQ_POLLIN, 0 };
+    }
+
+    int rc = zmq::poll(pollitems, count);
+
+    if (rc == -1) {
+        return INTERRUPTED;
+    }
+    if (pollitems[0].revents & ZMQ_POLLIN) {
+        zmq::message_t control;
+        [[maybe_unused]] auto _ = controlSocketThread->recv(control, zmq::recv_flags::none);
+        return WAKE;
+    }
+    if (requestItem >= 0 && (pollitems[requestItem].revents & ZMQ_POLLIN)) {
+        return REQUEST;
+    }
+    if (asyncItem >= 0 && (pollitems[asyncItem].revents & ZMQ_POLLIN)) {
+        return ASYNC;
+    }
+    return INTERRUPTED;
+}
+
+void ZmqServerTransport::receiveRequest(TransportMessage& request) {
+    [[maybe_unused]] auto _ = socket->recv(request.zmqMessage(), zmq::recv_flags::none);
+}
+
+void ZmqServerTransport::receiveAsync(TransportMessage& message) {
+    [[maybe_unused]] auto _ = asyncSocket->recv(message.zmqMessage(), zmq::recv_flags::none);
+}
+
+void ZmqServerTransport::sendReply(TransportMessage& reply) {
+    socket->send(reply.zmqMessage(), zmq::send_flags::none);
+}
+
+void ZmqServerTransport::wake(const string& reason) {
+    controlSocketMain->send(zmq::message_t(reason.data(), reason.size()), zmq::send_flags::none);
+}
+
+#ifndef USING_WIN
+ShmClientTransport::ShmClientTransport(const string& path):
+    path(path),
+    link(nullptr)
+{}
+
+ShmClientTransport::~ShmClientTransport() {
+    delete link;
+}
+
+void ShmClientTransport::connect() {
+    // Created by the server before the start barrier
+    link = new ShmLink(path, false);
+}
+
+void ShmClientTransport::disconnect() {
+    delete link;
+    link = nullptr;
+}
+
+void ShmClientTransport::sendRequest(TransportMessage& message) {
+    link->sendRequest(message);
+}
+
+void ShmClientTransport::receiveReply(TransportMessage& reply) {
+    link->receiveReply(reply);
+}
+
+void ShmClientTransport::sendAsync(TransportMessage& message) {
+    link->sendAsync(message);
+}
+
+void ShmClientTransport::sendAsyncBatch(vector<TransportMessage>& messages) {
+    link->sendAsyncBatch(messages);
+}
+
+ShmServerTransport::ShmServerTransport(const string& path):
+    path(path),
+    link(nullptr),
+    woken(false)
+{}
+
+ShmServerTransport::~ShmServerTransport() {
+    delete link;
+}
+
+void ShmServerTransport::bind() {
+    link = new ShmLink(path, true);
+}
+
+void ShmServerTransport::close() {
+    delete link;
+    link = nullptr;
+}
+
+ServerTransport::PollEvent ShmServerTransport::poll(bool readAsync, bool readRequests) {
+    while (true) {
+        // Read before checking the rings, so messages arriving
+        // after the check make the wait return immediately
+        uint32_t seen = link->handlerBell().load();
+
+        if (woken.exchange(false)) return WAKE;
+        if (readRequests && link->hasRequest()) return REQUEST;
+        if (readAsync && link->hasAsync()) return ASYNC;
+
+        link->handlerBell().wait(seen);
+    }
+}
+
+void ShmServerTransport::receiveRequest(TransportMessage& request) {
+    link->tryReceiveRequest(request);
+}
+
+void ShmServerTransport::receiveAsync(TransportMessage& message) {
+    link->tryReceiveAsync(message);
+}
+
+void ShmServerTransport::sendReply(TransportMessage& reply) {
+    link->sendReply(reply);
+}
+
+void ShmServerTransport::wake(const string&) {
+    woken = true;
+    if (link != nullptr) link->handlerBell().ring();
+}
+#endif
+
+ClientTransport* makeClientTransport(TransportType type, zmq::context_t& zcontext,
+    const string& dataDir, const string& host, partId_t from, partId_t to, int numThreads,
+    HandlerMode handlerMode
+) {
+    if (type == TransportType::SHM) {
+        #ifndef USING_WIN
+        return new ShmClientTransport(getShmLinkName(dataDir, from, to));
+        #else
+        throw runtime_error("The shm transport is not supported on Windows");
+        #endif
+    }
+    if (handlerMode == HandlerMode::REACTOR) {
+        return new ZmqClientTransport(zcontext,
+            getReactorSocketName(dataDir, host, to, type),
+            getAsyncSocketName(dataDir, host, from, to, numThreads, type),
+            to_string(from)
+        );
+    }
+    return new ZmqClientTransport(zcontext,
+        getSocketName(dataDir, host, from, to, numThreads, type),
+        getAsyncSocketName(dataDir, host, from, to, numThreads, type)
+    );
+}
+
+ServerTransport* makeServerTransport(TransportType type, zmq::context_t& zcontext,
+    const string& dataDir, const string& host, partId_t from, partId_t to, int numThreads
+) {
+    if (type == TransportType::SHM) {
+        #ifndef USING_WIN
+        return new ShmServerTransport(getShmLinkName(dataDir, from, to));
+        #else
+        throw runtime_error("The shm transport is not supported on Windows");
+        #endif
+    }
+    stringstream controlUri;
+    controlUri << "inproc://nb" << from << "-" << to;
+    return new ZmqServerTransport(zcontext,
+        getSocketName(dataDir, host, from, to, numThreads, type),
+        getAsyncSocketName(dataDir, host, from, to, numThreads, type),
+        controlUri.str()
+    );
+}
+
+}
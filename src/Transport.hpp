@@ -0,0 +1,172 @@
+/**
+Transport.hpp
+
+Interface for the links between partitions, with the ZMQ socket (ipc, tcp,
+inproc) and shared memory implementations, chosen with --transport.
+
+Author: Filippo Lenzi
+*/
+
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <zmq.hpp>
+
+#include "psumoTypes.hpp"
+#include "ShmLink.hpp"
+#include "TransportMessage.hpp"
+
+namespace psumo {
+
+/**
+Stub side of a link: requests that need a reply, and async messages
+that do not (see PartitionEdgesStub). Messages on each of the two
+channels arrive in the order they were sent.
+*/
+class ClientTransport {
+public:
+    virtual ~ClientTransport() {}
+
+    virtual void connect() = 0;
+    virtual void disconnect() = 0;
+
+    virtual void sendRequest(TransportMessage& message) = 0;
+    // Blocks until the reply to the last request arrives
+    virtual void receiveReply(TransportMessage& reply) = 0;
+    virtual void sendAsync(TransportMessage& message) = 0;
+    // Same as calling sendAsync on each, but can wake the receiver only once
+    virtual void sendAsyncBatch(std::vector<TransportMessage>& messages);
+};
+
+/**
+Handler side of a link. Only used by the handler thread, except
+for wake that is called by other threads to interrupt poll.
+*/
+class ServerTransport {
+public:
+    enum PollEvent {
+        REQUEST,
+        ASYNC,
+        // Woken by wake(), to check if the thread should stop or resume reading async
+        WAKE,
+        INTERRUPTED,
+    };
+
+    virtual ~ServerTransport() {}
+
+    virtual void bind() = 0;
+    virtual void close() = 0;
+
+    // Wait until a request (only if readRequests), an async message (only
+    // if readAsync), or a wake() is available; messages not read are
+    // left in the queue
+    virtual PollEvent poll(bool readAsync, bool readRequests) = 0;
+    // Call after poll returned the corresponding event
+    virtual void receiveRequest(TransportMessage& request) = 0;
+    virtual void receiveAsync(TransportMessage& message) = 0;
+    virtual void sendReply(TransportMessage& reply) = 0;
+    virtual void wake(const std::string& reason) = 0;
+};
+
+/**
+REQ/REP socket for requests and PUSH/PULL socket for async messages. The
+handler is woken up through an inproc PAIR socket, polled with the others.
+With a sender id, the server side is a handler reactor shared by all the
+neighbors: requests carry it as routing id, while async messages still go
+to a socket of their own.
+*/
+class ZmqClientTransport : public ClientTransport {
+private:
+    const std::string socketUri;
+    const std::string asyncSocketUri;
+    const std::string senderId;
+    bool connected;
+    // Pointers to be 100% sure about memory clearing with ZMQ
+    zmq::socket_t* socket;
+    zmq::socket_t* asyncSocket;
+public:
+    ZmqClientTransport(zmq::context_t& zcontext, const std::string& socketUri, const std::string& asyncSocketUri,
+        const std::string& senderId = "");
+    ~ZmqClientTransport();
+
+    void connect() override;
+    void disconnect() override;
+    void sendRequest(TransportMessage& message) override;
+    void receiveReply(TransportMessage& reply) override;
+    void sendAsync(TransportMessage& message) override;
+};
+
+class ZmqServerTransport : public ServerTransport {
+private:
+    const std::string socketUri;
+    const std::string asyncSocketUri;
+    const std::string controlUri;
+    zmq::socket_t* socket;
+    zmq::socket_t* asyncSocket;
+    zmq::socket_t* controlSocketMain;
+    zmq::socket_t* controlSocketThread;
+public:
+    ZmqServerTransport(zmq::context_t& zcontext, const std::string& socketUri,
+        const std::string& asyncSocketUri, const std::string& controlUri);
+    ~ZmqServerTransport();
+
+    void bind() override;
+    void close() override;
+    PollEvent poll(bool readAsync, bool readRequests) override;
+    void receiveRequest(TransportMessage& request) override;
+    void receiveAsync(TransportMessage& message) override;
+    void sendReply(TransportMessage& reply) override;
+    void wake(const std::string& reason) override;
+};
+
+#ifndef USING_WIN
+/**
+Rings in a shared memory segment, see ShmLink.
+*/
+class ShmClientTransport : public ClientTransport {
+private:
+    const std::string path;
+    ShmLink* link;
+public:
+    ShmClientTransport(const std::string& path);
+    ~ShmClientTransport();
+
+    void connect() override;
+    void disconnect() override;
+    void sendRequest(TransportMessage& message) override;
+    void receiveReply(TransportMessage& reply) override;
+    void sendAsync(TransportMessage& message) override;
+    void sendAsyncBatch(std::vector<TransportMessage>& messages) override;
+};
+
+class ShmServerTransport : public ServerTransport {
+private:
+    const std::string path;
+    ShmLink* link;
+    std::atomic<bool> woken;
+public:
+    ShmServerTransport(const std::string& path);
+    ~ShmServerTransport();
+
+    void bind() override;
+    void close() override;
+    PollEvent poll(bool readAsync, bool readRequests) override;
+    void receiveRequest(TransportMessage& request) override;
+    void receiveAsync(TransportMessage& message) override;
+    void sendReply(TransportMessage& reply) override;
+    void wake(const std::string& reason) override;
+};
+#endif
+
+// Link from partition from to partition to, whose host is given for tcp;
+// the zmq context is not used by shm.
+// Server transports for the reactor handler mode are made by HandlerReactor
+ClientTransport* makeClientTransport(TransportType type, zmq::context_t& zcontext,
+    const std::string& dataDir, const std::string& host, partId_t from, partId_t to, int numThreads,
+    HandlerMode handlerMode = HandlerMode::THREAD);
+ServerTransport* makeServerTransport(TransportType type, zmq::context_t& zcontext,
+    const std::string& dataDir, const std::string& host, partId_t from, partId_t to, int numThreads);
+
+}
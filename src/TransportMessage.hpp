@@ -0,0 +1,41 @@
+/**
+TransportMessage.hpp
+
+Buffer of the messages exchanged between partitions, whatever transport
+carries them.
+
+Author: Filippo Lenzi
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <zmq.hpp>
+
+namespace psumo {
+
+/**
+Bytes of a message sent through a ClientTransport or ServerTransport. The
+storage is a ZMQ message, so the ZMQ transports send and receive it without
+copies, while the shm transport copies it in and out of its rings; users of
+the transports only see the bytes.
+*/
+class TransportMessage {
+private:
+    zmq::message_t storage;
+public:
+    TransportMessage() = default;
+    explicit TransportMessage(size_t size): storage(size) {}
+    TransportMessage(const void* data, size_t size): storage(data, size) {}
+
+    void* data() { return storage.data(); }
+    const void* data() const { return storage.data(); }
+    size_t size() const { return storage.size(); }
+    // Resize, discarding the content
+    void rebuild(size_t size) { storage.rebuild(size); }
+
+    // Only for the ZMQ transports
+    zmq::message_t& zmqMessage() { return storage; }
+};
+
+}
@@ -9,9 +9,21 @@ Author: Filippo Lenzi
 #pragma once
 
 #include "libs/argparse.hpp"
+#include <charconv>
 #include <cstdlib>
+#include <fstream>
+#include <set>
 #include <sstream>
 
+#include "messagingShared.hpp"
+#include "psumoTypes.hpp"
+
+#ifdef USING_WIN
+#define DEFAULT_TRANSPORT "tcp"
+#else
+#define DEFAULT_TRANSPORT "ipc"
+#endif
+
 class Args {
 protected:
     bool printOnParse = true;
@@ -68,6 +80,40 @@ public:
         program.add_argument("--data-dir")
             .help("Data directory to store working files in")
             .default_value("data");
+        program.add_argument("--transport")
+            .help("How partitions exchange messages: 'ipc' (ZMQ unix sockets), 'tcp' (ZMQ TCP sockets, for partitions on multiple hosts) or 'shm' (shared memory ring buffers, only when all partitions are on the same host). Run ParallelTwin-Bench to compare them.")
+            .default_value(DEFAULT_TRANSPORT);
+        program.add_argument("--hosts")
+            .help("Tcp transport: file with the host of each partition and of the coordinator, one '<partition number or coordinator> <host>' per line ('#' for comments); sockets are bound on all interfaces and neighbors connect to the listed host. Unlisted ones are on this host")
+            .default_value("");
+        program.add_argument("--sync")
+            .help("How partitions synchronize at each step: 'global' (barrier with all partitions through the coordinator) or 'neighbor' (each partition only waits for its neighbors to finish the step), 'lookahead' (as neighbor, but neighbors only synchronize every few steps, as long as vehicles take to cross the border edges between them) or 'optimistic' (partitions never wait, and roll back to a saved state when a vehicle arrives late)")
+            .default_value("global");
+        program.add_argument("--sync-interval")
+            .help("Steps partitions run between synchronizations, with vehicles handed off in between added at the sync step; safe as long as vehicles can not cross a border edge in that time (partitions warn otherwise, the partitioning prints the safe window). 0 for the sync mode's default: every step, or as long as the lookahead allows with 'lookahead'. Not used by optimistic sync")
+            .default_value(0)
+            .scan<'i', int>();
+        program.add_argument("--handlers")
+            .help("How each partition serves its neighbors: 'thread' (a thread and sockets for each neighbor) or 'reactor' (a single thread and request socket for all neighbors, fewer context switches with many neighbors; ipc and tcp transports only)")
+            .default_value("thread");
+        program.add_argument("--barrier")
+            .help("Global sync mode: how partitions wait for each other at each step: 'central' (through the coordinator), 'tree' (combining tree between the partitions) or 'dissemination' (log2(N) rounds of messages between the partitions), the last two scale better with many partitions; or 'shm' (counter in shared memory, only when all partitions are on the same host). Run ParallelTwin-Bench to compare them")
+            .default_value("central");
+        program.add_argument("--barrier-spin")
+            .help("Shm barrier: microseconds to spin waiting for the other partitions before sleeping; higher values lower the latency with short steps, at the cost of CPU time")
+            .default_value(50)
+            .scan<'i', int>();
+        program.add_argument("--checkpoint-interval")
+            .help("Optimistic sync mode: steps between saved states to roll back to")
+            .default_value(10)
+            .scan<'i', int>();
+        program.add_argument("--max-queued-ops")
+            .help("Operations received from each neighbor (vehicles, speeds) that can wait to be applied; when reached, the neighbor's messages are left in the transport until some are applied")
+            .default_value(65536)
+            .scan<'i', int>();
+        program.add_argument("--trace")
+            .help("Record when each partition and thread steps, sends and handles messages and waits at barriers, and write it to this file as a Chrome trace (open with Perfetto or chrome://tracing)")
+            .default_value("");
         program.add_argument("-v", "--verbose")
             .help("Extra output")
             .default_value(false)
@@ -98,6 +144,16 @@ public:
         logHandledVehicles = program.get<bool>("--pin-to-cpu");
         logMsgNum = program.get<bool>("--log-msg-num");
         dataDir = program.get<std::string>("--data-dir");
+        transport = program.get<std::string>("--transport");
+        hostsFile = program.get<std::string>("--hosts");
+        sync = program.get<std::string>("--sync");
+        syncInterval = program.get<int>("--sync-interval");
+        handlers = program.get<std::string>("--handlers");
+        barrier = program.get<std::string>("--barrier");
+        barrierSpin = program.get<int>("--barrier-spin");
+        checkpointInterval = program.get<int>("--checkpoint-interval");
+        maxQueuedOps = program.get<int>("--max-queued-ops");
+        trace = program.get<std::string>("--trace");
         verbose = program.get<bool>("--verbose");
 
         std::stringstream msg;
@@ -111,17 +167,177 @@ public:
             std::cerr << msg.str();
             exit(EXIT_FAILURE);
         }
+        if (transport == "ipc") {
+            transportType = psumo::TransportType::IPC;
+        } else if (transport == "tcp") {
+            transportType = psumo::TransportType::TCP;
+        } else if (transport == "shm") {
+            transportType = psumo::TransportType::SHM;
+        } else {
+            msg << "Error: unknown transport " << transport << ", must be ipc, tcp or shm" << std::endl;
+            std::cerr << msg.str();
+            exit(EXIT_FAILURE);
+        }
+        if (transportType == psumo::TransportType::TCP && numThreads > psumo::getMaxTcpPartitions()) {
+            msg << "Error: the tcp transport supports up to " << psumo::getMaxTcpPartitions()
+                << " partitions, not enough ports for " << numThreads << std::endl;
+            std::cerr << msg.str();
+            exit(EXIT_FAILURE);
+        }
+        if (!hostsFile.empty()) {
+            if (transportType != psumo::TransportType::TCP) {
+                msg << "Error: the hosts file needs the tcp transport" << std::endl;
+                std::cerr << msg.str();
+                exit(EXIT_FAILURE);
+            }
+            readHostsFile();
+        }
+        if (sync == "global") {
+            syncMode = psumo::SyncMode::GLOBAL;
+        } else if (sync == "neighbor") {
+            syncMode = psumo::SyncMode::NEIGHBOR;
+        } else if (sync == "lookahead") {
+            syncMode = psumo::SyncMode::LOOKAHEAD;
+        } else if (sync == "optimistic") {
+            syncMode = psumo::SyncMode::OPTIMISTIC;
+        } else {
+            msg << "Error: unknown sync mode " << sync << ", must be global, neighbor, lookahead or optimistic" << std::endl;
+            std::cerr << msg.str();
+            exit(EXIT_FAILURE);
+        }
+        if (syncInterval < 0) {
+            msg << "Error: wrong sync interval, must be 0 or more steps, is " << syncInterval << std::endl;
+            std::cerr << msg.str();
+            exit(EXIT_FAILURE);
+        }
+        if (syncInterval > 0 && syncMode == psumo::SyncMode::OPTIMISTIC) {
+            msg << "Error: the sync interval can not be used with optimistic sync, which never waits" << std::endl;
+            std::cerr << msg.str();
+            exit(EXIT_FAILURE);
+        }
+        if (handlers == "thread") {
+            handlerMode = psumo::HandlerMode::THREAD;
+        } else if (handlers == "reactor") {
+            handlerMode = psumo::HandlerMode::REACTOR;
+        } else {
+            msg << "Error: unknown handler mode " << handlers << ", must be thread or reactor" << std::endl;
+            std::cerr << msg.str();
+            exit(EXIT_FAILURE);
+        }
+        if (handlerMode == psumo::HandlerMode::REACTOR && transportType == psumo::TransportType::SHM) {
+            msg << "Error: the reactor handler mode needs a zmq transport (ipc or tcp)" << std::endl;
+            std::cerr << msg.str();
+            exit(EXIT_FAILURE);
+        }
+        if (barrier == "central") {
+            barrierType = psumo::BarrierType::CENTRAL;
+        } else if (barrier == "tree") {
+            barrierType = psumo::BarrierType::TREE;
+        } else if (barrier == "dissemination") {
+            barrierType = psumo::BarrierType::DISSEMINATION;
+        } else if (barrier == "shm") {
+            barrierType = psumo::BarrierType::SHM;
+        } else {
+            msg << "Error: unknown barrier " << barrier << ", must be central, tree, dissemination or shm" << std::endl;
+            std::cerr << msg.str();
+            exit(EXIT_FAILURE);
+        }
+        if (barrierSpin < 0) {
+            msg << "Error: wrong barrier spin, must be 0 or more microseconds, is " << barrierSpin << std::endl;
+            std::cerr << msg.str();
+            exit(EXIT_FAILURE);
+        }
+        if ((program.is_used("--barrier") || program.is_used("--barrier-spin")) && syncMode != psumo::SyncMode::GLOBAL) {
+            msg << "Error: --barrier and --barrier-spin are only used by global sync, sync mode is " << sync << std::endl;
+            std::cerr << msg.str();
+            exit(EXIT_FAILURE);
+        }
+        if (barrierType == psumo::BarrierType::SHM && hostCount() > 1) {
+            msg << "Error: the shm barrier needs all partitions on the same host, the hosts file lists " << hostCount() << std::endl;
+            std::cerr << msg.str();
+            exit(EXIT_FAILURE);
+        }
+        if (checkpointInterval <= 0) {
+            msg << "Error: wrong checkpoint interval, must be positive number, is " << checkpointInterval << std::endl;
+            std::cerr << msg.str();
+            exit(EXIT_FAILURE);
+        }
+        if (maxQueuedOps <= 0) {
+            msg << "Error: wrong max queued operations, must be positive number, is " << maxQueuedOps << std::endl;
+            std::cerr << msg.str();
+            exit(EXIT_FAILURE);
+        }
+        #ifdef USING_WIN
+        if (transportType != psumo::TransportType::TCP) {
+            msg << "Error: only the tcp transport is supported on Windows" << std::endl;
+            std::cerr << msg.str();
+            exit(EXIT_FAILURE);
+        }
+        if (barrierType == psumo::BarrierType::SHM) {
+            msg << "Error: the shm barrier is not supported on Windows" << std::endl;
+            std::cerr << msg.str();
+            exit(EXIT_FAILURE);
+        }
+        #endif
 
         if (printOnParse) {
             std::cout << "cfg=" << cfg << ", numThreads=" << numThreads 
                 << ", partitioningThreads=" << partitioningThreads
                 << ", gui=" << gui << ", skipPart=" << skipPart
                 << ", keepPoly=" << keepPoly << ", dataDir=" << dataDir
+                << ", transport=" << transport << ", sync=" << sync
+                << ", syncInterval=" << syncInterval
+                << ", handlers=" << handlers << ", barrier=" << barrier
                 << ", verbose=" << verbose
                 << std::endl;
         }
     }
 
+    void readHostsFile() {
+        std::ifstream in(hostsFile);
+        if (!in) {
+            std::cerr << "Error: can not open hosts file " << hostsFile << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        std::string line;
+        int lineNumber = 0;
+        while (std::getline(in, line)) {
+            lineNumber++;
+            line = line.substr(0, line.find('#'));
+            std::istringstream fields(line);
+            std::string process, host, extra;
+            if (!(fields >> process)) continue;
+            if (!(fields >> host) || (fields >> extra)) {
+                std::cerr << "Error: line " << lineNumber << " of hosts file " << hostsFile
+                    << " must be '<partition number or coordinator> <host>'" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            if (process == "coordinator") {
+                coordinatorHost = host;
+                continue;
+            }
+            int partId = -1;
+            auto [end, err] = std::from_chars(process.data(), process.data() + process.size(), partId);
+            if (err != std::errc() || end != process.data() + process.size() || partId < 0) {
+                std::cerr << "Error: wrong partition number " << process << " at line " << lineNumber
+                    << " of hosts file " << hostsFile << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            if (partId >= (int) partitionHosts.size()) partitionHosts.resize(partId + 1);
+            partitionHosts[partId] = host;
+        }
+    }
+
+    // Different hosts the partitions run on, unlisted ones are on this host
+    int hostCount() {
+        std::set<std::string> hosts;
+        for (int partId = 0; partId < numThreads; partId++) {
+            bool listed = partId < (int) partitionHosts.size() && !partitionHosts[partId].empty();
+            hosts.insert(listed ? partitionHosts[partId] : "127.0.0.1");
+        }
+        return hosts.size();
+    }
+
     std::vector<std::string>& getArgVector() {
         return argv_;
     }
@@ -137,6 +353,23 @@ public:
     bool logHandledVehicles;
     bool logMsgNum;
     std::string dataDir;
+    std::string transport;
+    psumo::TransportType transportType;
+    std::string hostsFile;
+    // By partition id, empty for partitions on this host (see getPartitionHost)
+    std::vector<std::string> partitionHosts;
+    std::string coordinatorHost = "127.0.0.1";
+    std::string sync;
+    psumo::SyncMode syncMode;
+    int syncInterval;
+    std::string handlers;
+    psumo::HandlerMode handlerMode;
+    std::string barrier;
+    psumo::BarrierType barrierType;
+    int barrierSpin;
+    int checkpointInterval;
+    int maxQueuedOps;
+    std::string trace;
     bool verbose;
     std::vector<std::string> sumoArgs;
     std::vector<std::string> partitioningArgs;
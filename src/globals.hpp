@@ -5,6 +5,7 @@
 #define PROGRAM_NAME "ParallelTwin"
 #define PROGRAM_NAME_PART "ParallelTwin-Partition"
 #define PROGRAM_NAME_PART_GUI "ParallelTwin-Partition-Gui"
+#define PROGRAM_NAME_BENCH "ParallelTwin-Bench"
 #define PROGRAM_VER "0.7"
 
 const std::string OUTDIR("output");
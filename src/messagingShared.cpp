@@ -15,41 +15,124 @@ Author: Filippo Lenzi
 
 using namespace std;
 
-// #ifdef USING_WIN
-  // #define Z_USES_TCP
-// #endif
-
 #define SYNC_SOCKETS_START 4500
+// Async sockets start right after the request ones, see getPartAsyncSocketsStart
 #define PART_SOCKETS_START 5400
+#define REACTOR_SOCKETS_START 45400
+#define BARRIER_SOCKETS_START 47400
 
 namespace psumo {
 
 
+const string LOCAL_HOST("127.0.0.1");
+
+const string& getPartitionHost(const vector<string>& hosts, partId_t partId) {
+    if (partId < 0 || partId >= (partId_t) hosts.size() || hosts[partId].empty()) return LOCAL_HOST;
+    return hosts[partId];
+}
+
+string getBindAddress(const string& uri) {
+    // Names carry the host to connect to, which might not be the name of
+    // an interface: bind on all of them, unless all partitions are local
+    if (uri.rfind("tcp://", 0) != 0 || uri.rfind("tcp://" + LOCAL_HOST + ":", 0) == 0) return uri;
+    return "tcp://*" + uri.substr(uri.rfind(':'));
+}
+
 int cantorPairing(int a, int b, int n) {
   // Unique number from pairs of different ints
   return (a + b) * (a + b + 1) / 2 + b;
 }
 
-string getSocketName(std::string dataFolder, partId_t from, partId_t to, int numThreads) {
+// Highest port offset of a link between two partitions
+static int maxCantorPairing(int numThreads) {
+    if (numThreads < 2) return 0;
+    return cantorPairing(numThreads - 2, numThreads - 1, numThreads);
+}
+
+static int getPartAsyncSocketsStart(int numThreads) {
+    return PART_SOCKETS_START + maxCantorPairing(numThreads) + 1;
+}
+
+int getMaxTcpPartitions() {
+    int numThreads = 2;
+    while (getPartAsyncSocketsStart(numThreads + 1) + maxCantorPairing(numThreads + 1) < REACTOR_SOCKETS_START) {
+        numThreads++;
+    }
+    return numThreads;
+}
+
+string getSocketName(std::string dataFolder, const std::string& host, partId_t from, partId_t to, int numThreads, TransportType transport) {
     stringstream out;
-    #ifndef Z_USES_TCP
-        out << "ipc://" << dataFolder << "/sockets/" << from << "-" << to;
-    #else
+    if (transport == TransportType::TCP) {
         int port = PART_SOCKETS_START + cantorPairing(from, to, numThreads);
-        out << "tcp://127.0.0.1:" <<  port;
-    #endif
+        out << "tcp://" << host << ":" <<  port;
+    } else if (transport == TransportType::INPROC) {
+        out << "inproc://" << from << "-" << to;
+    } else {
+        out << "ipc://" << dataFolder << "/sockets/" << from << "-" << to;
+    }
+
+    return out.str();
+}
+
+string getAsyncSocketName(std::string dataFolder, const std::string& host, partId_t from, partId_t to, int numThreads, TransportType transport) {
+    stringstream out;
+    if (transport == TransportType::TCP) {
+        int port = getPartAsyncSocketsStart(numThreads) + cantorPairing(from, to, numThreads);
+        out << "tcp://" << host << ":" <<  port;
+    } else if (transport == TransportType::INPROC) {
+        out << "inproc://" << from << "-" << to << "-a";
+    } else {
+        out << "ipc://" << dataFolder << "/sockets/" << from << "-" << to << "-a";
+    }
+
+    return out.str();
+}
+
+string getReactorSocketName(std::string dataFolder, const std::string& host, partId_t partId, TransportType transport) {
+    stringstream out;
+    if (transport == TransportType::TCP) {
+        out << "tcp://" << host << ":" << REACTOR_SOCKETS_START + partId;
+    } else if (transport == TransportType::INPROC) {
+        out << "inproc://" << partId << "-r";
+    } else {
+        out << "ipc://" << dataFolder << "/sockets/" << partId << "-r";
+    }
+
+    return out.str();
+}
+
+string getBarrierSocketName(std::string dataFolder, const std::string& host, partId_t partId, TransportType transport) {
+    stringstream out;
+    if (transport == TransportType::TCP) {
+        out << "tcp://" << host << ":" << BARRIER_SOCKETS_START + partId;
+    } else if (transport == TransportType::INPROC) {
+        out << "inproc://" << partId << "-b";
+    } else {
+        out << "ipc://" << dataFolder << "/sockets/" << partId << "-b";
+    }
 
     return out.str();
 }
 
-string getSyncSocketId(std::string dataFolder, partId_t partId) {
+string getShmLinkName(std::string dataFolder, partId_t from, partId_t to) {
+    stringstream out;
+    out << dataFolder << "/sockets/" << from << "-" << to << ".shm";
+    return out.str();
+}
+
+string getShmBarrierName(std::string dataFolder) {
+    return dataFolder + "/sockets/barrier.shm";
+}
+
+string getSyncSocketId(std::string dataFolder, const std::string& host, partId_t partId, TransportType transport) {
   std::stringstream out;
-    #ifndef Z_USES_TCP
-    out << "ipc://" << dataFolder << "/sockets/" << partId << "-main-s";
-  #else
+  if (transport == TransportType::TCP) {
     int port = SYNC_SOCKETS_START + partId;
-    out << "tcp://127.0.0.1:" <<  port;
-  #endif
+    out << "tcp://" << host << ":" <<  port;
+  } else {
+    out << "ipc://" << dataFolder << "/sockets/" << partId << "-main-s";
+  }
 
   return out.str();
 }
@@ -61,51 +144,39 @@ zmq::socket_t* makeSocket(zmq::context_t& context_, zmq::socket_type type_)  {
     return socket;
 }
 
-zmq::message_t createMessageWithStrings(vector<string> &strings, int offset, int spaceAfter) {
-    int totalSize = 0;
-    for (auto str: strings) totalSize += str.size();
+TransportMessage createMessageWithStrings(const vector<string> &strings, int offset, int spaceAfter) {
+    size_t totalSize = 0;
+    for (auto& str: strings) totalSize += messageStringSize(str);
 
-    // + vector.size(): account for null characters at end of each string
-    zmq::message_t message(offset + spaceAfter + sizeof(int) + totalSize + strings.size());
-    char* data = static_cast<char*>(message.data());
+    TransportMessage message(offset + spaceAfter + sizeof(int) + totalSize);
 
     // Also write an int with the vector size
-    int vectorSize = strings.size();
-    std::memcpy(data + offset, &vectorSize, sizeof(int));
-
-    int writtenBytes = sizeof(int);
-    for (int i = 0; i < strings.size(); i++) {
-        std::memcpy(
-            data + offset + writtenBytes, 
-            (strings[i] + '\0').data(), strings[i].size() + 1
-        );
-        writtenBytes += strings[i].size() + 1;
+    MessageWriter writer(message, offset);
+    writer.write<int>(strings.size());
+    for (auto& str: strings) {
+        writer.writeString(str);
     }
 
     return message;
 }
 
-std::vector<std::string> readStringsFromMessage(zmq::message_t &message, int offset) {
-    const char* data = static_cast<const char*>(message.data());
-    size_t size = message.size();
-
-    int vectorSize;
-    std::memcpy(&vectorSize, data + offset, sizeof(int));
-
-    std::vector<std::string> result(vectorSize);
-    int currentString = 0;
+std::vector<std::string_view> readStringViewsFromMessage(const TransportMessage &message, int offset) {
+    MessageReader reader(message, offset);
+    int vectorSize = reader.read<int>();
 
-    size_t start = offset + sizeof(int);
-    for (size_t i = start; i < size && currentString < vectorSize; ++i) {
-        if (data[i] == '\0') {
-            result[currentString] = string(&data[start], &data[i]);
-            start = i + 1;
-            currentString++;
-        }
+    std::vector<std::string_view> result;
+    result.reserve(vectorSize);
+    for (int i = 0; i < vectorSize && reader.position() < message.size(); i++) {
+        result.push_back(reader.readString());
     }
 
     return result;
 }
 
+std::vector<std::string> readStringsFromMessage(const TransportMessage &message, int offset) {
+    auto views = readStringViewsFromMessage(message, offset);
+    return std::vector<std::string>(views.begin(), views.end());
+}
+
 
 }
\ No newline at end of file
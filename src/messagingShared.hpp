@@ -8,22 +8,123 @@ Author: Filippo Lenzi
 
 #pragma once
 
+#include <cstring>
 #include <string>
+#include <string_view>
+#include <vector>
+#include <zmq.hpp>
 
 #include "psumoTypes.hpp"
+#include "TransportMessage.hpp"
 #include "utils.hpp"
 
 // #define SOCK_COUNTS
 
 namespace psumo {
 
-std::string getSocketName(std::string directory, partId_t from, partId_t to, int numThreads);
-std::string getSyncSocketId(std::string dataFolder, partId_t partId);
+// Host of a partition with the tcp transport, from the hosts file (see
+// Args::partitionHosts), or this host if it is not listed
+extern const std::string LOCAL_HOST;
+const std::string& getPartitionHost(const std::vector<std::string>& hosts, partId_t partId);
+
+// Socket names take the host of the process that binds the socket, only used
+// with the tcp transport
+std::string getSocketName(std::string directory, const std::string& host, partId_t from, partId_t to, int numThreads, TransportType transport);
+// Socket for operations that do not need a reply, see PartitionEdgesStub
+std::string getAsyncSocketName(std::string directory, const std::string& host, partId_t from, partId_t to, int numThreads, TransportType transport);
+// Request socket of the handler reactor of a partition, shared by all its
+// neighbors; their async messages use the same sockets as in thread mode
+std::string getReactorSocketName(std::string directory, const std::string& host, partId_t partId, TransportType transport);
+// Socket each partition receives the messages of the step barrier on, see PeerBarrier;
+// ipc with the shm transport
+std::string getBarrierSocketName(std::string directory, const std::string& host, partId_t partId, TransportType transport);
+// Partitions the tcp transport has ports for, before the link ports run
+// into the reactor ones
+int getMaxTcpPartitions();
+// Coordinator sockets are always ZMQ, tcp with the tcp transport and ipc otherwise
+std::string getSyncSocketId(std::string dataFolder, const std::string& host, partId_t partId, TransportType transport);
+// File of the shared memory segment used instead of the two sockets above with the shm transport
+std::string getShmLinkName(std::string directory, partId_t from, partId_t to);
+// File of the shared memory step barrier, see ShmBarrier
+std::string getShmBarrierName(std::string directory);
 
 zmq::socket_t* makeSocket(zmq::context_t&context_, zmq::socket_type  type_);
+// Address to bind a socket name on: tcp ones of a listed host on all interfaces
+std::string getBindAddress(const std::string& uri);
 inline void* castPollSocket(zmq::socket_t& socket) { return socket.operator void*(); }
-zmq::message_t createMessageWithStrings(std::vector<std::string>& strings, int offset = 0, int spaceAfter = 0);
-std::vector<std::string> readStringsFromMessage(zmq::message_t& message, int offset = 0);
+TransportMessage createMessageWithStrings(const std::vector<std::string>& strings, int offset = 0, int spaceAfter = 0);
+std::vector<std::string> readStringsFromMessage(const TransportMessage& message, int offset = 0);
+// Views are valid as long as the message is alive and not moved, careful as
+// small messages store the data inside the message_t object itself
+std::vector<std::string_view> readStringViewsFromMessage(const TransportMessage& message, int offset = 0);
+
+// Size a string takes in a message, including the NULL terminator
+inline size_t messageStringSize(std::string_view str) { return str.size() + 1; }
+
+/**
+Write values in order directly into a message, which must have been created
+with the full size beforehand.
+*/
+class MessageWriter {
+private:
+    char* data;
+    size_t pos;
+public:
+    MessageWriter(zmq::message_t& message, size_t offset = 0):
+        data(static_cast<char*>(message.data())), pos(offset) {}
+    MessageWriter(TransportMessage& message, size_t offset = 0):
+        data(static_cast<char*>(message.data())), pos(offset) {}
+
+    template<typename T> void write(const T& value) {
+        std::memcpy(data + pos, &value, sizeof(T));
+        pos += sizeof(T);
+    }
+    void writeBytes(const void* src, size_t size) {
+        std::memcpy(data + pos, src, size);
+        pos += size;
+    }
+    // NULL terminated, like in createMessageWithStrings
+    void writeString(std::string_view str) {
+        std::memcpy(data + pos, str.data(), str.size());
+        data[pos + str.size()] = '\0';
+        pos += str.size() + 1;
+    }
+    size_t position() const { return pos; }
+};
+
+/**
+Read values in order from a message, strings as views into the message.
+*/
+class MessageReader {
+private:
+    const char* data;
+    size_t size;
+    size_t pos;
+public:
+    MessageReader(const zmq::message_t& message, size_t offset = 0):
+        data(static_cast<const char*>(message.data())), size(message.size()), pos(offset) {}
+    MessageReader(const TransportMessage& message, size_t offset = 0):
+        data(static_cast<const char*>(message.data())), size(message.size()), pos(offset) {}
+
+    template<typename T> T read() {
+        T value;
+        std::memcpy(&value, data + pos, sizeof(T));
+        pos += sizeof(T);
+        return value;
+    }
+    void readBytes(void* dst, size_t size) {
+        std::memcpy(dst, data + pos, size);
+        pos += size;
+    }
+    std::string_view readString() {
+        const char* start = data + pos;
+        const char* end = static_cast<const char*>(std::memchr(start, '\0', size - pos));
+        size_t length = end != nullptr ? end - start : size - pos;
+        pos += length + 1;
+        return std::string_view(start, length);
+    }
+    size_t position() const { return pos; }
+};
 
 
 // Some inline wrappers for zmq used in debug to check for socket connections
@@ -42,7 +143,7 @@ inline void connect(zmq::socket_t& socket, const std::string addr) {
     #endif
 }
 inline void bind(zmq::socket_t& socket, const std::string addr) {
-    socket.bind(addr);
+    socket.bind(getBindAddress(addr));
     #ifdef SOCK_COUNTS
         // printStackTrace();
         socketCounts++;
@@ -27,13 +27,15 @@ Contributions: Filippo Lenzi
 #include "ContextPool.hpp"
 #include "utils.hpp"
 #include "psumoTypes.hpp"
+#include "PartitionData.hpp"
 #include "PartitionManager.hpp"
+#include "Tracer.hpp"
 #include "utils.hpp"
 
 using namespace std;
 using namespace psumo;
 
-void loadPartData(int id, string dataFolder, vector<border_edge_t>& borderEdges, vector<partId_t>&, unordered_map<partId_t, unordered_set<string>>&, unordered_map<string, unordered_set<string>>&, float*);
+vector<string> loadIdTable(string dataFolder);
 
 int main(int argc, char* argv[]) {
     #ifdef HAVE_LIBSUMOGUI
@@ -58,6 +60,11 @@ int main(int argc, char* argv[]) {
     }
 
     ContextPool::verbose = args.verbose;
+    if (!args.trace.empty()) {
+        // After the coordinator's track
+        Tracer::enable(args.partId + 1, "Partition " + to_string(args.partId));
+        Tracer::nameThread("main");
+    }
 
     filesystem::path dataDir(args.dataDir);
     filesystem::create_directories(dataDir / "sockets");
@@ -66,37 +73,35 @@ int main(int argc, char* argv[]) {
     partFile << "part" << args.partId << ".sumocfg";
     string cfg = dataDir / partFile.str();
 
-    vector<border_edge_t> borderEdges;
-    vector<partId_t> partNeighbors;
-    unordered_map<partId_t, unordered_set<string>> partNeighborRoutes;
-    unordered_map<string, unordered_set<string>> routesEndingInEdge;
-    float lastDepartTime;
+    // Kept alive for the whole run, the partition manager reads it in place
+    PartitionData partData(args.dataDir, args.partId);
 
-    loadPartData(args.partId, 
-        args.dataDir, borderEdges, partNeighbors, 
-        partNeighborRoutes, routesEndingInEdge, 
-        &lastDepartTime
-    );
+    IdTable idTable(loadIdTable(args.dataDir));
 
     zmq::context_t& zctx = ContextPool::newContext(1);
 
     PartitionManager partManager(
         getSumoPath(args.gui), args.partId, cfg, args.endTime,
-        partNeighbors, partNeighborRoutes, 
-        routesEndingInEdge, lastDepartTime,
-        zctx, args.numThreads,
+        partData.getNeighbors(), partData,
+        partData.getLastDepartTime(),
+        idTable, zctx, args.numThreads,
         args.sumoArgs, args 
     );
-    partManager.setBorderEdges(borderEdges);
+    partManager.setBorderEdges(partData.getBorderEdges());
+    partManager.setNeighborLookaheads(partData.getNeighborLookaheads());
     partManager.loadRouteMetadata();
     partManager.enableTimeMeasures();
 
     try {
         partManager.startPartitionLocalProcess();
+        // Handler threads are stopped by now, merged by the coordinator;
+        // after an error they might still be running, so it is not written
+        Tracer::writePart(getTracePartFile(args.dataDir, args.partId));
     } catch (exception& e) {
         stringstream msg;
         msg << endl << "[ERR] Partition " << args.partId << " terminating because of an error: "
             << e.what() << endl;
+        cerr << msg.str();
     }
 
     // Deleting context blocks forever
@@ -110,44 +115,31 @@ int main(int argc, char* argv[]) {
     return 0;
 }
 
-void loadPartData(
-    int id, string dataFolder, 
-    vector<border_edge_t>& borderEdges, 
-    vector<partId_t>& partNeighbors,
-    unordered_map<partId_t, unordered_set<string>>& partNeighborRoutes,
-    unordered_map<string, unordered_set<string>>& routesEndingInEdge,
-    float* lastDepartTime
-) {
-    const auto dataFile = getPartitionDataFile(dataFolder, id);
-    
-    ifstream input(dataFile);
+vector<string> loadIdTable(string dataFolder) {
+    const auto tableFile = filesystem::path(dataFolder) / "idTable.json";
+
+    // Older partition data doesn't have it, all ids will be sent as strings
+    // the first time then
+    ifstream input(tableFile);
     if (!input) {
-        std::cerr << "Failed to open the data file: " << dataFile << std::endl;
-        exit(-2);
+        std::cerr << "No id table in data folder, will send all ids on first use: " << tableFile << std::endl;
+        return {};
     }
 
     nlohmann::json data;
     try {
         input >> data;
     } catch(const exception& e) {
-        std::cerr << "Failed to parse data file JSON: " << e.what() << std::endl;
+        std::cerr << "Failed to parse id table JSON: " << e.what() << std::endl;
         exit(-3);
     }
     input.close();
 
-    borderEdges = data["borderEdges"].template get<vector<border_edge_t>>();
-    partNeighbors = data["neighbors"].template get<vector<partId_t>>();
-
-    map<string, vector<string>> partNeighborLists = data["neighborRoutes"].template get<map<string, vector<string>>>();
-    for (auto pair : partNeighborLists) {
-        auto neighIdString = pair.first;
-        auto routesVector = pair.second;
-        
-        partId_t neighId = stoi(neighIdString);
-        unordered_set<string> neighRoutes(routesVector.begin(), routesVector.end());
-        partNeighborRoutes[neighId] = neighRoutes;
+    // Same order in every partition
+    vector<string> ids;
+    for (auto key : { "routes", "vehicleTypes", "lanes", "edges" }) {
+        auto keyIds = data[key].template get<vector<string>>();
+        ids.insert(ids.end(), keyIds.begin(), keyIds.end());
     }
-
-    routesEndingInEdge = data["borderRouteEnds"].template get<unordered_map<string, unordered_set<string>>>();
-    *lastDepartTime = data["lastDepart"].template get<float>();
-}
\ No newline at end of file
+    return ids;
+}
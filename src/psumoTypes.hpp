@@ -6,13 +6,72 @@ Header-only, some shared types in the program.
 
 #pragma once
 
+#include <functional>
 #include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #include <nlohmann/json.hpp>
 
 namespace psumo {
     typedef int partId_t;
 
+    // Allows looking up string sets/maps with string_views without
+    // creating a string
+    struct StringHash {
+        using is_transparent = void;
+        size_t operator()(std::string_view str) const { return std::hash<std::string_view>{}(str); }
+    };
+    typedef std::unordered_set<std::string, StringHash, std::equal_to<>> string_set;
+    template<typename T> using string_map = std::unordered_map<std::string, T, StringHash, std::equal_to<>>;
+
+    // How messages are exchanged between processes, see Transport.hpp
+    enum class TransportType {
+        IPC,
+        TCP,
+        SHM,
+        // Same process only, for the benchmarks
+        INPROC,
+    };
+
+    // How partitions wait for each other at the end of each step
+    enum class SyncMode {
+        // All partitions wait for each other through the coordinator
+        GLOBAL,
+        // Partitions only wait for the step fences of their neighbors, the
+        // coordinator is only told each partition's status to detect the end
+        NEIGHBOR,
+        // As NEIGHBOR, but each pair of neighbors only exchanges messages every
+        // few steps, as long as no vehicle can cross a border edge between them
+        LOOKAHEAD,
+        // Partitions do not wait at all, and roll back to a saved state when
+        // a vehicle arrives for a step they already simulated (see TimeWarp)
+        OPTIMISTIC,
+    };
+
+    // How a partition serves the messages of its neighbors
+    enum class HandlerMode {
+        // One thread and set of sockets for each neighbor
+        THREAD,
+        // One thread for all neighbors, with a single socket for the requests
+        // (see HandlerReactor)
+        REACTOR,
+    };
+
+    // How partitions wait for each other at the end of each step in
+    // global sync mode, see StepBarrier
+    enum class BarrierType {
+        // Through the coordinator
+        CENTRAL,
+        // Combining tree between the partitions
+        TREE,
+        // Dissemination barrier between the partitions
+        DISSEMINATION,
+        // Counter in shared memory, partitions on the same host only
+        SHM,
+    };
+
     typedef struct border_edge_t {
         std::string id;
         std::vector<std::string> lanes;
@@ -21,4 +80,42 @@ namespace psumo {
     } border_edge_t;
 
     NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(border_edge_t, id, lanes, from, to)
+
+    // Operations queued by the neighbor handlers, and buffered by the stubs
+    // when sent in batches
+
+    // Strings are views into either the received message or the id
+    // dictionary of the handler, kept alive until the operations are applied
+    typedef struct {
+        std::string_view vehId;
+        double speed;
+    } set_veh_speed_t;
+
+    typedef struct {
+        std::string_view vehId;
+        std::string_view routeId; 
+        std::string_view vehType;
+        std::string_view laneId;
+        int laneIndex;
+        double lanePos;
+        double speed;
+        // Simulation time of the step the sender added it at
+        double time;
+    } add_veh_view_t;
+
+    // Sent vehicle the sender rolled back, see TimeWarp
+    typedef struct {
+        std::string_view vehId;
+        double time;
+    } cancel_veh_t;
+
+    typedef struct {
+        std::string vehId;
+        std::string routeId; 
+        std::string vehType;
+        std::string laneId;
+        int laneIndex;
+        double lanePos;
+        double speed;
+    } add_veh_t;
 }
@@ -0,0 +1,379 @@
+/**
+transportBench.cpp
+
+Measure the round trip and barrier latency of each transport (see Transport.hpp),
+to choose the fastest one for a deployment, and the latency of each step barrier
+(see StepBarrier.hpp) with different partition counts. Partitions are simulated
+with threads in the same process, so the inproc transport can be measured too.
+
+Author: Filippo Lenzi
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <format>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <zmq.hpp>
+
+#include "libs/argparse.hpp"
+#include "globals.hpp"
+#include "messagingShared.hpp"
+#include "psumoTypes.hpp"
+#include "StepBarrier.hpp"
+#include "Transport.hpp"
+
+using namespace std;
+using namespace psumo;
+
+// No shared memory on Windows, see ShmLink.hpp
+#ifdef USING_WIN
+#define BENCH_TRANSPORTS "tcp,inproc"
+#define BENCH_BARRIERS "central,tree,dissemination"
+#else
+#define BENCH_TRANSPORTS "ipc,tcp,shm,inproc"
+#define BENCH_BARRIERS "central,tree,dissemination,shm"
+#endif
+
+typedef struct {
+    double mean;
+    double p50;
+    double p99;
+} latency_stats_t;
+
+static latency_stats_t getStats(vector<double>& samples) {
+    sort(samples.begin(), samples.end());
+    double sum = 0;
+    for (double sample : samples) sum += sample;
+    return {
+        sum / samples.size(),
+        samples[samples.size() / 2],
+        samples[min(samples.size() - 1, samples.size() * 99 / 100)],
+    };
+}
+
+static double elapsedMicros(chrono::steady_clock::time_point start) {
+    return chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+}
+
+// Reply to requests with the same message until woken up
+static void echoServer(ServerTransport* server) {
+    while (true) {
+        auto event = server->poll(true, true);
+        TransportMessage message;
+        if (event == ServerTransport::REQUEST) {
+            server->receiveRequest(message);
+            server->sendReply(message);
+        } else if (event == ServerTransport::ASYNC) {
+            server->receiveAsync(message);
+        } else if (event == ServerTransport::WAKE) {
+            return;
+        }
+    }
+}
+
+static latency_stats_t benchRoundTrip(TransportType type, zmq::context_t& zcontext,
+    const string& dataDir, int iterations, int messageSize
+) {
+    // Closed before the barrier benchmark starts, so the ids can overlap
+    const partId_t clientId = 0, serverId = 1;
+    auto server = makeServerTransport(type, zcontext, dataDir, LOCAL_HOST, clientId, serverId, 2);
+    auto client = makeClientTransport(type, zcontext, dataDir, LOCAL_HOST, clientId, serverId, 2);
+    server->bind();
+    client->connect();
+    thread serverThread(echoServer, server);
+
+    vector<double> samples;
+    samples.reserve(iterations);
+    // First tenth is warmup
+    for (int i = -iterations / 10; i < iterations; i++) {
+        TransportMessage request(messageSize);
+        TransportMessage reply;
+        auto start = chrono::steady_clock::now();
+        client->sendRequest(request);
+        client->receiveReply(reply);
+        if (i >= 0) samples.push_back(elapsedMicros(start));
+    }
+
+    server->wake("stop");
+    serverThread.join();
+    client->disconnect();
+    server->close();
+    delete client;
+    delete server;
+
+    return getStats(samples);
+}
+
+// Same as the partitions synchronizing through the coordinator: each client
+// sends a request, the coordinator replies to all once every request arrived
+static latency_stats_t benchBarrier(TransportType type, zmq::context_t& zcontext,
+    const string& dataDir, int iterations, int numClients
+) {
+    const partId_t coordinatorId = numClients;
+    vector<ServerTransport*> servers;
+    vector<ClientTransport*> clients;
+    for (partId_t i = 0; i < numClients; i++) {
+        servers.push_back(makeServerTransport(type, zcontext, dataDir, LOCAL_HOST, i, coordinatorId, numClients + 1));
+        clients.push_back(makeClientTransport(type, zcontext, dataDir, LOCAL_HOST, i, coordinatorId, numClients + 1));
+        servers[i]->bind();
+        clients[i]->connect();
+    }
+
+    const int warmup = iterations / 10;
+    thread coordinatorThread([&] {
+        for (int round = 0; round < warmup + iterations; round++) {
+            for (auto server : servers) {
+                while (server->poll(false, true) != ServerTransport::REQUEST);
+                TransportMessage request;
+                server->receiveRequest(request);
+            }
+            for (auto server : servers) {
+                TransportMessage reply("ok", 2);
+                server->sendReply(reply);
+            }
+        }
+    });
+
+    vector<double> samples;
+    samples.reserve(iterations);
+    vector<thread> clientThreads;
+    for (int i = 0; i < numClients; i++) {
+        clientThreads.emplace_back([&, i] {
+            for (int round = 0; round < warmup + iterations; round++) {
+                TransportMessage request(sizeof(int));
+                TransportMessage reply;
+                auto start = chrono::steady_clock::now();
+                clients[i]->sendRequest(request);
+                clients[i]->receiveReply(reply);
+                // Time from the first client only, all leave the barrier at the same time
+                if (i == 0 && round >= warmup) samples.push_back(elapsedMicros(start));
+            }
+        });
+    }
+
+    for (auto& clientThread : clientThreads) clientThread.join();
+    coordinatorThread.join();
+
+    for (int i = 0; i < numClients; i++) {
+        clients[i]->disconnect();
+        servers[i]->close();
+        delete clients[i];
+        delete servers[i];
+    }
+
+    return getStats(samples);
+}
+
+// The coordinator side of the central barrier, as in ParallelSim::coordinatePartitionsSync
+static void barrierCoordinator(vector<zmq::socket_t*>& sockets, int rounds) {
+    vector<zmq::pollitem_t> pollitems(sockets.size());
+    for (size_t i = 0; i < sockets.size(); i++) {
+        pollitems[i] = { castPollSocket(*sockets[i]), 0, ZMQ_POLLIN, 0 };
+    }
+    for (int round = 0; round < rounds; round++) {
+        size_t arrived = 0;
+        bool all = true;
+        while (arrived < sockets.size()) {
+            zmq::poll(pollitems);
+            for (size_t i = 0; i < sockets.size(); i++) {
+                if (!(pollitems[i].revents & ZMQ_POLLIN)) continue;
+                zmq::message_t message;
+                [[maybe_unused]] auto _ = sockets[i]->recv(message, zmq::recv_flags::none);
+                MessageReader reader(message, sizeof(int));
+                all = all && reader.read<bool>();
+                arrived++;
+            }
+        }
+        for (auto socket : sockets) {
+            zmq::message_t reply(sizeof(bool));
+            std::memcpy(reply.data(), &all, sizeof(bool));
+            socket->send(reply, zmq::send_flags::none);
+        }
+    }
+}
+
+// Step overhead of a barrier with numParts partitions all arriving together,
+// as in global sync mode; also checks the flags are combined correctly
+static latency_stats_t benchStepBarrier(BarrierType type, TransportType transport, zmq::context_t& zcontext,
+    const string& dataDir, int iterations, int numParts, int spinMicros
+) {
+    const int warmup = iterations / 10;
+    vector<zmq::socket_t*> coordinatorSockets, partitionSockets;
+    vector<StepBarrier*> barriers;
+    for (partId_t i = 0; i < numParts; i++) {
+        if (type == BarrierType::CENTRAL) {
+            coordinatorSockets.push_back(makeSocket(zcontext, zmq::socket_type::rep));
+            coordinatorSockets[i]->bind(getSyncSocketId(dataDir, LOCAL_HOST, i, transport));
+        }
+        partitionSockets.push_back(makeSocket(zcontext, zmq::socket_type::req));
+        barriers.push_back(makeStepBarrier(type, zcontext, *partitionSockets[i], dataDir, {}, i, numParts, transport, spinMicros));
+        barriers[i]->bind();
+    }
+    for (partId_t i = 0; i < numParts; i++) {
+        if (type == BarrierType::CENTRAL) partitionSockets[i]->connect(getSyncSocketId(dataDir, LOCAL_HOST, i, transport));
+        barriers[i]->connect();
+    }
+
+    thread coordinatorThread;
+    if (type == BarrierType::CENTRAL) {
+        coordinatorThread = thread(barrierCoordinator, ref(coordinatorSockets), warmup + iterations);
+    }
+
+    vector<double> samples;
+    samples.reserve(iterations);
+    vector<thread> partitionThreads;
+    for (int i = 0; i < numParts; i++) {
+        partitionThreads.emplace_back([&, i] {
+            for (int round = 0; round < warmup + iterations; round++) {
+                // Only the last partition is not empty in odd rounds
+                bool expected = round % 2 == 0;
+                auto start = chrono::steady_clock::now();
+                bool all = barriers[i]->arriveAndWait(expected || i != numParts - 1);
+                if (i == 0 && round >= warmup) samples.push_back(elapsedMicros(start));
+                if (all != expected) {
+                    cerr << format("Barrier combined flags wrong: partition {} round {}\n", i, round);
+                    exit(EXIT_FAILURE);
+                }
+            }
+        });
+    }
+
+    for (auto& partitionThread : partitionThreads) partitionThread.join();
+    if (coordinatorThread.joinable()) coordinatorThread.join();
+
+    for (int i = 0; i < numParts; i++) {
+        barriers[i]->close();
+        delete barriers[i];
+        delete partitionSockets[i];
+    }
+    for (auto socket : coordinatorSockets) delete socket;
+
+    return getStats(samples);
+}
+
+int main(int argc, char* argv[]) {
+    argparse::ArgumentParser program(PROGRAM_NAME_BENCH, PROGRAM_VER);
+    program.add_description("Measure the latency of the transports used between partitions");
+    program.add_argument("--transports")
+        .help("Transports to measure, comma separated")
+        .default_value(BENCH_TRANSPORTS);
+    program.add_argument("-i", "--iterations")
+        .help("Round trips and barriers to time for each transport")
+        .default_value(10000)
+        .scan<'i', int>();
+    program.add_argument("-N", "--num-threads")
+        .help("Partitions taking part in the barrier")
+        .default_value(4)
+        .scan<'i', int>();
+    program.add_argument("--msg-size")
+        .help("Size in bytes of the round trip messages")
+        .default_value(64)
+        .scan<'i', int>();
+    program.add_argument("--barriers")
+        .help("Step barriers to measure, comma separated")
+        .default_value(BENCH_BARRIERS);
+    program.add_argument("--barrier-sizes")
+        .help("Partition counts to measure the step barriers with, comma separated")
+        .default_value("4,16,64");
+    program.add_argument("--barrier-transport")
+        .help("Socket type for the step barriers that use sockets, ipc or tcp")
+        .default_value("ipc");
+    program.add_argument("--barrier-spin")
+        .help("Microseconds the shm barrier spins before sleeping")
+        .default_value(50)
+        .scan<'i', int>();
+    program.add_argument("--barrier-iterations")
+        .help("Steps to time for each step barrier and partition count")
+        .default_value(2000)
+        .scan<'i', int>();
+    program.add_argument("--data-dir")
+        .help("Data directory to store the ipc sockets and shared memory files in")
+        .default_value("data");
+
+    try {
+        program.parse_args(argc, argv);
+    } catch (const std::exception& err) {
+        std::cerr << err.what() << std::endl;
+        std::cerr << program << std::endl;
+        std::exit(1);
+    }
+
+    int iterations = program.get<int>("--iterations");
+    int numClients = program.get<int>("--num-threads");
+    int messageSize = program.get<int>("--msg-size");
+    string dataDir = program.get<string>("--data-dir");
+    filesystem::create_directories(filesystem::path(dataDir) / "sockets");
+
+    vector<pair<string, TransportType>> transports;
+    stringstream names(program.get<string>("--transports"));
+    string name;
+    while (getline(names, name, ',')) {
+        if (name == "ipc") transports.push_back({name, TransportType::IPC});
+        else if (name == "tcp") transports.push_back({name, TransportType::TCP});
+        #ifndef USING_WIN
+        else if (name == "shm") transports.push_back({name, TransportType::SHM});
+        #endif
+        else if (name == "inproc") transports.push_back({name, TransportType::INPROC});
+        else {
+            cerr << "Unknown transport " << name << endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Shared by all, as inproc only works within the same context
+    zmq::context_t zcontext;
+
+    cout << format("Latency in microseconds, {} iterations, {}B round trip messages, barrier with {} partitions\n",
+        iterations, messageSize, numClients);
+    cout << format("{:<8} {:>12} {:>12} {:>12} {:>12} {:>12} {:>12}\n",
+        "", "rtt mean", "rtt p50", "rtt p99", "barrier mean", "barrier p50", "barrier p99");
+    for (auto& [name, type] : transports) {
+        auto roundTrip = benchRoundTrip(type, zcontext, dataDir, iterations, messageSize);
+        auto barrier = benchBarrier(type, zcontext, dataDir, iterations, numClients);
+        cout << format("{:<8} {:>12.2f} {:>12.2f} {:>12.2f} {:>12.2f} {:>12.2f} {:>12.2f}\n",
+            name, roundTrip.mean, roundTrip.p50, roundTrip.p99, barrier.mean, barrier.p50, barrier.p99);
+    }
+
+    string barrierTransportName = program.get<string>("--barrier-transport");
+    TransportType barrierTransport;
+    if (barrierTransportName == "ipc") barrierTransport = TransportType::IPC;
+    else if (barrierTransportName == "tcp") barrierTransport = TransportType::TCP;
+    else {
+        cerr << "Unknown barrier transport " << barrierTransportName << endl;
+        exit(EXIT_FAILURE);
+    }
+    int barrierIterations = program.get<int>("--barrier-iterations");
+    int barrierSpin = program.get<int>("--barrier-spin");
+
+    vector<int> sizes;
+    stringstream sizeNames(program.get<string>("--barrier-sizes"));
+    while (getline(sizeNames, name, ',')) sizes.push_back(stoi(name));
+
+    cout << format("\nStep barrier latency in microseconds, {} iterations, {} sockets\n",
+        barrierIterations, barrierTransportName);
+    cout << format("{:<14} {:>6} {:>12} {:>12} {:>12}\n", "", "N", "mean", "p50", "p99");
+    stringstream barrierNames(program.get<string>("--barriers"));
+    while (getline(barrierNames, name, ',')) {
+        BarrierType type;
+        if (name == "central") type = BarrierType::CENTRAL;
+        else if (name == "tree") type = BarrierType::TREE;
+        else if (name == "dissemination") type = BarrierType::DISSEMINATION;
+        #ifndef USING_WIN
+        else if (name == "shm") type = BarrierType::SHM;
+        #endif
+        else {
+            cerr << "Unknown barrier " << name << endl;
+            exit(EXIT_FAILURE);
+        }
+        for (int size : sizes) {
+            auto stats = benchStepBarrier(type, barrierTransport, zcontext, dataDir, barrierIterations, size, barrierSpin);
+            cout << format("{:<14} {:>6} {:>12.2f} {:>12.2f} {:>12.2f}\n", name, size, stats.mean, stats.p50, stats.p99);
+        }
+    }
+}
@@ -127,9 +127,9 @@ string getSumoPath(bool gui) {
     }
 }
 
-filesystem::path getPartitionDataFile(string dataFolder, int partId) {
+filesystem::path getPartitionDataFile(string dataFolder, int partId, string extension) {
     stringstream fname;
-    fname << "partData" << partId << ".json";
+    fname << "partData" << partId << extension;
     return filesystem::path(dataFolder) / fname.str();
 }
 
@@ -46,7 +46,7 @@ namespace psumo {
     std::filesystem::path getCurrentExeDirectory();
 
     std::string getSumoPath(bool gui);
-    std::filesystem::path getPartitionDataFile(std::string dataFolder, int partId);
+    std::filesystem::path getPartitionDataFile(std::string dataFolder, int partId, std::string extension = ".json");
 
     inline std::string boolToString(bool x) { return x ? "true" : "false"; }
 }